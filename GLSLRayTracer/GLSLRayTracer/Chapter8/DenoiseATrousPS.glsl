@@ -0,0 +1,85 @@
+#version 330 core
+in vec2 screenCoord;
+
+uniform sampler2D illuminationMap;	// rgb lighting, a = luminance variance
+uniform sampler2D normalDepthMap;	// first hit normal, w = distance or 0 for escaped rays
+uniform int stepSize;				// 1, 2, 4, ... over the iterations
+
+uniform float sigmaLuminance;
+uniform float sigmaNormal;
+uniform float sigmaDepth;
+
+out vec4 FragColor;
+
+float Luminance(vec3 c)
+{
+	return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// One iteration of the edge-avoiding a-trous wavelet filter: a 5x5 B3 spline
+// kernel with holes of stepSize, weighted down across normal and depth edges
+// and across luminance differences large for the pixel's variance. The
+// variance is filtered along, so later iterations trust the lighting more.
+void main()
+{
+	const float kernel[3] = float[3](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(illuminationMap, 0);
+	vec4 center = texelFetch(illuminationMap, pixel, 0);
+	vec4 normalDepth = texelFetch(normalDepthMap, pixel, 0);
+
+	// the environment is not noisy
+	if(normalDepth.w == 0.0)
+	{
+		FragColor = center;
+		return;
+	}
+
+	// the variance itself is noisy, a 3x3 gaussian steadies the edge stopping
+	float variance = 0.0;
+	for(int y=-1; y<=1; y++)
+	{
+		for(int x=-1; x<=1; x++)
+		{
+			ivec2 q = clamp(pixel + ivec2(x, y), ivec2(0), size - 1);
+			variance += texelFetch(illuminationMap, q, 0).a * (x == 0 ? 0.5 : 0.25) * (y == 0 ? 0.5 : 0.25);
+		}
+	}
+
+	float luminance = Luminance(center.xyz);
+	float phiLuminance = sigmaLuminance * sqrt(variance) + 1e-6;
+
+	float centerWeight = kernel[0] * kernel[0];
+	vec3 sumColor = center.xyz * centerWeight;
+	float sumVariance = center.a * centerWeight * centerWeight;
+	float sumWeight = centerWeight;
+	for(int y=-2; y<=2; y++)
+	{
+		for(int x=-2; x<=2; x++)
+		{
+			if(x == 0 && y == 0)
+				continue;
+
+			ivec2 q = pixel + ivec2(x, y) * stepSize;
+			if(any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)))
+				continue;
+
+			vec4 normalDepthQ = texelFetch(normalDepthMap, q, 0);
+			if(normalDepthQ.w == 0.0)
+				continue;
+
+			vec4 neighbour = texelFetch(illuminationMap, q, 0);
+			float weightNormal = pow(max(dot(normalDepth.xyz, normalDepthQ.xyz), 0.0), sigmaNormal);
+			float weightDepth = exp(-abs(normalDepth.w - normalDepthQ.w) / (sigmaDepth * normalDepth.w * float(stepSize) * length(vec2(x, y)) + 1e-6));
+			float weightLuminance = exp(-abs(luminance - Luminance(neighbour.xyz)) / phiLuminance);
+
+			float weight = kernel[abs(x)] * kernel[abs(y)] * weightNormal * weightDepth * weightLuminance;
+			sumColor += neighbour.xyz * weight;
+			sumVariance += neighbour.a * weight * weight;
+			sumWeight += weight;
+		}
+	}
+
+	FragColor = vec4(sumColor / sumWeight, sumVariance / (sumWeight * sumWeight));
+}
@@ -0,0 +1,54 @@
+#version 330 core
+in vec2 screenCoord;
+
+uniform sampler2D colorMap;			// path traced radiance
+uniform sampler2D albedoMap;		// first hit albedo
+uniform sampler2D normalDepthMap;	// first hit normal, w = distance or 0 for escaped rays
+
+out vec4 FragColor;					// radiance divided by albedo, a = luminance variance
+
+float Luminance(vec3 c)
+{
+	return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Splits the albedo off so the filter only blurs lighting, and estimates the
+// variance of the lighting from the moments of its surface's neighbours, as
+// a frame on its own has too few samples to estimate it per pixel.
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(colorMap, 0);
+	vec4 normalDepth = texelFetch(normalDepthMap, pixel, 0);
+	vec3 illumination = texelFetch(colorMap, pixel, 0).xyz / max(texelFetch(albedoMap, pixel, 0).xyz, vec3(0.001));
+
+	if(normalDepth.w == 0.0)
+	{
+		FragColor = vec4(illumination, 0.0);
+		return;
+	}
+
+	float sumWeight = 0.0;
+	vec2 moments = vec2(0.0);
+	for(int y=-2; y<=2; y++)
+	{
+		for(int x=-2; x<=2; x++)
+		{
+			ivec2 q = pixel + ivec2(x, y);
+			if(any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)))
+				continue;
+
+			vec4 normalDepthQ = texelFetch(normalDepthMap, q, 0);
+			if(normalDepthQ.w == 0.0)
+				continue;
+
+			float weight = pow(max(dot(normalDepth.xyz, normalDepthQ.xyz), 0.0), 32.0) * exp(-abs(normalDepth.w - normalDepthQ.w) / (0.05 * normalDepth.w));
+			float l = Luminance(texelFetch(colorMap, q, 0).xyz / max(texelFetch(albedoMap, q, 0).xyz, vec3(0.001)));
+			moments += weight * vec2(l, l * l);
+			sumWeight += weight;
+		}
+	}
+	moments /= max(sumWeight, 1e-6);
+
+	FragColor = vec4(illumination, max(moments.y - moments.x * moments.x, 0.0));
+}
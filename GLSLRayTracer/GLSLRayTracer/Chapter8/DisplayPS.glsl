@@ -0,0 +1,14 @@
+#version 330 core
+in vec2 screenCoord;
+
+uniform sampler2D colorMap;
+
+out vec4 FragColor;
+
+#include "Tonemap.glsl"
+
+void main()
+{
+	FragColor.xyz = Tonemap(texelFetch(colorMap, ivec2(gl_FragCoord.xy), 0).xyz);
+	FragColor.w = 1.0;
+}
@@ -0,0 +1,150 @@
+///////////////////////////////////////////////////////////////////////////////
+struct Ray {
+    vec3 origin;
+    vec3 direction;
+}; 
+
+struct Camera 
+{
+    vec3 lower_left_corner;
+    vec3 horizontal;
+	vec3 vertical;
+	vec3 origin;
+}; 
+
+struct Sphere 
+{
+    vec3 center;
+    float radius;
+	int material;		// index into the material table
+}; 
+
+struct HitRecord
+{
+	float t;
+	vec3 position;
+	vec3 normal;
+	
+	int material;
+};
+
+struct World
+{
+	int objectCount;
+	Sphere objects[10];
+};
+
+
+//////////////////////////////////////////////-//////////////////////////////////////
+Ray RayConstructor(vec3 origin, vec3 direction)
+{
+	Ray ray;
+	ray.origin = origin;
+	ray.direction = direction;
+
+	return ray;
+}
+
+vec3 RayGetPointAt(Ray ray, float t)
+{
+	return ray.origin + t * ray.direction;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+Camera CameraConstructor(vec3 lower_left_corner, vec3 horizontal, vec3 vertical, vec3 origin)
+{
+	Camera camera;
+
+	camera.origin = origin;
+	camera.lower_left_corner = lower_left_corner;
+	camera.horizontal = horizontal;
+	camera.vertical = vertical;
+
+	return camera;
+}
+
+Camera CameraSet(vec3 eye, vec3 target, vec3 up, float vfov, float aspect)
+{
+	Camera camera;
+
+	float halfHeight = tan(vfov * PI / 180.0 / 2.0);
+	float halfWidth = halfHeight * aspect;
+
+	// right hand
+	vec3 zAxis = normalize(eye - target);
+	vec3 xAxis = normalize(cross(up, zAxis));
+	vec3 yAxis = normalize(cross(zAxis, xAxis));
+
+	camera.origin = eye;
+	camera.horizontal = (2.0 * halfWidth) * xAxis;
+	camera.vertical = (2.0 * halfHeight) * yAxis;
+	camera.lower_left_corner = camera.origin - camera.horizontal / 2.0 - camera.vertical / 2.0 - zAxis;
+
+	return camera;
+}
+
+Ray CameraGetRay(Camera camera, vec2 uv)
+{
+	Ray ray = RayConstructor(camera.origin, 
+		camera.lower_left_corner + uv.x * camera.horizontal + uv.y * camera.vertical - camera.origin);
+
+	return ray;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// latitude and longitude of a point on a sphere from its outward normal, laid
+// out like the environment map
+vec2 SphereGetUV(vec3 normal)
+{
+	return vec2(atan(normal.x, normal.z) / (2.0 * PI) + 0.5, acos(clamp(normal.y, -1.0, 1.0)) / PI);
+}
+
+Sphere SphereConstructor(vec3 center, float radius, int material)
+{
+	Sphere sphere;
+
+	sphere.center = center;
+	sphere.radius = radius;
+	sphere.material = material;
+
+	return sphere;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+bool SphereHit(Sphere sphere, Ray ray, float t_min, float t_max, inout HitRecord hitRecord)
+{
+	vec3 oc = ray.origin - sphere.center;
+	
+	float a = dot(ray.direction, ray.direction);
+	float b = dot(oc, ray.direction);
+	float c = dot(oc, oc) - sphere.radius * sphere.radius;
+
+	float discriminant = b * b - a * c;
+	if(discriminant>0)
+	{
+		float temp = (-b - sqrt(discriminant)) / a;
+		if(temp < t_max && temp> t_min)
+		{
+			hitRecord.t = temp;
+			hitRecord.position = RayGetPointAt(ray, hitRecord.t);
+			hitRecord.normal = (hitRecord.position - sphere.center) / sphere.radius;
+			
+			hitRecord.material = sphere.material;
+			return true;
+		}
+
+		temp = (-b + sqrt(discriminant)) / a;
+		if(temp < t_max && temp> t_min)
+		{
+			hitRecord.t = temp;
+			hitRecord.position = RayGetPointAt(ray, hitRecord.t);
+			hitRecord.normal = (hitRecord.position - sphere.center) / sphere.radius;
+
+			hitRecord.material = sphere.material;
+			
+			return true;
+		}
+	}
+	
+	return false;
+}
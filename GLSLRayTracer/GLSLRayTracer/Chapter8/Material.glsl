@@ -0,0 +1,338 @@
+////////////////////////////////////////////////////////////////////////////////////
+#define MAT_LAMBERTIAN		0
+#define MAT_METALLIC	1
+#define MAT_DIELECTRIC	2
+#define MAT_PBR			3
+
+// below this GGX alpha a surface is a perfect mirror or refractor
+#define MIN_GGX_ALPHA	0.001
+
+// A program specialized for a scene defines HAS_MAT_* for the material types it
+// uses, the others are compiled out. Without any of them every type is built.
+#if !defined(HAS_MAT_LAMBERTIAN) && !defined(HAS_MAT_METALLIC) && !defined(HAS_MAT_DIELECTRIC)
+#define HAS_MAT_LAMBERTIAN
+#define HAS_MAT_METALLIC
+#define HAS_MAT_DIELECTRIC
+#endif
+
+#ifdef HAS_MAT_LAMBERTIAN
+
+struct Lambertian
+{
+	vec3 albedo;
+};
+
+Lambertian LambertianConstructor(vec3 albedo)
+{
+	Lambertian lambertian;
+
+	lambertian.albedo = albedo;
+
+	return lambertian;
+}
+
+bool LambertianScatter(in Lambertian lambertian, in Ray incident, in HitRecord hitRecord, out Ray scattered, out vec3 attenuation)
+{
+	attenuation = lambertian.albedo;
+
+	// cosine weighted, so the cosine over the pdf cancels the 1 / PI of the BRDF
+	scattered.origin = hitRecord.position;
+	scattered.direction = LocalToWorld(SampleCosineHemisphere(rand2()), hitRecord.normal);
+
+	return true;
+}
+#endif
+
+#ifdef HAS_MAT_METALLIC
+struct Metallic
+{
+	vec3 albedo;
+	float roughness;
+};
+
+Metallic MetallicConstructor(vec3 albedo, float roughness)
+{
+	Metallic metallic;
+
+	metallic.albedo = albedo;
+	metallic.roughness = roughness;
+
+	return metallic;
+}
+#endif
+
+float schlick(float cosine, float ior)
+{
+	float r0 = (1 - ior) / (1 + ior);
+	r0 = r0 * r0;
+	return r0 + (1 - r0) * pow((1 - cosine), 5);
+}
+
+vec3 reflect(in vec3 incident, in vec3 normal)
+{
+	return incident - 2 * dot(normal, incident) * normal;
+}
+
+vec3 FresnelSchlick(vec3 f0, float cosine)
+{
+	return f0 + (vec3(1.0) - f0) * pow(1.0 - clamp(cosine, 0.0, 1.0), 5.0);
+}
+
+// unpolarized reflectance of a dielectric boundary, 1 on total internal reflection
+float FresnelDielectric(float cosine, float ni_over_nt)
+{
+	float sin2T = ni_over_nt * ni_over_nt * (1.0 - cosine * cosine);
+	if(sin2T >= 1.0)
+		return 1.0;
+
+	float cosT = sqrt(1.0 - sin2T);
+	float rs = (ni_over_nt * cosine - cosT) / (ni_over_nt * cosine + cosT);
+	float rp = (cosine - ni_over_nt * cosT) / (cosine + ni_over_nt * cosT);
+	return 0.5 * (rs * rs + rp * rp);
+}
+
+bool refract(vec3 v, vec3 n, float ni_over_nt, out vec3 refracted)
+{
+	vec3 uv = normalize(v);
+	float dt = dot(uv, n);
+	float discriminant = 1.0 - ni_over_nt * ni_over_nt * (1.0 - dt * dt);
+	if (discriminant > 0)
+	{
+		refracted = ni_over_nt * (uv - n * dt) - n * sqrt(discriminant);
+		return true;
+	}
+	else
+		return false;
+}
+
+#ifdef HAS_MAT_METALLIC
+// GGX conductor with alpha = roughness^2 and the albedo as Schlick's F0. The
+// normal is drawn from the visible normals, which leaves the Fresnel term
+// times G2 / G1 as the weight of the reflection.
+bool MetallicScatter(in Metallic metallic, in Ray incident, in HitRecord hitRecord, out Ray scattered, out vec3 attenuation)
+{
+	attenuation = vec3(0.0);
+	scattered.origin = hitRecord.position;
+	scattered.direction = hitRecord.normal;
+
+	vec3 wo = WorldToLocal(-normalize(incident.direction), hitRecord.normal);
+	if(wo.z <= 0.0)
+		return false;
+
+	float alpha = metallic.roughness * metallic.roughness;
+	bool rough = alpha >= MIN_GGX_ALPHA;
+	vec3 h = rough ? SampleGGXVNDF(wo, alpha, rand2()) : vec3(0.0, 0.0, 1.0);
+	vec3 wi = reflect(-wo, h);
+	if(wi.z <= 0.0)
+		return false;
+
+	float weight = rough ? GGXG2(wo, wi, alpha) / GGXG1(wo, alpha) : 1.0;
+	attenuation = FresnelSchlick(metallic.albedo, dot(wo, h)) * weight;
+	scattered.direction = LocalToWorld(wi, hitRecord.normal);
+
+	return true;
+}
+#endif
+
+#ifdef HAS_MAT_DIELECTRIC
+struct Dielectric
+{
+	vec3 albedo;
+	float roughness;
+	float ior;
+};
+
+Dielectric DielectricConstructor(vec3 albedo, float roughness, float ior)
+{
+	Dielectric dielectric;
+
+	dielectric.albedo = albedo;
+	dielectric.roughness = roughness;
+	dielectric.ior = ior;
+
+	return dielectric;
+}
+
+bool DielectricScatter1(in Dielectric dielectric, in Ray incident, in HitRecord hitRecord, out Ray scattered, out vec3 attenuation)
+{
+	attenuation = dielectric.albedo;
+	vec3 reflected = reflect(incident.direction, hitRecord.normal);
+
+	vec3 outward_normal;
+	float ni_over_nt;
+	if(dot(incident.direction, hitRecord.normal) > 0.0)// hit from inside
+	{
+		outward_normal = -hitRecord.normal;
+		ni_over_nt = dielectric.ior;
+	}
+	else // hit from outside
+	{
+		outward_normal = hitRecord.normal;
+		ni_over_nt = 1.0 / dielectric.ior;
+	}
+
+	vec3 refracted;
+	if(refract(incident.direction, outward_normal, ni_over_nt, refracted))
+	{
+		scattered = Ray(hitRecord.position, refracted);
+
+		return true;
+	}
+	else
+	{
+		scattered = Ray(hitRecord.position, reflected);
+
+		return false;
+	}
+}
+
+bool DielectricScatter2(in Dielectric dielectric, in Ray incident, in HitRecord hitRecord, out Ray scattered, out vec3 attenuation)
+{
+	attenuation = dielectric.albedo;
+	vec3 reflected = reflect(incident.direction, hitRecord.normal);
+
+	vec3 outward_normal;
+	float ni_over_nt;
+	float cosine;
+	if(dot(incident.direction, hitRecord.normal) > 0.0)// hit from inside
+	{
+		outward_normal = -hitRecord.normal;
+		ni_over_nt = dielectric.ior;
+		cosine = dot(incident.direction, hitRecord.normal) / length(incident.direction); // incident angle
+	}
+	else // hit from outside
+	{
+		outward_normal = hitRecord.normal;
+		ni_over_nt = 1.0 / dielectric.ior;
+		cosine = -dot(incident.direction, hitRecord.normal) / length(incident.direction); // incident angle
+	}
+
+	float reflect_prob;
+	vec3 refracted;
+	if(refract(incident.direction, outward_normal, ni_over_nt, refracted))
+	{
+		reflect_prob = schlick(cosine, dielectric.ior);
+	}
+	else
+	{
+		reflect_prob = 1.0;
+	}
+
+	if(rand() < reflect_prob)
+	{
+		scattered = Ray(hitRecord.position, refracted);
+	}
+	else
+	{
+		scattered = Ray(hitRecord.position, refracted);
+	}
+
+	return true;
+}
+
+// rough dielectric after Walter et al. 2007. A visible normal is drawn, then
+// reflection or refraction about it with the Fresnel reflectance as the
+// probability, which leaves G2 / G1 as the weight of either.
+bool DielectricScatterGGX(in Dielectric dielectric, in Ray incident, in HitRecord hitRecord, out Ray scattered, out vec3 attenuation)
+{
+	attenuation = vec3(0.0);
+	scattered.origin = hitRecord.position;
+	scattered.direction = hitRecord.normal;
+
+	vec3 direction = normalize(incident.direction);
+	bool inside = dot(direction, hitRecord.normal) > 0.0;
+	vec3 normal = inside ? -hitRecord.normal : hitRecord.normal;
+	float ni_over_nt = inside ? dielectric.ior : 1.0 / dielectric.ior;
+
+	vec3 wo = WorldToLocal(-direction, normal);
+	float alpha = dielectric.roughness * dielectric.roughness;
+	bool rough = alpha >= MIN_GGX_ALPHA;
+	vec3 h = rough ? SampleGGXVNDF(wo, alpha, rand2()) : vec3(0.0, 0.0, 1.0);
+
+	vec3 wi;
+	float cosine = dot(wo, h);
+	if(rand() < FresnelDielectric(cosine, ni_over_nt))
+	{
+		wi = reflect(-wo, h);
+		if(wi.z <= 0.0)
+			return false;
+	}
+	else
+	{
+		if(!refract(-wo, h, ni_over_nt, wi) || wi.z >= 0.0)
+			return false;
+	}
+
+	float weight = rough ? GGXG2(wo, wi, alpha) / GGXG1(wo, alpha) : 1.0;
+	attenuation = dielectric.albedo * weight;
+	scattered.direction = LocalToWorld(wi, normal);
+
+	return true;
+}
+
+bool DielectricScatter(in Dielectric dielectric, in Ray incident, in HitRecord hitRecord, out Ray scattered, out vec3 attenuation)
+{
+	//return DielectricScatter1(dielectric, incident, hitRecord, scattered, attenuation);
+	//return DielectricScatter2(dielectric, incident, hitRecord, scattered, attenuation);
+	return DielectricScatterGGX(dielectric, incident, hitRecord, scattered, attenuation);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////
+// Every material of the scene is one RGBA32UI texel of the material table, built
+// on the C++ side:
+// x = type in the low 8 bits, texture layer + 1 above them (0 for none)
+// y = albedo red and green, z = albedo blue and roughness, as 16 bit unorms
+// w = index of refraction as float bits
+uniform usamplerBuffer materials;
+uniform sampler2DArray materialTextures; // a layer per texture id, white while loading
+
+struct Material
+{
+	int type;
+	vec3 albedo;
+	float roughness;
+	float ior;
+	int textureId;		// -1 for none
+};
+
+Material MaterialFetch(int index)
+{
+	uvec4 record = texelFetch(materials, index);
+
+	Material material;
+	material.type = int(record.x & 0xffu);
+	material.textureId = int(record.x >> 8) - 1;
+	material.albedo = vec3(float(record.y & 0xffffu), float(record.y >> 16), float(record.z & 0xffffu)) / 65535.0;
+	material.roughness = float(record.z >> 16) / 65535.0;
+	material.ior = uintBitsToFloat(record.w);
+
+	return material;
+}
+
+// level 0 only, there are no useful derivatives inside the path loop
+vec3 MaterialTextureColor(in Material material, in HitRecord hitRecord)
+{
+	if(material.textureId < 0)
+		return vec3(1.0, 1.0, 1.0);
+
+	return textureLod(materialTextures, vec3(SphereGetUV(hitRecord.normal), float(material.textureId)), 0.0).xyz;
+}
+
+bool MaterialScatter(in Material material, in Ray incident, in HitRecord hitRecord, out Ray scattered, out vec3 attenuation)
+{
+#ifdef HAS_MAT_LAMBERTIAN
+	if(material.type==MAT_LAMBERTIAN)
+		return LambertianScatter(LambertianConstructor(material.albedo), incident, hitRecord, scattered, attenuation);
+#endif
+#ifdef HAS_MAT_METALLIC
+	if(material.type==MAT_METALLIC)
+		return MetallicScatter(MetallicConstructor(material.albedo, material.roughness), incident, hitRecord, scattered, attenuation);
+#endif
+#ifdef HAS_MAT_DIELECTRIC
+	if(material.type==MAT_DIELECTRIC)
+		return DielectricScatter(DielectricConstructor(material.albedo, material.roughness, material.ior), incident, hitRecord, scattered, attenuation);
+#endif
+
+	return false;
+}
@@ -0,0 +1,51 @@
+///////////////////////////////////////////////////////////////////////////////
+// Precomputed environment lighting for the preview program, see the C++
+// LightingCache. A path ends at its first diffuse or glossy hit, lit by the
+// environment alone: no shadows and no light between objects, which is enough
+// to lay a scene out. Dielectrics are still traced through.
+#ifdef PREVIEW_LIGHTING
+
+uniform vec3 shIrradiance[9];		// L2 SH of the irradiance over PI, the light a white Lambertian reflects
+uniform sampler2D prefilteredEnv;	// GGX prefiltered, SphereGetUV layout, lod = roughness * (levels - 1)
+uniform float prefilteredLevels;
+
+vec3 PreviewDiffuse(vec3 n)
+{
+	vec3 color = shIrradiance[0] * 0.282095;
+	color += shIrradiance[1] * (0.488603 * n.y);
+	color += shIrradiance[2] * (0.488603 * n.z);
+	color += shIrradiance[3] * (0.488603 * n.x);
+	color += shIrradiance[4] * (1.092548 * n.x * n.y);
+	color += shIrradiance[5] * (1.092548 * n.y * n.z);
+	color += shIrradiance[6] * (0.315392 * (3.0 * n.z * n.z - 1.0));
+	color += shIrradiance[7] * (1.092548 * n.x * n.z);
+	color += shIrradiance[8] * (0.546274 * (n.x * n.x - n.y * n.y));
+
+	return max(color, vec3(0.0));
+}
+
+vec3 PreviewSpecular(vec3 dir, float roughness)
+{
+	return textureLod(prefilteredEnv, SphereGetUV(dir), roughness * (prefilteredLevels - 1.0)).xyz;
+}
+
+// the light leaving the hit along the incident ray, false to keep tracing
+bool PreviewShade(in Material material, in Ray incident, in HitRecord hitRecord, out vec3 color)
+{
+	color = vec3(0.0);
+	if(material.type==MAT_LAMBERTIAN)
+	{
+		color = material.albedo * PreviewDiffuse(hitRecord.normal);
+		return true;
+	}
+	if(material.type==MAT_METALLIC)
+	{
+		vec3 v = -normalize(incident.direction);
+		vec3 r = reflect(-v, hitRecord.normal);
+		color = FresnelSchlick(material.albedo, dot(v, hitRecord.normal)) * PreviewSpecular(r, material.roughness);
+		return true;
+	}
+
+	return false;
+}
+#endif
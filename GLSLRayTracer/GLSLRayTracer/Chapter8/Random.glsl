@@ -0,0 +1,149 @@
+//////////////////////////////////////////////////////////////////////////////
+uint m_u = uint(521288629);
+uint m_v = uint(362436069);
+
+uint GetUintCore(inout uint u, inout uint v)
+{
+	v = uint(36969) * (v & uint(65535)) + (v >> 16);
+	u = uint(18000) * (u & uint(65535)) + (u >> 16);
+	return (v << 16) + u;
+}
+
+// same hash as the CPU backend, pixels and frames get decorrelated streams
+void SeedRandom(uint pixel, uint frame)
+{
+	uint h = pixel * 0x9E3779B1u ^ frame * 0x85EBCA77u;
+	h ^= h >> 16;
+	h *= 0x7FEB352Du;
+	h ^= h >> 15;
+	m_u = (521288629u ^ (h & 0xFFFF0000u)) | 1u;
+	m_v = (362436069u ^ (h << 16)) | 1u;
+}
+
+float GetUniformCore(inout uint u, inout uint v)
+{
+	uint z = GetUintCore(u, v);
+	
+	return float(z) / uint(4294967295);
+}
+
+float GetUniform()
+{
+	return GetUniformCore(m_u, m_v);
+}
+
+uint GetUint()
+{
+	return GetUintCore(m_u, m_v);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// sample sequences indexed by pixel, sample and dimension, the same as the
+// CPU backend's. SAMPLER_SOBOL and SAMPLER_BLUE_NOISE replace the generator.
+#if defined(SAMPLER_SOBOL) || defined(SAMPLER_BLUE_NOISE)
+uniform usampler2D sobolMatrices; // 32 direction numbers of 4 dimensions
+#endif
+#ifdef SAMPLER_BLUE_NOISE
+uniform usampler2D blueNoise; // 64 x 64 ranks
+#endif
+
+uvec2 m_pixel;
+uint m_pixelSeed;
+uint m_sampleIndex;
+uint m_dimension;
+
+uint HashUint(uint x)
+{
+	x ^= x >> 16;
+	x *= 0x7FEB352Du;
+	x ^= x >> 15;
+	x *= 0x846CA68Bu;
+	x ^= x >> 16;
+	return x;
+}
+
+uint ReverseBits(uint x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+uint NestedUniformScramble(uint x, uint seed)
+{
+	x = ReverseBits(x);
+	x ^= x * 0x3D20ADEAu;
+	x += seed;
+	x *= (seed >> 16) | 1u;
+	x ^= x * 0x05526C56u;
+	x ^= x * 0x53A22864u;
+	return ReverseBits(x);
+}
+
+#if defined(SAMPLER_SOBOL) || defined(SAMPLER_BLUE_NOISE)
+uint GetSobol(uint index, uint dimension)
+{
+	uint x = 0u;
+	for(int bit = 0; index != 0u; bit++, index >>= 1)
+	{
+		if((index & 1u) != 0u)
+			x ^= texelFetch(sobolMatrices, ivec2(bit, int(dimension)), 0).r;
+	}
+	return x;
+}
+#endif
+
+// pixel counts rows up like gl_FragCoord
+void SamplerBegin(uvec2 pixel, uint width, uint sampleIndex)
+{
+	SeedRandom(pixel.y * width + pixel.x, sampleIndex);
+
+	m_pixel = pixel;
+	m_pixelSeed = HashUint(pixel.y * width + pixel.x);
+	m_sampleIndex = sampleIndex;
+	m_dimension = 0u;
+}
+
+float rand()
+{
+#if defined(SAMPLER_SOBOL)
+	uint set = m_dimension / 4u;
+	uint component = m_dimension % 4u;
+	uint seed = HashUint(m_pixelSeed ^ HashUint(set));
+	uint value = GetSobol(NestedUniformScramble(m_sampleIndex, seed), component);
+	value = NestedUniformScramble(value, HashUint(seed + component));
+	m_dimension++;
+	return float(value >> 8) * (1.0 / 16777216.0);
+#elif defined(SAMPLER_BLUE_NOISE)
+	uint set = m_dimension / 4u;
+	uint component = m_dimension % 4u;
+	uint seed = HashUint(set);
+	uint value = NestedUniformScramble(GetSobol(m_sampleIndex, component), HashUint(seed + component));
+
+	// a toroidal shift by the rank of a blue noise texel, offset per dimension
+	uint offset = HashUint(m_dimension);
+	uint rank = texelFetch(blueNoise, ivec2((m_pixel.x + offset) & 63u, (m_pixel.y + (offset >> 6)) & 63u), 0).r;
+	value += (rank << 20) + (1u << 19);
+	m_dimension++;
+	return float(value >> 8) * (1.0 / 16777216.0);
+#else
+	return GetUniform();
+#endif
+}
+
+vec2 rand2()
+{
+	return vec2(rand(), rand());
+}
+
+vec3 rand3()
+{
+	return vec3(rand(), rand(), rand());
+}
+
+vec4 rand4()
+{
+	return vec4(rand(), rand(), rand(), rand());
+}
@@ -0,0 +1,148 @@
+///////////////////////////////////////////////////////////////////////////////
+// Direction sampling with the matching densities, the same as the CPU
+// backend's. Lobes are sampled in a local frame with z along the normal, every
+// pdf is per unit solid angle.
+
+// orthonormal basis around a unit vector n, Duff et al. 2017
+void BuildBasis(vec3 n, out vec3 t, out vec3 b)
+{
+	float s = n.z >= 0.0 ? 1.0 : -1.0;
+	float a = -1.0 / (s + n.z);
+	float c = n.x * n.y * a;
+	t = vec3(1.0 + s * n.x * n.x * a, s * c, -s * n.x);
+	b = vec3(c, s + n.y * n.y * a, -n.y);
+}
+
+vec3 LocalToWorld(vec3 v, vec3 n)
+{
+	vec3 t;
+	vec3 b;
+	BuildBasis(n, t, b);
+	return v.x * t + v.y * b + v.z * n;
+}
+
+vec3 WorldToLocal(vec3 v, vec3 n)
+{
+	vec3 t;
+	vec3 b;
+	BuildBasis(n, t, b);
+	return vec3(dot(v, t), dot(v, b), dot(v, n));
+}
+
+vec3 SampleUniformSphere(vec2 u)
+{
+	float z = 1.0 - 2.0 * u.x;
+	float r = sqrt(max(0.0, 1.0 - z * z));
+	float phi = 2.0 * PI * u.y;
+	return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+float UniformSpherePdf()
+{
+	return 1.0 / (4.0 * PI);
+}
+
+// Shirley and Chiu's mapping, keeps the strata of u
+vec2 SampleConcentricDisk(vec2 u)
+{
+	vec2 p = 2.0 * u - 1.0;
+	if(p.x == 0.0 && p.y == 0.0)
+		return vec2(0.0, 0.0);
+
+	float r;
+	float theta;
+	if(abs(p.x) > abs(p.y))
+	{
+		r = p.x;
+		theta = (PI / 4.0) * (p.y / p.x);
+	}
+	else
+	{
+		r = p.y;
+		theta = (PI / 2.0) - (PI / 4.0) * (p.x / p.y);
+	}
+	return r * vec2(cos(theta), sin(theta));
+}
+
+// Malley's method, the disk projected up onto the hemisphere
+vec3 SampleCosineHemisphere(vec2 u)
+{
+	vec2 d = SampleConcentricDisk(u);
+	return vec3(d, sqrt(max(0.0, 1.0 - dot(d, d))));
+}
+
+float CosineHemispherePdf(float cosTheta)
+{
+	return max(cosTheta, 0.0) / PI;
+}
+
+// GGX (Trowbridge-Reitz) microfacet normals h with alpha = roughness^2
+float GGXD(vec3 h, float alpha)
+{
+	if(h.z <= 0.0)
+		return 0.0;
+
+	float a2 = alpha * alpha;
+	float d = h.z * h.z * (a2 - 1.0) + 1.0;
+	return a2 / (PI * d * d);
+}
+
+float GGXLambda(vec3 v, float alpha)
+{
+	float cos2 = v.z * v.z;
+	if(cos2 <= 0.0)
+		return 0.0;
+
+	float tan2 = max(0.0, 1.0 - cos2) / cos2;
+	return 0.5 * (-1.0 + sqrt(1.0 + alpha * alpha * tan2));
+}
+
+// Smith masking of one direction, and height correlated masking-shadowing
+float GGXG1(vec3 v, float alpha)
+{
+	return 1.0 / (1.0 + GGXLambda(v, alpha));
+}
+
+float GGXG2(vec3 wo, vec3 wi, float alpha)
+{
+	return 1.0 / (1.0 + GGXLambda(wo, alpha) + GGXLambda(wi, alpha));
+}
+
+// the normals visible from v, v.z > 0, Heitz 2018
+vec3 SampleGGXVNDF(vec3 v, float alpha, vec2 u)
+{
+	vec3 vh = normalize(vec3(alpha * v.x, alpha * v.y, v.z));
+	float lensq = vh.x * vh.x + vh.y * vh.y;
+	vec3 t1 = lensq > 0.0 ? vec3(-vh.y, vh.x, 0.0) * inversesqrt(lensq) : vec3(1.0, 0.0, 0.0);
+	vec3 t2 = cross(vh, t1);
+
+	float r = sqrt(u.x);
+	float phi = 2.0 * PI * u.y;
+	float p1 = r * cos(phi);
+	float p2 = r * sin(phi);
+	float s = 0.5 * (1.0 + vh.z);
+	p2 = (1.0 - s) * sqrt(max(0.0, 1.0 - p1 * p1)) + s * p2;
+
+	vec3 nh = p1 * t1 + p2 * t2 + sqrt(max(0.0, 1.0 - p1 * p1 - p2 * p2)) * vh;
+	return normalize(vec3(alpha * nh.x, alpha * nh.y, max(0.0, nh.z)));
+}
+
+// density of the visible normal h
+float GGXVNDFPdf(vec3 v, vec3 h, float alpha)
+{
+	if(v.z <= 0.0)
+		return 0.0;
+
+	return GGXG1(v, alpha) * max(dot(v, h), 0.0) * GGXD(h, alpha) / v.z;
+}
+
+// density of l, v reflected about a visible normal
+float GGXReflectionPdf(vec3 v, vec3 l, float alpha)
+{
+	vec3 h = normalize(v + l);
+	float vdoth = dot(v, h);
+	if(vdoth <= 0.0)
+		return 0.0;
+
+	return GGXVNDFPdf(v, h, alpha) / (4.0 * vdoth);
+}
@@ -0,0 +1,73 @@
+#version 330 core
+in vec2 screenCoord;
+
+uniform sampler2D frameColor;		// radiance traced this frame
+uniform sampler2D frameHit;			// first hit position with w = 1, or the ray direction with w = 0
+uniform sampler2D historyColor;		// blended radiance, alpha counts the frames in it
+uniform sampler2D historyHit;		// the previous frame's first hits
+uniform int hasHistory;
+
+// the previous frame's camera, as CameraSet() built it
+uniform vec3 previousOrigin;
+uniform vec3 previousLowerLeft;
+uniform vec3 previousHorizontal;
+uniform vec3 previousVertical;
+
+uniform float maxHistory;			// a frame weighs at least 1 / maxHistory
+uniform float hitTolerance;			// relative to the distance from the camera
+
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out vec4 HitColor;
+
+// where the previous camera saw a first hit, false if off its image
+bool Reproject(vec4 hit, out vec2 uv)
+{
+	vec3 direction = hit.w > 0.0 ? hit.xyz - previousOrigin : hit.xyz;
+	vec3 normal = cross(previousHorizontal, previousVertical);
+	float d = dot(direction, normal);
+	if(abs(d) < 1e-8)
+		return false;
+
+	float s = dot(previousLowerLeft - previousOrigin, normal) / d;
+	if(s <= 0.0)
+		return false;
+
+	vec3 q = previousOrigin + s * direction - previousLowerLeft;
+	uv = vec2(dot(q, previousHorizontal) / dot(previousHorizontal, previousHorizontal), dot(q, previousVertical) / dot(previousVertical, previousVertical));
+
+	return all(greaterThanEqual(uv, vec2(0.0))) && all(lessThan(uv, vec2(1.0)));
+}
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	vec3 color = texelFetch(frameColor, pixel, 0).xyz;
+	vec4 hit = texelFetch(frameHit, pixel, 0);
+
+	vec3 history = vec3(0.0, 0.0, 0.0);
+	float historyLength = 0.0;
+	vec2 uv;
+	if(hasHistory != 0 && Reproject(hit, uv))
+	{
+		ivec2 previous = ivec2(uv * vec2(textureSize(historyHit, 0)));
+		vec4 previousHit = texelFetch(historyHit, previous, 0);
+
+		// disoccluded if the previous frame saw another surface, or sky, there
+		bool sameSurface;
+		if(hit.w > 0.0)
+			sameSurface = previousHit.w > 0.0 && distance(hit.xyz, previousHit.xyz) < hitTolerance * distance(hit.xyz, previousOrigin);
+		else
+			sameSurface = previousHit.w == 0.0;
+
+		if(sameSurface)
+		{
+			vec4 h = texelFetch(historyColor, previous, 0);
+			history = h.xyz;
+			historyLength = h.w;
+		}
+	}
+
+	historyLength = min(historyLength + 1.0, maxHistory);
+	FragColor = vec4(mix(history, color, 1.0 / historyLength), historyLength);
+	HitColor = hit;
+}
@@ -0,0 +1,22 @@
+///////////////////////////////////////////////////////////////////////////////
+// The display transform of every program that puts radiance on the screen, so
+// the plain, --temporal and --denoise views match. Programs built with TONEMAP
+// (--exposure) apply the exposure, the fitted ACES filmic curve and gamma 2.2,
+// the others show linear radiance as is.
+#ifdef TONEMAP
+uniform float exposure;
+
+vec3 ACESFilm(vec3 x)
+{
+	return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+#endif
+
+vec3 Tonemap(vec3 color)
+{
+#ifdef TONEMAP
+	return pow(ACESFilm(color * exposure), vec3(1.0 / 2.2));
+#else
+	return color;
+#endif
+}
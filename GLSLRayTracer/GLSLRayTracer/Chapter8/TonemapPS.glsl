@@ -0,0 +1,19 @@
+#version 330 core
+in vec2 screenCoord;
+
+uniform sampler2D illuminationMap;	// lighting with the albedo divided out
+uniform sampler2D albedoMap;
+
+out vec4 FragColor;
+
+#include "Tonemap.glsl"
+
+// remodulates the denoised lighting before the display transform
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	vec3 color = texelFetch(illuminationMap, pixel, 0).xyz * texelFetch(albedoMap, pixel, 0).xyz;
+
+	FragColor.xyz = Tonemap(color);
+	FragColor.w = 1.0;
+}
@@ -0,0 +1,49 @@
+///////////////////////////////////////////////////////////////////////////////
+// Lookups into a texture streamed by the C++ VirtualTexture. The page table
+// holds, for every tile of every level, the physical cache slot of that tile
+// or of its closest resident ancestor in the low 16 bits and that ancestor's
+// level above them.
+#ifdef VIRTUAL_ENVMAP
+
+#define VT_TILE_SIZE	128
+#define VT_TILE_BORDER	1
+#define VT_PAGE_SIZE	(VT_TILE_SIZE + 2 * VT_TILE_BORDER)
+
+uniform usamplerBuffer vtPageTable;
+uniform sampler2D vtPhysical;
+uniform ivec4 vtLevels[16];	// page table offset, tiles across, width, height
+uniform int vtLevel;		// the level lookups ask for, from the output resolution
+uniform int vtCacheSide;	// physical cache slots per side
+
+uint vtRequest = 0u;		// 1 + page table index of the last tile asked for, for the feedback pass
+
+ivec2 VirtualTextureTiles(ivec4 level)
+{
+	return ivec2(level.y, (level.w + VT_TILE_SIZE - 1) / VT_TILE_SIZE);
+}
+
+// repeats across and clamps top and bottom like the environment map did
+vec3 VirtualTextureSample(vec2 uv)
+{
+	uv = vec2(fract(uv.x), clamp(uv.y, 0.0, 1.0));
+
+	ivec4 level = vtLevels[vtLevel];
+	ivec2 tile = min(ivec2(uv * vec2(level.zw)) / VT_TILE_SIZE, VirtualTextureTiles(level) - 1);
+	int index = level.x + tile.y * level.y + tile.x;
+	vtRequest = uint(index) + 1u;
+
+	uint entry = texelFetch(vtPageTable, index).r;
+	int slot = int(entry & 0xffffu);
+	int resident = int(entry >> 16);
+
+	// the same walk up to the parent as the page table's
+	for(int l = vtLevel; l < resident; l++)
+		tile = min(tile / 2, VirtualTextureTiles(vtLevels[l + 1]) - 1);
+
+	vec2 inTile = uv * vec2(vtLevels[resident].zw) - vec2(tile * VT_TILE_SIZE);
+	inTile = clamp(inTile, vec2(-0.5), vec2(float(VT_TILE_SIZE) + 0.5));
+	vec2 texel = vec2(slot % vtCacheSide, slot / vtCacheSide) * float(VT_PAGE_SIZE) + float(VT_TILE_BORDER) + inTile;
+	return textureLod(vtPhysical, texel / float(vtCacheSide * VT_PAGE_SIZE), 0.0).xyz;
+}
+
+#endif
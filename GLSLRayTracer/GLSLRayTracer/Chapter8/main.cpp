@@ -4,6 +4,51 @@
 #include <GLFW\glfw3.h>
 
 #include <iostream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <random>
+#include <sys/types.h>
+#include <sys/stat.h>
+// winsock2.h must come before windows.h, which would otherwise pull in winsock.h
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#include <windows.h>
+#include <direct.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <signal.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow* window);
@@ -16,6 +61,15 @@ float phi = 70.0;
 float cameraPos[] = { 0.0f, 0.0f, 0.0f };
 float cameraTarget[] = { 0.0f, 0.0f, -1.0f };
 float cameraUp[] = { 0.0f, 1.0f, 0.0f };
+bool lightingPreview = true; // with --preview-lighting, P switches between the preview and the full path tracer
+
+// translation and scale of each sphere on top of WorldConstructor(), set per frame by --animate
+float sphereTransforms[10][4] =
+{
+	{ 0.0f, 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f },
+	{ 0.0f, 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f }
+};
+
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
 	glViewport(0, 0, width, height);
@@ -65,6 +119,14 @@ void processInput(GLFWwindow* window)
 		glfwSetWindowShouldClose(window, true);
 	}
 
+	static bool previewKeyDown = false;
+	bool previewKey = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+	if (previewKey && !previewKeyDown)
+	{
+		lightingPreview = !lightingPreview;
+	}
+	previewKeyDown = previewKey;
+
 	cameraTarget[0] = cameraPos[0] + x;
 	cameraTarget[1] = cameraPos[1] + y;
 	cameraTarget[2] = cameraPos[2] + z;
@@ -86,6 +148,55 @@ void processInput(GLFWwindow* window)
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <map>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+// #defines injected right after a shader's #version line. Kept sorted so the
+// same set always gives the same variant key.
+class ShaderDefines
+{
+public:
+	ShaderDefines()
+	{
+	}
+
+	~ShaderDefines()
+	{
+	}
+
+	void Set(const char* name_, const char* value_ = "")
+	{
+		defines[name_] = value_;
+	}
+
+	void Set(const char* name_, int value_)
+	{
+		defines[name_] = std::to_string(value_);
+	}
+
+	std::string GetKey() const
+	{
+		std::string key;
+		for (auto& define : defines)
+			key += define.first + "=" + define.second + ";";
+
+		return key;
+	}
+
+	std::string GetSource() const
+	{
+		std::string source;
+		for (auto& define : defines)
+			source += "#define " + define.first + " " + define.second + "\n";
+
+		return source;
+	}
+private:
+	std::map<std::string, std::string> defines;
+};
+
 class ShaderProgram
 {
 public:
@@ -100,74 +211,166 @@ public:
 
 	bool Create(const char* vertexPath, const char* fragmentPath)
 	{
-		// 1. retrieve the vertex/fragment source code from filePath
-		std::string vertexCode;
-		std::string fragmentCode;
-		std::string geometryCode;
-		std::ifstream vShaderFile;
-		std::ifstream fShaderFile;
-		std::ifstream gShaderFile;
-		// ensure ifstream objects can throw exceptions:
-		vShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		fShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		gShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		try
-		{
-			// open files
-			vShaderFile.open(vertexPath);
-			fShaderFile.open(fragmentPath);
-			std::stringstream vShaderStream, fShaderStream;
-
-			// read file's buffer contents into streams
-			vShaderStream << vShaderFile.rdbuf();
-			fShaderStream << fShaderFile.rdbuf();
+		return Create(vertexPath, fragmentPath, ShaderDefines());
+	}
 
-			// close file handlers
-			vShaderFile.close();
-			fShaderFile.close();
+	bool Create(const char* vertexPath, const char* fragmentPath, const ShaderDefines& defines)
+	{
+		return Begin(vertexPath, fragmentPath, defines) && Finish();
+	}
 
-			// convert stream into string
-			vertexCode = vShaderStream.str();
-			fragmentCode = fShaderStream.str();
-		}
-		catch (std::ifstream::failure&)
+	// Issues the compiles and the link without asking for their status, so a
+	// driver with KHR_parallel_shader_compile can finish them in the background.
+	// The program is usable after Finish().
+	bool Begin(const char* vertexPath, const char* fragmentPath, const ShaderDefines& defines)
+	{
+		// 1. retrieve the vertex/fragment source code from filePath, expanding #include
+		std::unique_ptr<PendingBuild> build(new PendingBuild);
+		if (!Preprocess(vertexPath, defines, build->vertexCode, build->vertexFiles) ||
+			!Preprocess(fragmentPath, defines, build->fragmentCode, build->fragmentFiles))
 		{
 			return false;
 		}
 
-		const char* vShaderCode = vertexCode.c_str();
-		const char* fShaderCode = fragmentCode.c_str();
+		const char* vShaderCode = build->vertexCode.c_str();
+		const char* fShaderCode = build->fragmentCode.c_str();
 
 		// 2. compile shaders
-		unsigned int vertex, fragment;
 		// vertex shader
-		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &vShaderCode, NULL);
-		glCompileShader(vertex);
-		CheckCompileErrors(vertex, "VERTEX");
+		build->vertex = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(build->vertex, 1, &vShaderCode, NULL);
+		glCompileShader(build->vertex);
 
 		// fragment Shader
-		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &fShaderCode, NULL);
-		glCompileShader(fragment);
-		CheckCompileErrors(fragment, "FRAGMENT");
+		build->fragment = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(build->fragment, 1, &fShaderCode, NULL);
+		glCompileShader(build->fragment);
 
 		// shader Program
-		handle = glCreateProgram();
-		glAttachShader(handle, vertex);
-		glAttachShader(handle, fragment);
+		build->program = glCreateProgram();
+		glAttachShader(build->program, build->vertex);
+		glAttachShader(build->program, build->fragment);
+		glLinkProgram(build->program);
+
+		build->sources[0] = vertexPath;
+		build->sources[1] = fragmentPath;
+		build->defines = defines;
+
+		Cancel();
+		pending = std::move(build);
+
+		return true;
+	}
+
+	bool IsPending() const
+	{
+		return pending != nullptr;
+	}
+
+	// true when Finish() would not block. Without KHR_parallel_shader_compile
+	// there is no way to ask, so the build counts as complete.
+	bool IsComplete() const
+	{
+		if (!pending || !GLAD_GL_KHR_parallel_shader_compile)
+			return true;
+
+		GLint complete = GL_FALSE;
+		glGetProgramiv(pending->program, GL_COMPLETION_STATUS_KHR, &complete);
+
+		return complete != GL_FALSE;
+	}
+
+	// waits for the build started by Begin(), on failure the previous program stays
+	bool Finish()
+	{
+		if (!pending)
+			return handle != 0;
+
+		std::unique_ptr<PendingBuild> build = std::move(pending);
 
-		glLinkProgram(handle);
-		CheckCompileErrors(handle, "PROGRAM");
+		bool success = CheckCompileErrors(build->vertex, "VERTEX", build->vertexFiles);
+		success = CheckCompileErrors(build->fragment, "FRAGMENT", build->fragmentFiles) && success;
+		success = success && CheckCompileErrors(build->program, "PROGRAM", build->fragmentFiles);
 		// delete the shaders as they're linked into our program now and no longer necessery
-		glDeleteShader(vertex);
-		glDeleteShader(fragment);
+		glDeleteShader(build->vertex);
+		glDeleteShader(build->fragment);
+
+		if (!success)
+		{
+			glDeleteProgram(build->program);
+			return false;
+		}
+
+		Destroy();
+		handle = build->program;
+		sourceFiles = build->vertexFiles;
+		sourceFiles.insert(sourceFiles.end(), build->fragmentFiles.begin(), build->fragmentFiles.end());
+		sources[0] = build->sources[0];
+		sources[1] = build->sources[1];
+		sourceDefines = build->defines;
+
+		return true;
+	}
+
+	// drops a build started by Begin()
+	void Cancel()
+	{
+		if (pending)
+		{
+			glDeleteShader(pending->vertex);
+			glDeleteShader(pending->fragment);
+			glDeleteProgram(pending->program);
+			pending.reset();
+		}
+	}
+
+	// rebuilds from the same files and defines, keeps the old program on failure
+	bool Recreate()
+	{
+		ShaderProgram program;
+		if (!program.Create(sources[0].c_str(), sources[1].c_str(), sourceDefines))
+			return false;
+
+		Swap(program);
+		program.Destroy();
 
 		return true;
 	}
 
+	void Swap(ShaderProgram& other)
+	{
+		std::swap(handle, other.handle);
+		std::swap(sourceFiles, other.sourceFiles);
+		std::swap(sources[0], other.sources[0]);
+		std::swap(sources[1], other.sources[1]);
+		std::swap(sourceDefines, other.sourceDefines);
+	}
+
+	// every file the program was built from, includes too
+	const std::vector<std::string>& GetSourceFiles() const
+	{
+		return sourceFiles;
+	}
+
+	const char* GetVertexPath() const
+	{
+		return sources[0].c_str();
+	}
+
+	const char* GetFragmentPath() const
+	{
+		return sources[1].c_str();
+	}
+
+	const ShaderDefines& GetDefines() const
+	{
+		return sourceDefines;
+	}
+
 	void Destroy()
 	{
+		Cancel();
+
 		if (handle)
 		{
 			glDeleteProgram(handle);
@@ -215,6 +418,13 @@ public:
 		glUniform4i(location, v0_, v1_, v2_, v3_);
 	}
 
+	void SetUniform1ui(const char* name_, unsigned int v0_)
+	{
+		int location = glGetUniformLocation(handle, name_);
+
+		glUniform1ui(location, v0_);
+	}
+
 	void SetUniform1f(const char* name_, float v0_)
 	{
 		int location = glGetUniformLocation(handle, name_);
@@ -320,7 +530,88 @@ public:
 		glUniformMatrix4fv(location, count_, true, v_);
 	}
 private:
-	void CheckCompileErrors(GLuint shader, std::string type)
+	// Expands #include "file" (relative to the including file, each file at
+	// most once) and puts the defines after #version. #line directives carry
+	// the index into files_ as the source string number, so a compile error
+	// reads 1(42) for line 42 of files_[1].
+	static bool Preprocess(const std::string& path_, const ShaderDefines& defines_, std::string& code_, std::vector<std::string>& files_)
+	{
+		code_.clear();
+		files_.clear();
+
+		bool definesInjected = false;
+		if (!Expand(path_, defines_, code_, files_, definesInjected))
+			return false;
+
+		if (!definesInjected)
+			code_ = defines_.GetSource() + "#line 1 0\n" + code_;
+
+		return true;
+	}
+
+	static bool Expand(const std::string& path_, const ShaderDefines& defines_, std::string& code_, std::vector<std::string>& files_, bool& definesInjected_)
+	{
+		for (auto& file : files_)
+		{
+			if (file == path_)
+				return true;
+		}
+
+		std::ifstream file(path_.c_str());
+		if (!file)
+		{
+			std::cout << "ERROR::SHADER_FILE_NOT_READ: " << path_ << std::endl;
+			return false;
+		}
+
+		int fileIndex = (int)files_.size();
+		files_.push_back(path_);
+
+		std::string directory;
+		size_t slash = path_.find_last_of("/\\");
+		if (slash != std::string::npos)
+			directory = path_.substr(0, slash + 1);
+
+		std::string line;
+		int lineNumber = 0;
+		while (std::getline(file, line))
+		{
+			lineNumber++;
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+
+			size_t start = line.find_first_not_of(" \t");
+			if (start != std::string::npos && line.compare(start, 8, "#version") == 0 && fileIndex == 0)
+			{
+				code_ += line + "\n" + defines_.GetSource();
+				code_ += "#line " + std::to_string(lineNumber + 1) + " " + std::to_string(fileIndex) + "\n";
+				definesInjected_ = true;
+			}
+			else if (start != std::string::npos && line.compare(start, 8, "#include") == 0)
+			{
+				size_t open = line.find_first_of("\"<", start + 8);
+				size_t close = open == std::string::npos ? open : line.find_first_of("\">", open + 1);
+				if (close == std::string::npos)
+				{
+					std::cout << "ERROR::SHADER_INCLUDE_SYNTAX: " << path_ << "(" << lineNumber << ")" << std::endl;
+					return false;
+				}
+
+				code_ += "#line 1 " + std::to_string(files_.size()) + "\n";
+				if (!Expand(directory + line.substr(open + 1, close - open - 1), defines_, code_, files_, definesInjected_))
+					return false;
+				code_ += "#line " + std::to_string(lineNumber + 1) + " " + std::to_string(fileIndex) + "\n";
+			}
+			else
+			{
+				code_ += line + "\n";
+			}
+		}
+
+		return true;
+	}
+
+	bool CheckCompileErrors(GLuint shader, std::string type, const std::vector<std::string>& files)
 	{
 		GLint success;
 		GLchar infoLog[1024];
@@ -330,7 +621,10 @@ private:
 			if (!success)
 			{
 				glGetShaderInfoLog(shader, 1024, NULL, infoLog);
-				std::cout << "ERROR::SHADER_COMPILATION_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
+				std::cout << "ERROR::SHADER_COMPILATION_ERROR of type: " << type << "\n" << infoLog << "\n";
+				for (size_t i = 0; i < files.size(); i++)
+					std::cout << i << ": " << files[i] << "\n";
+				std::cout << " -- --------------------------------------------------- -- " << std::endl;
 			}
 		}
 		else
@@ -342,9 +636,152 @@ private:
 				std::cout << "ERROR::PROGRAM_LINKING_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
 			}
 		}
+
+		return success != 0;
 	}
 private:
+	struct PendingBuild
+	{
+		unsigned int vertex = 0;
+		unsigned int fragment = 0;
+		unsigned int program = 0;
+		std::string vertexCode;
+		std::string fragmentCode;
+		std::vector<std::string> vertexFiles;
+		std::vector<std::string> fragmentFiles;
+		std::string sources[2];
+		ShaderDefines defines;
+	};
+
 	unsigned int handle;
+	std::vector<std::string> sourceFiles;
+	std::string sources[2];
+	ShaderDefines sourceDefines;
+	std::unique_ptr<PendingBuild> pending;
+};
+
+// Starts every program build up front and finishes them as the driver
+// reports completion, so only the program needed for the first frame is
+// waited on. The compiler thread count is left to the driver.
+class ShaderCompileQueue
+{
+public:
+	ShaderCompileQueue()
+	{
+	}
+
+	~ShaderCompileQueue()
+	{
+	}
+
+	void Create()
+	{
+		if (GLAD_GL_KHR_parallel_shader_compile)
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+	}
+
+	void Destroy()
+	{
+		for (auto program : pending)
+			program->Cancel();
+
+		pending.clear();
+	}
+
+	bool Submit(ShaderProgram* program_, const char* vertexPath_, const char* fragmentPath_, const ShaderDefines& defines_)
+	{
+		if (!program_->Begin(vertexPath_, fragmentPath_, defines_))
+			return false;
+
+		pending.push_back(program_);
+
+		return true;
+	}
+
+	// blocks on program_ alone
+	bool Wait(ShaderProgram* program_)
+	{
+		pending.erase(std::remove(pending.begin(), pending.end(), program_), pending.end());
+
+		return program_->Finish();
+	}
+
+	bool WaitAll()
+	{
+		bool success = true;
+		for (auto program : pending)
+			success = program->Finish() && success;
+
+		pending.clear();
+
+		return success;
+	}
+
+	// once per frame, finishes whatever the driver has completed
+	void Update()
+	{
+		for (size_t i = 0; i < pending.size(); )
+		{
+			if (pending[i]->IsComplete())
+			{
+				pending[i]->Finish();
+				pending.erase(pending.begin() + i);
+			}
+			else
+			{
+				i++;
+			}
+		}
+	}
+
+	int GetPendingCount() const
+	{
+		return (int)pending.size();
+	}
+private:
+	std::vector<ShaderProgram*> pending;
+};
+
+// Programs keyed by their source paths and defines, each variant is built once.
+class ShaderProgramCache
+{
+public:
+	ShaderProgramCache()
+	{
+	}
+
+	~ShaderProgramCache()
+	{
+	}
+
+	// with a queue the program is only submitted and is ready once the queue finishes it
+	ShaderProgram* Get(const char* vertexPath, const char* fragmentPath, const ShaderDefines& defines, ShaderCompileQueue* queue = nullptr)
+	{
+		std::string key = std::string(vertexPath) + "|" + fragmentPath + "|" + defines.GetKey();
+
+		auto found = programs.find(key);
+		if (found != programs.end())
+			return found->second.get();
+
+		std::unique_ptr<ShaderProgram> program(new ShaderProgram);
+		if (queue ? !queue->Submit(program.get(), vertexPath, fragmentPath, defines) : !program->Create(vertexPath, fragmentPath, defines))
+			return nullptr;
+
+		ShaderProgram* result = program.get();
+		programs[key] = std::move(program);
+
+		return result;
+	}
+
+	void Destroy()
+	{
+		for (auto& program : programs)
+			program.second->Destroy();
+
+		programs.clear();
+	}
+private:
+	std::map<std::string, std::unique_ptr<ShaderProgram>> programs;
 };
 
 class VertexArrayObject
@@ -474,6 +911,11 @@ public:
 	{
 		glBindTexture(type, 0);
 	}
+
+	unsigned int GetHandle() const
+	{
+		return handle;
+	}
 protected:
 	unsigned int handle;
 
@@ -494,25 +936,67 @@ public:
 	{
 	}
 
+	// sized internal formats, so the storage does not depend on the driver:
+	// 8 bits a channel for LDR data, half floats for HDR data
 	bool Create(unsigned int width, unsigned int height, unsigned int nrComponents, bool isHDR, void* data)
 	{
+		unsigned int internalFormat = 0;
 		if (nrComponents == 1)
+		{
 			format = GL_RED;
+			internalFormat = isHDR ? GL_R16F : GL_R8;
+		}
 		else if (nrComponents == 3)
+		{
 			format = GL_RGB;
+			internalFormat = isHDR ? GL_RGB16F : GL_RGB8;
+		}
 		else if (nrComponents == 4)
+		{
 			format = GL_RGBA;
+			internalFormat = isHDR ? GL_RGBA16F : GL_RGBA8;
+		}
 
 		if (isHDR)
 			pixelFormat = GL_FLOAT;
 		else
 			pixelFormat = GL_UNSIGNED_BYTE;
 
-		glGenTextures(1, &handle);
+		// recreating keeps the GL name, so a texture can be respecified in place
+		if (!handle)
+			glGenTextures(1, &handle);
 		glBindTexture(GL_TEXTURE_2D, handle);
-		glTexImage2D(GL_TEXTURE_2D, 0, (GLint)format, width, height, 0, (GLint)format, (GLint)pixelFormat, data);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, (GLint)internalFormat, width, height, 0, (GLint)format, (GLint)pixelFormat, data);
 		glGenerateMipmap(GL_TEXTURE_2D);
 
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+		return true;
+	}
+
+	// uploads a prebuilt mip chain, level i is (width >> i) x (height >> i)
+	bool Create(unsigned int width, unsigned int height, unsigned int levelCount, unsigned int internalFormat, unsigned int format_, unsigned int pixelFormat_, const void* const* levels)
+	{
+		format = format_;
+		pixelFormat = pixelFormat_;
+
+		if (!handle)
+			glGenTextures(1, &handle);
+		glBindTexture(GL_TEXTURE_2D, handle);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for (unsigned int level = 0; level < levelCount; level++)
+		{
+			unsigned int levelWidth = (width >> level) ? (width >> level) : 1;
+			unsigned int levelHeight = (height >> level) ? (height >> level) : 1;
+			glTexImage2D(GL_TEXTURE_2D, level, (GLint)internalFormat, levelWidth, levelHeight, 0, (GLint)format, (GLint)pixelFormat, levels[level]);
+		}
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
@@ -547,6 +1031,17 @@ public:
 		}
 	}
 
+	bool Update(unsigned int width, unsigned int height, void* data)
+	{
+		if (!handle)
+			return false;
+
+		glBindTexture(GL_TEXTURE_2D, handle);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, (GLint)format, (GLint)pixelFormat, data);
+
+		return true;
+	}
+
 	void Destroy()
 	{
 		if (handle)
@@ -559,93 +1054,10166 @@ private:
 private:
 };
 
-
-ShaderProgram shaderProgram;
-Texture2D diffuseMap;
-Texture2D specularMap;
-Texture2D envMap;
-VertexArrayObject vertexArrayObject;
-
-bool createScene()
+// a buffer object read by texelFetch, for tables too long for uniforms
+class TextureBuffer : public Texture
 {
-	float vertices[] = {
-		 1.0f,  1.0f, 0.0f,  // top right
-		 1.0f, -1.0f, 0.0f,  // bottom right
-		-1.0f, -1.0f, 0.0f,  // bottom left
-		-1.0f,  1.0f, 0.0f   // top left 
-	};
-	unsigned int indices[] = {  // note that we start from 0!
-		0, 1, 3,   // first triangle
-		1, 2, 3    // second triangle
-	};
-
-	if (!vertexArrayObject.Create(vertices, sizeof(vertices) / sizeof(vertices[0]), indices, sizeof(indices) / sizeof(indices[0])))
+public:
+	TextureBuffer()
+		: Texture(GL_TEXTURE_BUFFER)
+		, buffer(0)
 	{
-		return false;
 	}
 
-	if (!shaderProgram.Create("PathTraceVS.glsl", "PathTracePS.glsl"))
+	~TextureBuffer()
 	{
-		return false;
 	}
 
-	shaderProgram.Bind();
-
-	if (!diffuseMap.Create("../assets/diffuseMap.png"))
+	bool Create(unsigned int internalFormat, const void* data, unsigned int size)
 	{
-		return false;
+		if (!buffer)
+			glGenBuffers(1, &buffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+		glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+		if (!handle)
+			glGenTextures(1, &handle);
+		glBindTexture(GL_TEXTURE_BUFFER, handle);
+		glTexBuffer(GL_TEXTURE_BUFFER, internalFormat, buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+		return true;
 	}
 
-	if (!specularMap.Create("../assets/specularMap.png"))
+	void Destroy()
+	{
+		if (handle)
+		{
+			glDeleteTextures(1, &handle);
+			handle = 0;
+		}
+
+		if (buffer)
+		{
+			glDeleteBuffers(1, &buffer);
+			buffer = 0;
+		}
+	}
+private:
+	unsigned int buffer;
+};
+
+// equally sized RGBA8 layers behind one sampler, a layer per material texture
+class TextureArray : public Texture
+{
+public:
+	TextureArray()
+		: Texture(GL_TEXTURE_2D_ARRAY)
+		, size(0)
+		, layerCount(0)
+	{
+	}
+
+	~TextureArray()
+	{
+	}
+
+	// every layer starts white, so an untextured or still loading layer leaves
+	// the albedo alone
+	bool Create(unsigned int size_, unsigned int layerCount_)
+	{
+		size = size_;
+		layerCount = layerCount_;
+		if (!layerCount)
+			return true;
+
+		std::vector<unsigned char> white(size_t(size) * size * layerCount * 4, 255);
+		if (!handle)
+			glGenTextures(1, &handle);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, handle);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, size, size, layerCount, 0, GL_RGBA, GL_UNSIGNED_BYTE, white.data());
+
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+		return true;
+	}
+
+	// data is size x size RGBA8, or an offset into a bound GL_PIXEL_UNPACK_BUFFER
+	bool Update(unsigned int layer, const void* data)
+	{
+		if (!handle || layer >= layerCount)
+			return false;
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, handle);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE, data);
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		if (handle)
+		{
+			glDeleteTextures(1, &handle);
+			handle = 0;
+		}
+	}
+
+	unsigned int GetSize() const
+	{
+		return size;
+	}
+
+	unsigned int GetLayerCount() const
+	{
+		return layerCount;
+	}
+private:
+	unsigned int size;
+	unsigned int layerCount;
+};
+
+class FrameBufferObject
+{
+public:
+	enum
+	{
+		MAX_COLOR_ATTACHMENTS = 4
+	};
+
+	FrameBufferObject()
+		: handle(0)
+		, width(0)
+		, height(0)
+		, colorMapCount(0)
+	{
+	}
+
+	~FrameBufferObject()
+	{
+	}
+
+	bool Create(unsigned int width_, unsigned int height_, unsigned int internalFormat_)
+	{
+		return Create(width_, height_, &internalFormat_, 1);
+	}
+
+	// one color attachment per internal format, drawn to as outputs 0..count-1
+	bool Create(unsigned int width_, unsigned int height_, const unsigned int* internalFormats_, int count_)
+	{
+		if (count_ < 1 || count_ > MAX_COLOR_ATTACHMENTS)
+			return false;
+
+		width = width_;
+		height = height_;
+		colorMapCount = count_;
+
+		glGenFramebuffers(1, &handle);
+		glBindFramebuffer(GL_FRAMEBUFFER, handle);
+
+		unsigned int drawBuffers[MAX_COLOR_ATTACHMENTS];
+		for (int i = 0; i < colorMapCount; i++)
+		{
+			// an integer target needs an integer client format even without data
+			const void* levels[] = { nullptr };
+			bool integer = internalFormats_[i] == GL_R32UI;
+			colorMaps[i].Create(width, height, 1, internalFormats_[i], integer ? GL_RED_INTEGER : GL_RGBA, integer ? GL_UNSIGNED_INT : GL_FLOAT, levels);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, colorMaps[i].GetHandle(), 0);
+			drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
+		}
+		glDrawBuffers(colorMapCount, drawBuffers);
+
+		bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		if (!complete)
+		{
+			std::cout << "ERROR::FRAMEBUFFER_INCOMPLETE " << width << "x" << height << std::endl;
+			Destroy();
+			return false;
+		}
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		for (int i = 0; i < colorMapCount; i++)
+			colorMaps[i].Destroy();
+		colorMapCount = 0;
+
+		if (handle)
+		{
+			glDeleteFramebuffers(1, &handle);
+			handle = 0;
+		}
+	}
+
+	// also sets the viewport to the whole target
+	void Bind()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, handle);
+		glViewport(0, 0, width, height);
+	}
+
+	void Unbind()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	Texture2D& GetColorMap(int index_ = 0)
+	{
+		return colorMaps[index_];
+	}
+
+	int GetColorMapCount() const
+	{
+		return colorMapCount;
+	}
+
+	unsigned int GetWidth() const
+	{
+		return width;
+	}
+
+	unsigned int GetHeight() const
+	{
+		return height;
+	}
+private:
+	unsigned int handle;
+	unsigned int width;
+	unsigned int height;
+	Texture2D colorMaps[MAX_COLOR_ATTACHMENTS];
+	int colorMapCount;
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+// CPU backend: a line by line port of PathTracePS.glsl, so the same scene can be
+// rendered by worker threads when there is no GPU or for offline/reference output.
+#define PI 3.14159265f
+#define RAYCAST_MAX 100000.0f
+
+class Vector3
+{
+public:
+	Vector3()
+		: x(0.0f)
+		, y(0.0f)
+		, z(0.0f)
+	{
+	}
+
+	Vector3(float x_, float y_, float z_)
+		: x(x_)
+		, y(y_)
+		, z(z_)
+	{
+	}
+
+	Vector3 operator + (const Vector3& v_) const { return Vector3(x + v_.x, y + v_.y, z + v_.z); }
+	Vector3 operator - (const Vector3& v_) const { return Vector3(x - v_.x, y - v_.y, z - v_.z); }
+	Vector3 operator * (const Vector3& v_) const { return Vector3(x * v_.x, y * v_.y, z * v_.z); }
+	Vector3 operator * (float s_) const { return Vector3(x * s_, y * s_, z * s_); }
+	Vector3 operator / (float s_) const { return Vector3(x / s_, y / s_, z / s_); }
+	Vector3 operator - () const { return Vector3(-x, -y, -z); }
+	Vector3& operator += (const Vector3& v_) { x += v_.x; y += v_.y; z += v_.z; return *this; }
+	Vector3& operator *= (const Vector3& v_) { x *= v_.x; y *= v_.y; z *= v_.z; return *this; }
+
+	float x;
+	float y;
+	float z;
+};
+
+inline Vector3 operator * (float s_, const Vector3& v_)
+{
+	return v_ * s_;
+}
+
+inline float dot(const Vector3& a, const Vector3& b)
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Vector3 cross(const Vector3& a, const Vector3& b)
+{
+	return Vector3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+inline float length(const Vector3& v)
+{
+	return sqrtf(dot(v, v));
+}
+
+inline Vector3 normalize(const Vector3& v)
+{
+	return v / length(v);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// each worker thread owns its generator state, the shader keeps it per fragment
+thread_local unsigned int m_u = 521288629;
+thread_local unsigned int m_v = 362436069;
+
+unsigned int GetUintCore(unsigned int& u, unsigned int& v)
+{
+	v = 36969u * (v & 65535u) + (v >> 16);
+	u = 18000u * (u & 65535u) + (u >> 16);
+	return (v << 16) + u;
+}
+
+float GetUniformCore(unsigned int& u, unsigned int& v)
+{
+	unsigned int z = GetUintCore(u, v);
+
+	return float(z) / 4294967295.0f;
+}
+
+unsigned int HashUint(unsigned int x)
+{
+	x ^= x >> 16;
+	x *= 0x7FEB352Du;
+	x ^= x >> 15;
+	x *= 0x846CA68Bu;
+	x ^= x >> 16;
+	return x;
+}
+
+unsigned int ReverseBits(unsigned int x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of a 32 bit fixed point number, Burley 2020 with the
+// Laine-Karras style permutation improved by Vegdahl
+unsigned int NestedUniformScramble(unsigned int x, unsigned int seed)
+{
+	x = ReverseBits(x);
+	x ^= x * 0x3D20ADEAu;
+	x += seed;
+	x *= (seed >> 16) | 1u;
+	x ^= x * 0x05526C56u;
+	x ^= x * 0x53A22864u;
+	return ReverseBits(x);
+}
+
+// Sample sequences indexed by pixel, sample and dimension. SamplerBegin()
+// starts a sample of a pixel and every GetUniform() after it returns the next
+// dimension. RANDOM draws from the multiply with carry generator, SOBOL from
+// Owen scrambled Sobol points padded out of 4D sets that are shuffled and
+// scrambled per pixel, BLUE_NOISE from one scrambled Sobol sequence for the
+// whole frame, shifted per pixel by a blue noise tile so that the error of a
+// few samples is spread as blue noise. The tables are built here and uploaded
+// for Random.glsl, which samples the same way.
+class SamplerTables
+{
+public:
+	enum Type
+	{
+		RANDOM,
+		SOBOL,
+		BLUE_NOISE
+	};
+
+	enum
+	{
+		SOBOL_DIMENSIONS = 4,
+		SOBOL_BITS = 32,
+		BLUE_NOISE_SIZE = 64
+	};
+
+	SamplerTables()
+		: type(RANDOM)
+	{
+	}
+
+	~SamplerTables()
+	{
+	}
+
+	void Create(Type type_)
+	{
+		type = type_;
+		if (type == RANDOM)
+			return;
+
+		BuildSobolMatrices();
+		if (type == BLUE_NOISE)
+			BuildBlueNoise();
+	}
+
+	// the tables as integer textures, only on the GL thread
+	bool CreateTextures()
+	{
+		if (type == RANDOM)
+			return true;
+
+		const void* sobolLevels[] = { sobolMatrices };
+		sobolTexture.Create(SOBOL_BITS, SOBOL_DIMENSIONS, 1, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, sobolLevels);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		if (type == BLUE_NOISE)
+		{
+			const void* blueNoiseLevels[] = { blueNoise };
+			blueNoiseTexture.Create(BLUE_NOISE_SIZE, BLUE_NOISE_SIZE, 1, GL_R16UI, GL_RED_INTEGER, GL_UNSIGNED_SHORT, blueNoiseLevels);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		}
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		sobolTexture.Destroy();
+		blueNoiseTexture.Destroy();
+	}
+
+	Type GetType() const
+	{
+		return type;
+	}
+
+	Texture2D& GetSobolTexture()
+	{
+		return sobolTexture;
+	}
+
+	Texture2D& GetBlueNoiseTexture()
+	{
+		return blueNoiseTexture;
+	}
+
+	unsigned int GetSobol(unsigned int index_, unsigned int dimension_) const
+	{
+		unsigned int x = 0;
+		for (int bit = 0; index_ != 0; bit++, index_ >>= 1)
+		{
+			if (index_ & 1u)
+				x ^= sobolMatrices[dimension_][bit];
+		}
+
+		return x;
+	}
+
+	// dimension_ of sample index_ of the pixel with hash pixelSeed_ at x_, y_
+	float GetSample(unsigned int x_, unsigned int y_, unsigned int pixelSeed_, unsigned int index_, unsigned int dimension_) const
+	{
+		unsigned int set = dimension_ / SOBOL_DIMENSIONS;
+		unsigned int component = dimension_ % SOBOL_DIMENSIONS;
+
+		unsigned int value;
+		if (type == SOBOL)
+		{
+			unsigned int seed = HashUint(pixelSeed_ ^ HashUint(set));
+			value = GetSobol(NestedUniformScramble(index_, seed), component);
+			value = NestedUniformScramble(value, HashUint(seed + component));
+		}
+		else
+		{
+			unsigned int seed = HashUint(set);
+			value = NestedUniformScramble(GetSobol(index_, component), HashUint(seed + component));
+
+			// a toroidal shift by the rank of a blue noise texel, offset per dimension
+			unsigned int offset = HashUint(dimension_);
+			unsigned int rank = blueNoise[((y_ + (offset >> 6)) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE + ((x_ + offset) & (BLUE_NOISE_SIZE - 1))];
+			value += (rank << 20) + (1u << 19);
+		}
+
+		return float(value >> 8) * (1.0f / 16777216.0f);
+	}
+private:
+	// direction numbers of Joe and Kuo for the first dimensions
+	void BuildSobolMatrices()
+	{
+		struct Polynomial
+		{
+			int degree;
+			unsigned int coefficients;
+			unsigned int m[3];
+		};
+		const Polynomial polynomials[SOBOL_DIMENSIONS - 1] =
+		{
+			{ 1, 0, { 1 } },
+			{ 2, 1, { 1, 3 } },
+			{ 3, 1, { 1, 3, 1 } }
+		};
+
+		for (int bit = 0; bit < SOBOL_BITS; bit++)
+			sobolMatrices[0][bit] = 1u << (31 - bit);
+
+		for (int d = 1; d < SOBOL_DIMENSIONS; d++)
+		{
+			const Polynomial& p = polynomials[d - 1];
+			unsigned int* v = sobolMatrices[d];
+			for (int bit = 0; bit < SOBOL_BITS; bit++)
+			{
+				if (bit < p.degree)
+				{
+					v[bit] = p.m[bit] << (31 - bit);
+					continue;
+				}
+
+				v[bit] = v[bit - p.degree] ^ (v[bit - p.degree] >> p.degree);
+				for (int k = 1; k < p.degree; k++)
+				{
+					if ((p.coefficients >> (p.degree - 1 - k)) & 1u)
+						v[bit] ^= v[bit - k];
+				}
+			}
+		}
+	}
+
+	// void and cluster (Ulichney 1993) with a gaussian on the torus, the
+	// texels ranked in the order they were filled
+	void BuildBlueNoise()
+	{
+		const int size = BLUE_NOISE_SIZE;
+		const int count = size * size;
+
+		std::vector<float> kernel(count);
+		for (int y = 0; y < size; y++)
+		{
+			for (int x = 0; x < size; x++)
+			{
+				int dx = std::min(x, size - x);
+				int dy = std::min(y, size - y);
+				kernel[y * size + x] = expf(-float(dx * dx + dy * dy) / (2.0f * 1.5f * 1.5f));
+			}
+		}
+
+		std::vector<unsigned char> pattern(count, 0);
+		std::vector<float> energy(count, 0.0f);
+		auto toggle = [&](int texel, bool set)
+		{
+			pattern[texel] = set ? 1 : 0;
+			int tx = texel % size;
+			int ty = texel / size;
+			float sign = set ? 1.0f : -1.0f;
+			for (int y = 0; y < size; y++)
+			{
+				for (int x = 0; x < size; x++)
+					energy[y * size + x] += sign * kernel[((y - ty) & (size - 1)) * size + ((x - tx) & (size - 1))];
+			}
+		};
+		// the set texel with the most energy, or the free texel with the least
+		auto find = [&](bool cluster)
+		{
+			int best = -1;
+			for (int i = 0; i < count; i++)
+			{
+				if (pattern[i] != (cluster ? 1 : 0))
+					continue;
+				if (best < 0 || (cluster ? energy[i] > energy[best] : energy[i] < energy[best]))
+					best = i;
+			}
+			return best;
+		};
+
+		// a tenth of the texels at random, then moved out of clusters into voids until stable
+		unsigned int u = 521288629u;
+		unsigned int v = 362436069u;
+		int ones = 0;
+		while (ones < count / 10)
+		{
+			int texel = GetUintCore(u, v) % count;
+			if (!pattern[texel])
+			{
+				toggle(texel, true);
+				ones++;
+			}
+		}
+		while (true)
+		{
+			int cluster = find(true);
+			toggle(cluster, false);
+			int voidTexel = find(false);
+			toggle(voidTexel, true);
+			if (voidTexel == cluster)
+				break;
+		}
+
+		std::vector<unsigned char> initial = pattern;
+		std::vector<float> initialEnergy = energy;
+		for (int rank = ones - 1; rank >= 0; rank--)
+		{
+			int cluster = find(true);
+			toggle(cluster, false);
+			blueNoise[cluster] = (unsigned short)rank;
+		}
+
+		pattern = initial;
+		energy = initialEnergy;
+		for (int rank = ones; rank < count; rank++)
+		{
+			int voidTexel = find(false);
+			toggle(voidTexel, true);
+			blueNoise[voidTexel] = (unsigned short)rank;
+		}
+	}
+
+	Type type;
+	unsigned int sobolMatrices[SOBOL_DIMENSIONS][SOBOL_BITS];
+	unsigned short blueNoise[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+	Texture2D sobolTexture;
+	Texture2D blueNoiseTexture;
+};
+
+SamplerTables samplerTables;
+
+// the sample being drawn on this thread
+struct SamplerState
+{
+	unsigned int x;
+	unsigned int y;
+	unsigned int pixelSeed;
+	unsigned int index;
+	unsigned int dimension;
+};
+
+thread_local SamplerState samplerState;
+
+void SeedRandom(unsigned int pixel, unsigned int frame)
+{
+	// decorrelate pixels and frames, the multiply with carry generator must never see a zero seed
+	unsigned int h = pixel * 0x9E3779B1u ^ frame * 0x85EBCA77u;
+	h ^= h >> 16;
+	h *= 0x7FEB352Du;
+	h ^= h >> 15;
+	m_u = (521288629u ^ (h & 0xFFFF0000u)) | 1u;
+	m_v = (362436069u ^ (h << 16)) | 1u;
+}
+
+// pixel x, y of a frame width wide, counting rows up like gl_FragCoord
+void SamplerBegin(unsigned int x, unsigned int y, unsigned int width, unsigned int sampleIndex)
+{
+	unsigned int pixel = y * width + x;
+	SeedRandom(pixel, sampleIndex);
+
+	samplerState.x = x;
+	samplerState.y = y;
+	samplerState.pixelSeed = HashUint(pixel);
+	samplerState.index = sampleIndex;
+	samplerState.dimension = 0;
+}
+
+float GetUniform()
+{
+	if (samplerTables.GetType() == SamplerTables::RANDOM)
+		return GetUniformCore(m_u, m_v);
+
+	return samplerTables.GetSample(samplerState.x, samplerState.y, samplerState.pixelSeed, samplerState.index, samplerState.dimension++);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// direction sampling with the matching densities, as in Sampling.glsl. Lobes
+// are sampled in a local frame with z along the normal, pdfs per solid angle.
+void BuildBasis(const Vector3& n, Vector3& t, Vector3& b)
+{
+	float s = n.z >= 0.0f ? 1.0f : -1.0f;
+	float a = -1.0f / (s + n.z);
+	float c = n.x * n.y * a;
+	t = Vector3(1.0f + s * n.x * n.x * a, s * c, -s * n.x);
+	b = Vector3(c, s + n.y * n.y * a, -n.y);
+}
+
+Vector3 LocalToWorld(const Vector3& v, const Vector3& n)
+{
+	Vector3 t;
+	Vector3 b;
+	BuildBasis(n, t, b);
+	return v.x * t + v.y * b + v.z * n;
+}
+
+Vector3 WorldToLocal(const Vector3& v, const Vector3& n)
+{
+	Vector3 t;
+	Vector3 b;
+	BuildBasis(n, t, b);
+	return Vector3(dot(v, t), dot(v, b), dot(v, n));
+}
+
+Vector3 SampleUniformSphere(float u1, float u2)
+{
+	float z = 1.0f - 2.0f * u1;
+	float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+	float phi = 2.0f * PI * u2;
+	return Vector3(r * cosf(phi), r * sinf(phi), z);
+}
+
+float UniformSpherePdf()
+{
+	return 1.0f / (4.0f * PI);
+}
+
+void SampleConcentricDisk(float u1, float u2, float& x, float& y)
+{
+	float px = 2.0f * u1 - 1.0f;
+	float py = 2.0f * u2 - 1.0f;
+	if (px == 0.0f && py == 0.0f)
+	{
+		x = y = 0.0f;
+		return;
+	}
+
+	float r;
+	float theta;
+	if (fabsf(px) > fabsf(py))
+	{
+		r = px;
+		theta = (PI / 4.0f) * (py / px);
+	}
+	else
+	{
+		r = py;
+		theta = (PI / 2.0f) - (PI / 4.0f) * (px / py);
+	}
+	x = r * cosf(theta);
+	y = r * sinf(theta);
+}
+
+Vector3 SampleCosineHemisphere(float u1, float u2)
+{
+	float x;
+	float y;
+	SampleConcentricDisk(u1, u2, x, y);
+	return Vector3(x, y, sqrtf(std::max(0.0f, 1.0f - x * x - y * y)));
+}
+
+float CosineHemispherePdf(float cosTheta)
+{
+	return std::max(cosTheta, 0.0f) / PI;
+}
+
+float GGXD(const Vector3& h, float alpha)
+{
+	if (h.z <= 0.0f)
+		return 0.0f;
+
+	float a2 = alpha * alpha;
+	float d = h.z * h.z * (a2 - 1.0f) + 1.0f;
+	return a2 / (PI * d * d);
+}
+
+float GGXLambda(const Vector3& v, float alpha)
+{
+	float cos2 = v.z * v.z;
+	if (cos2 <= 0.0f)
+		return 0.0f;
+
+	float tan2 = std::max(0.0f, 1.0f - cos2) / cos2;
+	return 0.5f * (-1.0f + sqrtf(1.0f + alpha * alpha * tan2));
+}
+
+float GGXG1(const Vector3& v, float alpha)
+{
+	return 1.0f / (1.0f + GGXLambda(v, alpha));
+}
+
+float GGXG2(const Vector3& wo, const Vector3& wi, float alpha)
+{
+	return 1.0f / (1.0f + GGXLambda(wo, alpha) + GGXLambda(wi, alpha));
+}
+
+Vector3 SampleGGXVNDF(const Vector3& v, float alpha, float u1, float u2)
+{
+	Vector3 vh = normalize(Vector3(alpha * v.x, alpha * v.y, v.z));
+	float lensq = vh.x * vh.x + vh.y * vh.y;
+	Vector3 t1 = lensq > 0.0f ? Vector3(-vh.y, vh.x, 0.0f) / sqrtf(lensq) : Vector3(1.0f, 0.0f, 0.0f);
+	Vector3 t2 = cross(vh, t1);
+
+	float r = sqrtf(u1);
+	float phi = 2.0f * PI * u2;
+	float p1 = r * cosf(phi);
+	float p2 = r * sinf(phi);
+	float s = 0.5f * (1.0f + vh.z);
+	p2 = (1.0f - s) * sqrtf(std::max(0.0f, 1.0f - p1 * p1)) + s * p2;
+
+	Vector3 nh = p1 * t1 + p2 * t2 + sqrtf(std::max(0.0f, 1.0f - p1 * p1 - p2 * p2)) * vh;
+	return normalize(Vector3(alpha * nh.x, alpha * nh.y, std::max(0.0f, nh.z)));
+}
+
+float GGXVNDFPdf(const Vector3& v, const Vector3& h, float alpha)
+{
+	if (v.z <= 0.0f)
+		return 0.0f;
+
+	return GGXG1(v, alpha) * std::max(dot(v, h), 0.0f) * GGXD(h, alpha) / v.z;
+}
+
+float GGXReflectionPdf(const Vector3& v, const Vector3& l, float alpha)
+{
+	Vector3 h = normalize(v + l);
+	float vdoth = dot(v, h);
+	if (vdoth <= 0.0f)
+		return 0.0f;
+
+	return GGXVNDFPdf(v, h, alpha) / (4.0f * vdoth);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+struct Ray
+{
+	Vector3 origin;
+	Vector3 direction;
+};
+
+struct Camera
+{
+	Vector3 lower_left_corner;
+	Vector3 horizontal;
+	Vector3 vertical;
+	Vector3 origin;
+};
+
+struct Sphere
+{
+	Vector3 center;
+	float radius;
+	int material;		// index into the material table
+};
+
+struct HitRecord
+{
+	float t;
+	Vector3 position;
+	Vector3 normal;
+
+	int material;
+};
+
+struct World
+{
+	int objectCount;
+	Sphere objects[10];
+};
+
+Ray RayConstructor(const Vector3& origin, const Vector3& direction)
+{
+	Ray ray;
+	ray.origin = origin;
+	ray.direction = direction;
+
+	return ray;
+}
+
+Vector3 RayGetPointAt(const Ray& ray, float t)
+{
+	return ray.origin + t * ray.direction;
+}
+
+Camera CameraSet(const Vector3& eye, const Vector3& target, const Vector3& up, float vfov, float aspect)
+{
+	Camera camera;
+
+	float halfHeight = tanf(vfov * PI / 180.0f / 2.0f);
+	float halfWidth = halfHeight * aspect;
+
+	// right hand
+	Vector3 zAxis = normalize(eye - target);
+	Vector3 xAxis = normalize(cross(up, zAxis));
+	Vector3 yAxis = normalize(cross(zAxis, xAxis));
+
+	camera.origin = eye;
+	camera.horizontal = (2.0f * halfWidth) * xAxis;
+	camera.vertical = (2.0f * halfHeight) * yAxis;
+	camera.lower_left_corner = camera.origin - camera.horizontal / 2.0f - camera.vertical / 2.0f - zAxis;
+
+	return camera;
+}
+
+Ray CameraGetRay(const Camera& camera, float u, float v)
+{
+	return RayConstructor(camera.origin,
+		camera.lower_left_corner + u * camera.horizontal + v * camera.vertical - camera.origin);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+#define MAT_LAMBERTIAN	0
+#define MAT_METALLIC	1
+#define MAT_DIELECTRIC	2
+
+// below this GGX alpha a surface is a perfect mirror or refractor
+#define MIN_GGX_ALPHA	0.001f
+#define MAT_PBR			3
+
+struct Lambertian
+{
+	Vector3 albedo;
+};
+
+struct Metallic
+{
+	Vector3 albedo;
+	float roughness;
+};
+
+struct Dielectric
+{
+	Vector3 albedo;
+	float roughness;
+	float ior;
+};
+
+Lambertian LambertianConstructor(const Vector3& albedo)
+{
+	Lambertian lambertian;
+
+	lambertian.albedo = albedo;
+
+	return lambertian;
+}
+
+Metallic MetallicConstructor(const Vector3& albedo, float roughness)
+{
+	Metallic metallic;
+
+	metallic.albedo = albedo;
+	metallic.roughness = roughness;
+
+	return metallic;
+}
+
+Dielectric DielectricConstructor(const Vector3& albedo, float roughness, float ior)
+{
+	Dielectric dielectric;
+
+	dielectric.albedo = albedo;
+	dielectric.roughness = roughness;
+	dielectric.ior = ior;
+
+	return dielectric;
+}
+
+bool LambertianScatter(const Lambertian& lambertian, const Ray&, const HitRecord& hitRecord, Ray& scattered, Vector3& attenuation)
+{
+	attenuation = lambertian.albedo;
+
+	// cosine weighted, so the cosine over the pdf cancels the 1 / PI of the BRDF
+	float u1 = GetUniform();
+	float u2 = GetUniform();
+	scattered.origin = hitRecord.position;
+	scattered.direction = LocalToWorld(SampleCosineHemisphere(u1, u2), hitRecord.normal);
+
+	return true;
+}
+
+float schlick(float cosine, float ior)
+{
+	float r0 = (1.0f - ior) / (1.0f + ior);
+	r0 = r0 * r0;
+	return r0 + (1.0f - r0) * powf((1.0f - cosine), 5.0f);
+}
+
+Vector3 reflect(const Vector3& incident, const Vector3& normal)
+{
+	return incident - 2.0f * dot(normal, incident) * normal;
+}
+
+Vector3 FresnelSchlick(const Vector3& f0, float cosine)
+{
+	float m = powf(1.0f - std::min(std::max(cosine, 0.0f), 1.0f), 5.0f);
+	return f0 + (Vector3(1.0f, 1.0f, 1.0f) - f0) * m;
+}
+
+// unpolarized reflectance of a dielectric boundary, 1 on total internal reflection
+float FresnelDielectric(float cosine, float ni_over_nt)
+{
+	float sin2T = ni_over_nt * ni_over_nt * (1.0f - cosine * cosine);
+	if (sin2T >= 1.0f)
+		return 1.0f;
+
+	float cosT = sqrtf(1.0f - sin2T);
+	float rs = (ni_over_nt * cosine - cosT) / (ni_over_nt * cosine + cosT);
+	float rp = (cosine - ni_over_nt * cosT) / (cosine + ni_over_nt * cosT);
+	return 0.5f * (rs * rs + rp * rp);
+}
+
+bool refract(const Vector3& v, const Vector3& n, float ni_over_nt, Vector3& refracted)
+{
+	Vector3 uv = normalize(v);
+	float dt = dot(uv, n);
+	float discriminant = 1.0f - ni_over_nt * ni_over_nt * (1.0f - dt * dt);
+	if (discriminant > 0)
+	{
+		refracted = ni_over_nt * (uv - n * dt) - n * sqrtf(discriminant);
+		return true;
+	}
+	else
+		return false;
+}
+
+// GGX conductor with alpha = roughness^2 and the albedo as Schlick's F0, see Material.glsl
+bool MetallicScatter(const Metallic& metallic, const Ray& incident, const HitRecord& hitRecord, Ray& scattered, Vector3& attenuation)
+{
+	attenuation = Vector3(0.0f, 0.0f, 0.0f);
+	scattered.origin = hitRecord.position;
+	scattered.direction = hitRecord.normal;
+
+	Vector3 wo = WorldToLocal(-normalize(incident.direction), hitRecord.normal);
+	if (wo.z <= 0.0f)
+		return false;
+
+	float alpha = metallic.roughness * metallic.roughness;
+	bool rough = alpha >= MIN_GGX_ALPHA;
+	Vector3 h(0.0f, 0.0f, 1.0f);
+	if (rough)
+	{
+		float u1 = GetUniform();
+		float u2 = GetUniform();
+		h = SampleGGXVNDF(wo, alpha, u1, u2);
+	}
+	Vector3 wi = reflect(-wo, h);
+	if (wi.z <= 0.0f)
+		return false;
+
+	float weight = rough ? GGXG2(wo, wi, alpha) / GGXG1(wo, alpha) : 1.0f;
+	attenuation = FresnelSchlick(metallic.albedo, dot(wo, h)) * weight;
+	scattered.direction = LocalToWorld(wi, hitRecord.normal);
+
+	return true;
+}
+
+// rough dielectric after Walter et al. 2007, see Material.glsl
+bool DielectricScatter(const Dielectric& dielectric, const Ray& incident, const HitRecord& hitRecord, Ray& scattered, Vector3& attenuation)
+{
+	attenuation = Vector3(0.0f, 0.0f, 0.0f);
+	scattered.origin = hitRecord.position;
+	scattered.direction = hitRecord.normal;
+
+	Vector3 direction = normalize(incident.direction);
+	bool inside = dot(direction, hitRecord.normal) > 0.0f;
+	Vector3 normal = inside ? -hitRecord.normal : hitRecord.normal;
+	float ni_over_nt = inside ? dielectric.ior : 1.0f / dielectric.ior;
+
+	Vector3 wo = WorldToLocal(-direction, normal);
+	float alpha = dielectric.roughness * dielectric.roughness;
+	bool rough = alpha >= MIN_GGX_ALPHA;
+	Vector3 h(0.0f, 0.0f, 1.0f);
+	if (rough)
+	{
+		float u1 = GetUniform();
+		float u2 = GetUniform();
+		h = SampleGGXVNDF(wo, alpha, u1, u2);
+	}
+
+	Vector3 wi;
+	float cosine = dot(wo, h);
+	if (GetUniform() < FresnelDielectric(cosine, ni_over_nt))
+	{
+		wi = reflect(-wo, h);
+		if (wi.z <= 0.0f)
+			return false;
+	}
+	else
+	{
+		if (!refract(-wo, h, ni_over_nt, wi) || wi.z >= 0.0f)
+			return false;
+	}
+
+	float weight = rough ? GGXG2(wo, wi, alpha) / GGXG1(wo, alpha) : 1.0f;
+	attenuation = dielectric.albedo * weight;
+	scattered.direction = LocalToWorld(wi, normal);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Every material of a scene is one RGBA32UI texel of the material table, the
+// record the shader fetches once per hit:
+// x = type in the low 8 bits, texture layer + 1 above them (0 for none)
+// y = albedo red and green, z = albedo blue and roughness, as 16 bit unorms
+// w = index of refraction as float bits
+struct PackedMaterial
+{
+	unsigned int x;
+	unsigned int y;
+	unsigned int z;
+	unsigned int w;
+};
+
+struct Material
+{
+	int type;
+	Vector3 albedo;
+	float roughness;
+	float ior;
+	int textureId;		// -1 for none
+};
+
+Material MaterialConstructor(int type, const Vector3& albedo, float roughness, float ior, int textureId = -1)
+{
+	Material material;
+
+	material.type = type;
+	material.albedo = albedo;
+	material.roughness = roughness;
+	material.ior = ior;
+	material.textureId = textureId;
+
+	return material;
+}
+
+unsigned int PackUnorm16(float value)
+{
+	return (unsigned int)(std::min(std::max(value, 0.0f), 1.0f) * 65535.0f + 0.5f);
+}
+
+PackedMaterial MaterialPack(const Material& material)
+{
+	PackedMaterial packed;
+
+	packed.x = (unsigned int)(material.type & 0xff) | ((unsigned int)(material.textureId + 1) << 8);
+	packed.y = PackUnorm16(material.albedo.x) | (PackUnorm16(material.albedo.y) << 16);
+	packed.z = PackUnorm16(material.albedo.z) | (PackUnorm16(material.roughness) << 16);
+	memcpy(&packed.w, &material.ior, sizeof(packed.w));
+
+	return packed;
+}
+
+// the same decode as MaterialFetch in Material.glsl
+Material MaterialUnpack(const PackedMaterial& packed)
+{
+	Material material;
+
+	material.type = int(packed.x & 0xffu);
+	material.textureId = int(packed.x >> 8) - 1;
+	material.albedo = Vector3(float(packed.y & 0xffffu), float(packed.y >> 16), float(packed.z & 0xffffu)) / 65535.0f;
+	material.roughness = float(packed.z >> 16) / 65535.0f;
+	memcpy(&material.ior, &packed.w, sizeof(material.ior));
+
+	return material;
+}
+
+bool MaterialScatter(const Material& material, const Ray& incident, const HitRecord& hitRecord, Ray& scatter, Vector3& attenuation)
+{
+	if (material.type == MAT_LAMBERTIAN)
+		return LambertianScatter(LambertianConstructor(material.albedo), incident, hitRecord, scatter, attenuation);
+	else if (material.type == MAT_METALLIC)
+		return MetallicScatter(MetallicConstructor(material.albedo, material.roughness), incident, hitRecord, scatter, attenuation);
+	else if (material.type == MAT_DIELECTRIC)
+		return DielectricScatter(DielectricConstructor(material.albedo, material.roughness, material.ior), incident, hitRecord, scatter, attenuation);
+	else
+		return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// latitude and longitude of a point on a sphere from its outward normal, laid
+// out like the environment map
+void SphereGetUV(const Vector3& normal, float& u, float& v)
+{
+	u = atan2f(normal.x, normal.z) / (2.0f * PI) + 0.5f;
+	v = acosf(std::min(std::max(normal.y, -1.0f), 1.0f)) / PI;
+}
+
+Sphere SphereConstructor(const Vector3& center, float radius, int material)
+{
+	Sphere sphere;
+
+	sphere.center = center;
+	sphere.radius = radius;
+	sphere.material = material;
+
+	return sphere;
+}
+
+bool SphereHit(const Sphere& sphere, const Ray& ray, float t_min, float t_max, HitRecord& hitRecord)
+{
+	Vector3 oc = ray.origin - sphere.center;
+
+	float a = dot(ray.direction, ray.direction);
+	float b = dot(oc, ray.direction);
+	float c = dot(oc, oc) - sphere.radius * sphere.radius;
+
+	float discriminant = b * b - a * c;
+	if (discriminant > 0)
+	{
+		float temp = (-b - sqrtf(discriminant)) / a;
+		if (temp < t_max && temp > t_min)
+		{
+			hitRecord.t = temp;
+			hitRecord.position = RayGetPointAt(ray, hitRecord.t);
+			hitRecord.normal = (hitRecord.position - sphere.center) / sphere.radius;
+
+			hitRecord.material = sphere.material;
+			return true;
+		}
+
+		temp = (-b + sqrtf(discriminant)) / a;
+		if (temp < t_max && temp > t_min)
+		{
+			hitRecord.t = temp;
+			hitRecord.position = RayGetPointAt(ray, hitRecord.t);
+			hitRecord.normal = (hitRecord.position - sphere.center) / sphere.radius;
+
+			hitRecord.material = sphere.material;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+class EnvironmentMap
+{
+public:
+	EnvironmentMap()
+		: width(0)
+		, height(0)
+	{
+	}
+
+	~EnvironmentMap()
+	{
+	}
+
+	bool Create(char const* path)
+	{
+		int nrComponents;
+		bool isHDR = stbi_is_hdr(path);
+
+		// LDR images are sampled as UNORM by the GPU, so skip stbi's gamma expansion
+		if (isHDR)
+		{
+			float* data = stbi_loadf(path, &width, &height, &nrComponents, 3);
+			if (!data)
+				return false;
+
+			texels.assign(data, data + width * height * 3);
+			stbi_image_free(data);
+		}
+		else
+		{
+			unsigned char* data = stbi_load(path, &width, &height, &nrComponents, 3);
+			if (!data)
+				return false;
+
+			texels.resize(width * height * 3);
+			for (size_t i = 0; i < texels.size(); i++)
+				texels[i] = data[i] / 255.0f;
+			stbi_image_free(data);
+		}
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		texels.clear();
+		texels.shrink_to_fit();
+		width = 0;
+		height = 0;
+	}
+
+	// bilinear, GL_REPEAT addressing
+	Vector3 Sample(float u, float v) const
+	{
+		if (texels.empty())
+			return Vector3(0.0f, 0.0f, 0.0f);
+
+		float x = (u - floorf(u)) * width - 0.5f;
+		float y = (v - floorf(v)) * height - 0.5f;
+		int x0 = (int)floorf(x);
+		int y0 = (int)floorf(y);
+		float fx = x - x0;
+		float fy = y - y0;
+
+		Vector3 c00 = Texel(x0, y0);
+		Vector3 c10 = Texel(x0 + 1, y0);
+		Vector3 c01 = Texel(x0, y0 + 1);
+		Vector3 c11 = Texel(x0 + 1, y0 + 1);
+
+		return (c00 * (1.0f - fx) + c10 * fx) * (1.0f - fy) + (c01 * (1.0f - fx) + c11 * fx) * fy;
+	}
+private:
+	Vector3 Texel(int x, int y) const
+	{
+		x = ((x % width) + width) % width;
+		y = ((y % height) + height) % height;
+		const float* t = &texels[(y * width + x) * 3];
+
+		return Vector3(t[0], t[1], t[2]);
+	}
+private:
+	int width;
+	int height;
+	std::vector<float> texels;
+};
+
+// the CPU copy of the material TextureArray, size x size RGBA8 layers
+class TextureLayers
+{
+public:
+	TextureLayers()
+		: size(0)
+	{
+	}
+
+	~TextureLayers()
+	{
+	}
+
+	// white like the array's placeholders
+	void Create(int size_, int layerCount_)
+	{
+		size = size_;
+		texels.assign(layerCount_, std::vector<unsigned char>(size_t(size) * size * 4, 255));
+	}
+
+	void Destroy()
+	{
+		texels.clear();
+		texels.shrink_to_fit();
+		size = 0;
+	}
+
+	// box filters an RGBA8 image of any size into the layer, each layer has a
+	// single writer so loads of different layers can run in parallel
+	void SetLayer(int layer, const unsigned char* data, int width, int height)
+	{
+		BoxFilter(data, width, height, size, texels[layer].data());
+	}
+
+	// an RGBA8 image of any size to size x size RGBA8 in dst, a plain copy when
+	// it already is that size
+	static void BoxFilter(const unsigned char* data, int width, int height, int size, unsigned char* dst)
+	{
+		for (int y = 0; y < size; y++)
+		{
+			int sy0 = y * height / size;
+			int sy1 = std::max(sy0 + 1, (y + 1) * height / size);
+			for (int x = 0; x < size; x++)
+			{
+				int sx0 = x * width / size;
+				int sx1 = std::max(sx0 + 1, (x + 1) * width / size);
+
+				unsigned int sum[4] = { 0, 0, 0, 0 };
+				for (int sy = sy0; sy < sy1; sy++)
+				{
+					for (int sx = sx0; sx < sx1; sx++)
+					{
+						for (int c = 0; c < 4; c++)
+							sum[c] += data[(size_t(sy) * width + sx) * 4 + c];
+					}
+				}
+
+				unsigned int count = (sy1 - sy0) * (sx1 - sx0);
+				for (int c = 0; c < 4; c++)
+					dst[(size_t(y) * size + x) * 4 + c] = (unsigned char)((sum[c] + count / 2) / count);
+			}
+		}
+	}
+
+	const unsigned char* GetLayer(int layer) const
+	{
+		return texels[layer].data();
+	}
+
+	int GetSize() const
+	{
+		return size;
+	}
+
+	int GetLayerCount() const
+	{
+		return int(texels.size());
+	}
+
+	// bilinear, GL_REPEAT addressing, like the shader's sampler2DArray
+	Vector3 Sample(int layer, float u, float v) const
+	{
+		if (layer < 0 || layer >= GetLayerCount())
+			return Vector3(1.0f, 1.0f, 1.0f);
+
+		float x = (u - floorf(u)) * size - 0.5f;
+		float y = (v - floorf(v)) * size - 0.5f;
+		int x0 = (int)floorf(x);
+		int y0 = (int)floorf(y);
+		float fx = x - x0;
+		float fy = y - y0;
+
+		Vector3 c00 = Texel(layer, x0, y0);
+		Vector3 c10 = Texel(layer, x0 + 1, y0);
+		Vector3 c01 = Texel(layer, x0, y0 + 1);
+		Vector3 c11 = Texel(layer, x0 + 1, y0 + 1);
+
+		return (c00 * (1.0f - fx) + c10 * fx) * (1.0f - fy) + (c01 * (1.0f - fx) + c11 * fx) * fy;
+	}
+private:
+	Vector3 Texel(int layer, int x, int y) const
+	{
+		x = ((x % size) + size) % size;
+		y = ((y % size) + size) % size;
+		const unsigned char* t = &texels[layer][(size_t(y) * size + x) * 4];
+
+		return Vector3(t[0], t[1], t[2]) / 255.0f;
+	}
+private:
+	int size;
+	std::vector<std::vector<unsigned char>> texels;
+};
+
+// read-only scene data shared by all worker threads
+struct Scene
+{
+	World world;
+	std::vector<PackedMaterial> materials;
+	const EnvironmentMap* envMap;
+	const TextureLayers* textures;	// null leaves every material untextured
+};
+
+World WorldConstructor()
+{
+	World world;
+
+	world.objectCount = 4;
+	world.objects[0] = SphereConstructor(Vector3(0.0f, 0.0f, -1.0f), 0.25f, 0);
+	world.objects[1] = SphereConstructor(Vector3(0.7f, 0.0f, -1.0f), 0.25f, 5);
+	world.objects[2] = SphereConstructor(Vector3(-0.7f, 0.0f, -1.0f), 0.25f, 10);
+	world.objects[3] = SphereConstructor(Vector3(0.0f, -100.5f, -1.0f), 100.0f, 3);
+
+	return world;
+}
+
+// the material table the spheres index, lambertian from 0, metallic from 4 and
+// dielectric from 8. The center sphere's material is textured with layer 0.
+std::vector<PackedMaterial> MaterialsConstructor()
+{
+	std::vector<PackedMaterial> materials;
+
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_LAMBERTIAN, Vector3(0.8f, 0.8f, 0.8f), 1.0f, 1.0f, 0)));
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_LAMBERTIAN, Vector3(0.5f, 0.7f, 0.5f), 1.0f, 1.0f)));
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_LAMBERTIAN, Vector3(0.5f, 0.5f, 0.7f), 1.0f, 1.0f)));
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_LAMBERTIAN, Vector3(0.7f, 0.7f, 0.7f), 1.0f, 1.0f)));
+
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_METALLIC, Vector3(0.7f, 0.5f, 0.5f), 0.0f, 1.0f)));
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_METALLIC, Vector3(0.5f, 0.7f, 0.5f), 0.1f, 1.0f)));
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_METALLIC, Vector3(0.5f, 0.5f, 0.7f), 0.2f, 1.0f)));
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_METALLIC, Vector3(0.7f, 0.7f, 0.7f), 0.3f, 1.0f)));
+
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_DIELECTRIC, Vector3(1.0f, 1.0f, 1.0f), 0.0f, 1.5f)));
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_DIELECTRIC, Vector3(1.0f, 1.0f, 1.0f), 0.1f, 1.5f)));
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_DIELECTRIC, Vector3(1.0f, 1.0f, 1.0f), 0.2f, 1.5f)));
+	materials.push_back(MaterialPack(MaterialConstructor(MAT_DIELECTRIC, Vector3(1.0f, 1.0f, 1.0f), 0.3f, 1.5f)));
+
+	return materials;
+}
+
+// the images behind the material table's texture ids, a TextureArray layer each
+std::vector<std::string> MaterialTexturesConstructor()
+{
+	std::vector<std::string> paths;
+
+	paths.push_back("../assets/envmap8.jpg");
+
+	return paths;
+}
+
+// moves and scales each sphere about its center, like the shader does
+void WorldTransform(World& world, const float (*transforms)[4])
+{
+	for (int i = 0; i < world.objectCount; i++)
+	{
+		world.objects[i].center += Vector3(transforms[i][0], transforms[i][1], transforms[i][2]);
+		world.objects[i].radius *= transforms[i][3];
+	}
+}
+
+bool WorldHit(const World& world, const Ray& ray, float t_min, float t_max, HitRecord& rec)
+{
+	float cloestSoFar = t_max;
+	bool hitSomething = false;
+	HitRecord tempRec;
+
+	for (int i = 0; i < world.objectCount; i++)
+	{
+		if (SphereHit(world.objects[i], ray, t_min, cloestSoFar, tempRec))
+		{
+			hitSomething = true;
+			cloestSoFar = tempRec.t;
+
+			rec = tempRec;
+		}
+	}
+
+	return hitSomething;
+}
+
+void InitScene(Scene& scene, const EnvironmentMap* envMap, const TextureLayers* textures = nullptr)
+{
+	scene.world = WorldConstructor();
+	scene.materials = MaterialsConstructor();
+	scene.envMap = envMap;
+	scene.textures = textures;
+}
+
+Vector3 GetEnvironmentColor(const Scene& scene, const Ray& ray)
+{
+	Vector3 dir = normalize(ray.direction);
+	float phi = acosf(dir.y) / PI;
+	float theta = (atan2f(dir.x, dir.z) + (PI / 2.0f)) / PI;
+
+	return scene.envMap->Sample(theta, phi);
+}
+
+// what the first segment of a path saw, guides the denoiser
+struct PrimaryHit
+{
+	Vector3 albedo;		// 1 for an escaped ray
+	Vector3 normal;		// 0 for an escaped ray
+};
+
+Vector3 WorldTrace(const Scene& scene, Ray ray, int depth, PrimaryHit* primary = nullptr)
+{
+	HitRecord hitRecord;
+
+	Vector3 frac(1.0f, 1.0f, 1.0f);
+	Vector3 bgColor(0.0f, 0.0f, 0.0f);
+	if (primary)
+	{
+		primary->albedo = Vector3(1.0f, 1.0f, 1.0f);
+		primary->normal = Vector3(0.0f, 0.0f, 0.0f);
+	}
+	int maxDepth = depth;
+	while (depth > 0)
+	{
+		depth--;
+		if (WorldHit(scene.world, ray, 0.001f, RAYCAST_MAX, hitRecord))
+		{
+			Material material = MaterialUnpack(scene.materials[hitRecord.material]);
+			if (scene.textures && material.textureId >= 0)
+			{
+				float u, v;
+				SphereGetUV(hitRecord.normal, u, v);
+				material.albedo *= scene.textures->Sample(material.textureId, u, v);
+			}
+			if (primary && depth == maxDepth - 1)
+			{
+				primary->albedo = material.albedo;
+				primary->normal = hitRecord.normal;
+			}
+
+			Ray scatterRay;
+			Vector3 attenuation;
+			if (!MaterialScatter(material, ray, hitRecord, scatterRay, attenuation))
+				break;
+
+			frac *= attenuation;
+			ray = scatterRay;
+		}
+		else
+		{
+			bgColor = GetEnvironmentColor(scene, ray);
+			break;
+		}
+	}
+
+	return bgColor * frac;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Chase-Lev work stealing deque (Le, Pop, Cohen, Zappa Nardelli 2013). The owner
+// pushes and pops at the bottom, every other worker steals from the top.
+class TileDeque
+{
+public:
+	TileDeque()
+		: top(0)
+		, bottom(0)
+		, mask(0)
+	{
+	}
+
+	~TileDeque()
+	{
+	}
+
+	// capacity is rounded up to a power of two and never grows, the scheduler
+	// never seeds more than one frame share into a deque at a time
+	void Create(unsigned int capacity_)
+	{
+		unsigned int capacity = 1;
+		while (capacity < capacity_)
+			capacity <<= 1;
+
+		buffer.reset(new std::atomic<int64_t>[capacity]);
+		mask = capacity - 1;
+		top.store(0, std::memory_order_relaxed);
+		bottom.store(0, std::memory_order_relaxed);
+	}
+
+	void Push(int64_t item)
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed);
+
+		buffer[b & mask].store(item, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	bool Pop(int64_t& item)
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+
+		item = buffer[b & mask].load(std::memory_order_relaxed);
+		if (t == b)
+		{
+			// last item, race against thieves
+			bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+
+		return true;
+	}
+
+	bool Steal(int64_t& item)
+	{
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+			return false;
+
+		item = buffer[t & mask].load(std::memory_order_relaxed);
+
+		return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+	}
+
+	bool Empty() const
+	{
+		return top.load(std::memory_order_relaxed) >= bottom.load(std::memory_order_relaxed);
+	}
+private:
+	// keep the thieves' end and the owner's end on separate cache lines
+	std::atomic<int64_t> top;
+	char padTop[64 - sizeof(std::atomic<int64_t>)];
+	std::atomic<int64_t> bottom;
+	char padBottom[64 - sizeof(std::atomic<int64_t>)];
+	std::unique_ptr<std::atomic<int64_t>[]> buffer;
+	int64_t mask;
+};
+
+// Hilbert curve index to grid position, n must be a power of two
+void HilbertToXY(unsigned int n, unsigned int d, unsigned int& x, unsigned int& y)
+{
+	x = 0;
+	y = 0;
+	for (unsigned int s = 1; s < n; s *= 2)
+	{
+		unsigned int rx = 1 & (d / 2);
+		unsigned int ry = 1 & (d ^ rx);
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+
+			unsigned int t = x;
+			x = y;
+			y = t;
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+bool PinCurrentThreadToCore(unsigned int core)
+{
+#ifdef _WIN32
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = WORD(core / 64);
+	affinity.Mask = KAFFINITY(1) << (core % 64);
+
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(core % CPU_SETSIZE, &cpuset);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0;
+#else
+	return false;
+#endif
+}
+
+// Pages are committed but not touched, so the OS places each one on the NUMA
+// node of the first thread that writes it.
+void* AllocatePages(size_t size)
+{
+#ifdef _WIN32
+	return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return memory == MAP_FAILED ? nullptr : memory;
+#endif
+}
+
+void FreePages(void* memory, size_t size)
+{
+	if (!memory)
+		return;
+
+#ifdef _WIN32
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, size);
+#endif
+}
+
+// Which logical processors belong to which NUMA node. Falls back to a single
+// node holding every processor when the platform does not tell us.
+class NumaTopology
+{
+public:
+	NumaTopology()
+	{
+	}
+
+	~NumaTopology()
+	{
+	}
+
+	bool Create()
+	{
+		nodeCpus.clear();
+
+#ifdef _WIN32
+		ULONG highestNode = 0;
+		if (GetNumaHighestNodeNumber(&highestNode))
+		{
+			for (USHORT node = 0; node <= highestNode; node++)
+			{
+				GROUP_AFFINITY affinity = {};
+				if (!GetNumaNodeProcessorMaskEx(node, &affinity))
+					continue;
+
+				std::vector<unsigned int> cpus;
+				for (unsigned int bit = 0; bit < 64; bit++)
+				{
+					if (affinity.Mask & (KAFFINITY(1) << bit))
+						cpus.push_back(affinity.Group * 64 + bit);
+				}
+
+				if (!cpus.empty())
+					nodeCpus.push_back(cpus);
+			}
+		}
+#elif defined(__linux__)
+		for (unsigned int node = 0; ; node++)
+		{
+			std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			if (!file)
+				break;
+
+			std::string cpulist;
+			std::getline(file, cpulist);
+
+			std::vector<unsigned int> cpus = ParseCpuList(cpulist);
+			if (!cpus.empty())
+				nodeCpus.push_back(cpus);
+		}
+#endif
+
+		if (nodeCpus.empty())
+		{
+			std::vector<unsigned int> cpus;
+			for (unsigned int i = 0; i < std::max(1u, std::thread::hardware_concurrency()); i++)
+				cpus.push_back(i);
+
+			nodeCpus.push_back(cpus);
+		}
+
+		return true;
+	}
+
+	unsigned int GetNodeCount() const
+	{
+		return (unsigned int)nodeCpus.size();
+	}
+
+	const std::vector<unsigned int>& GetCpus(unsigned int node) const
+	{
+		return nodeCpus[node];
+	}
+
+	// spreads workers over whole nodes first, so neighbouring worker indices
+	// (and therefore neighbouring tile shares) share a node
+	void GetWorkerPlacement(unsigned int worker, unsigned int& cpu, unsigned int& node) const
+	{
+		unsigned int cpuCount = 0;
+		for (size_t i = 0; i < nodeCpus.size(); i++)
+			cpuCount += (unsigned int)nodeCpus[i].size();
+
+		unsigned int index = worker % cpuCount;
+		for (node = 0; index >= nodeCpus[node].size(); node++)
+			index -= (unsigned int)nodeCpus[node].size();
+
+		cpu = nodeCpus[node][index];
+	}
+private:
+	// "0-3,8-11" style lists from sysfs
+	static std::vector<unsigned int> ParseCpuList(const std::string& cpulist)
+	{
+		std::vector<unsigned int> cpus;
+		std::stringstream stream(cpulist);
+		std::string range;
+		while (std::getline(stream, range, ','))
+		{
+			if (range.empty())
+				continue;
+
+			size_t dash = range.find('-');
+			unsigned int first = (unsigned int)atoi(range.c_str());
+			unsigned int last = dash == std::string::npos ? first : (unsigned int)atoi(range.c_str() + dash + 1);
+			for (unsigned int cpu = first; cpu <= last; cpu++)
+				cpus.push_back(cpu);
+		}
+
+		return cpus;
+	}
+private:
+	std::vector<std::vector<unsigned int>> nodeCpus;
+};
+
+// RGB32F frame stored tile by tile in Hilbert order instead of row by row, so
+// one worker's share of the frame is one contiguous range of pages that can
+// live on that worker's NUMA node. Resolve() produces the usual linear image.
+class TiledFrameBuffer
+{
+public:
+	TiledFrameBuffer()
+		: memory(nullptr)
+		, size(0)
+		, width(0)
+		, height(0)
+		, tileSize(0)
+		, tilesX(0)
+	{
+	}
+
+	~TiledFrameBuffer()
+	{
+		Destroy();
+	}
+
+	bool Create(int width_, int height_, int tileSize_, int tilesX_, const std::vector<int>& tileOrder_)
+	{
+		Destroy();
+
+		width = width_;
+		height = height_;
+		tileSize = tileSize_;
+		tilesX = tilesX_;
+		tileOrder = tileOrder_;
+		homeNodes.assign(tileOrder.size(), -1);
+
+		size = tileOrder.size() * GetTileFloats() * sizeof(float);
+		memory = (float*)AllocatePages(size);
+
+		return memory != nullptr;
+	}
+
+	void Destroy()
+	{
+		FreePages(memory, size);
+		memory = nullptr;
+		size = 0;
+	}
+
+	float* GetTile(int rank)
+	{
+		return memory + rank * GetTileFloats();
+	}
+
+	size_t GetTileFloats() const
+	{
+		return size_t(tileSize) * tileSize * 3;
+	}
+
+	int GetHomeNode(int rank) const
+	{
+		return homeNodes[rank];
+	}
+
+	void SetHomeNode(int rank, int node)
+	{
+		homeNodes[rank] = node;
+	}
+
+	void Resolve(float* linear) const
+	{
+		for (size_t rank = 0; rank < tileOrder.size(); rank++)
+		{
+			int x0 = (tileOrder[rank] % tilesX) * tileSize;
+			int y0 = (tileOrder[rank] / tilesX) * tileSize;
+			int w = std::min(tileSize, width - x0);
+			int h = std::min(tileSize, height - y0);
+
+			const float* src = memory + rank * GetTileFloats();
+			for (int y = 0; y < h; y++)
+				memcpy(&linear[((y0 + y) * width + x0) * 3], &src[y * tileSize * 3], w * 3 * sizeof(float));
+		}
+	}
+private:
+	float* memory;
+	size_t size;
+	int width;
+	int height;
+	int tileSize;
+	int tilesX;
+	std::vector<int> tileOrder;
+	std::vector<int> homeNodes;
+};
+
+// Per-thread bump allocator for transient render data. Allocations are never
+// freed individually: a Scope rewinds to where it started (end of a tile) and
+// Reset() drops everything (start of a frame). When a tile needs more than the
+// current block a new block is chained on, and the next Reset() folds them
+// into one block large enough, so after warm-up the render loop never reaches
+// the heap.
+class ScratchArena
+{
+public:
+	class Scope
+	{
+	public:
+		Scope(ScratchArena& arena_)
+			: arena(arena_)
+			, mark(arena_.used)
+			, blockCount(arena_.blocks.size())
+			, live(arena_.chainedSize + arena_.used)
+		{
+		}
+
+		~Scope()
+		{
+			arena.Rewind(mark, blockCount, live);
+		}
+	private:
+		ScratchArena& arena;
+		size_t mark;
+		size_t blockCount;
+		size_t live;
+	};
+
+	ScratchArena()
+		: used(0)
+		, chainedSize(0)
+		, peak(0)
+		, overflows(0)
+	{
+	}
+
+	~ScratchArena()
+	{
+		Destroy();
+	}
+
+	bool Create(size_t capacity_)
+	{
+		Destroy();
+
+		return AddBlock(capacity_);
+	}
+
+	void Destroy()
+	{
+		for (size_t i = 0; i < blocks.size(); i++)
+			FreePages(blocks[i].memory, blocks[i].size);
+
+		blocks.clear();
+		used = 0;
+		chainedSize = 0;
+	}
+
+	void* Allocate(size_t size, size_t alignment = 16)
+	{
+		size_t offset = (used + alignment - 1) & ~(alignment - 1);
+		if (blocks.empty() || offset + size > blocks.back().size)
+		{
+			// chain a new block, it is merged into the first one on Reset
+			overflows++;
+			if (!AddBlock(std::max(size + alignment, blocks.empty() ? size_t(0) : blocks.back().size * 2)))
+				return nullptr;
+
+			offset = 0;
+		}
+
+		used = offset + size;
+		peak = std::max(peak, chainedSize + used);
+
+		return blocks.back().memory + offset;
+	}
+
+	// default constructs count Ts, nothing is ever destructed
+	template<class T>
+	T* AllocateArray(size_t count)
+	{
+		T* array = (T*)Allocate(sizeof(T) * count, alignof(T) > 16 ? alignof(T) : 16);
+		for (size_t i = 0; i < count; i++)
+			new (&array[i]) T();
+
+		return array;
+	}
+
+	void Reset()
+	{
+		if (blocks.size() > 1)
+		{
+			size_t total = 0;
+			for (size_t i = 0; i < blocks.size(); i++)
+				total += blocks[i].size;
+
+			Create(total);
+		}
+
+		used = 0;
+		chainedSize = 0;
+	}
+
+	size_t GetCapacity() const
+	{
+		size_t total = 0;
+		for (size_t i = 0; i < blocks.size(); i++)
+			total += blocks[i].size;
+
+		return total;
+	}
+
+	size_t GetPeak() const
+	{
+		return peak;
+	}
+
+	size_t GetOverflows() const
+	{
+		return overflows;
+	}
+private:
+	struct Block
+	{
+		unsigned char* memory;
+		size_t size;
+	};
+
+	bool AddBlock(size_t size)
+	{
+		Block block;
+		block.memory = (unsigned char*)AllocatePages(size);
+		block.size = size;
+		if (!block.memory)
+			return false;
+
+		if (!blocks.empty())
+			chainedSize += used;
+
+		blocks.push_back(block);
+		used = 0;
+
+		return true;
+	}
+
+	void Rewind(size_t mark, size_t blockCount, size_t live)
+	{
+		// everything allocated inside the scope is dead; if it chained a new block
+		// carry on from the start of that block, the old ones are merged on Reset.
+		// Either way only what was live when the scope opened still counts.
+		if (blocks.size() != blockCount)
+		{
+			used = 0;
+			chainedSize = live;
+		}
+		else
+		{
+			used = mark;
+		}
+	}
+private:
+	std::vector<Block> blocks;
+	size_t used;
+	size_t chainedSize;	// live bytes in the blocks before the last
+	size_t peak;		// most live bytes at once
+	size_t overflows;
+};
+
+// everything a worker needs to render one frame
+struct CPUFrame
+{
+	Camera camera;
+	int samplesPerPixel;
+	int maxDepth;
+	TiledFrameBuffer* frameBuffer;
+	bool firstTouch; // only fault in the pages of the frame buffer, see CreateFrameBuffer
+};
+
+// Renders frames with a pool of pinned worker threads. Each frame is cut into
+// tiles laid out along a Hilbert curve and dealt to the workers in contiguous
+// shares; a worker that runs dry claims an unclaimed share, then steals single
+// tiles from the others, preferring workers on its own NUMA node. There is no
+// barrier between frames: as soon as frame N+1 is submitted, idle workers
+// start on it while stragglers finish frame N.
+class TileScheduler
+{
+public:
+	enum
+	{
+		MAX_FRAMES_IN_FLIGHT = 2,
+		TILE_SIZE = 16
+	};
+
+	struct Stats
+	{
+		uint64_t tilesRendered;
+		uint64_t tilesStolen;
+		uint64_t sharesClaimed;
+		uint64_t remoteTiles;
+		uint64_t idleMicroseconds;
+		unsigned int nodeCount;
+		unsigned int sceneReplicas;
+		uint64_t arenaPeakBytes; // largest of any worker
+		uint64_t arenaCapacityBytes; // all workers
+		uint64_t arenaOverflows;
+	};
+
+	TileScheduler()
+		: scene(nullptr)
+		, workerCount(0)
+		, width(0)
+		, height(0)
+		, tilesX(0)
+		, tilesY(0)
+		, shareSize(0)
+		, arenaSize(0)
+		, submittedFrame(-1)
+		, running(false)
+	{
+	}
+
+	~TileScheduler()
+	{
+	}
+
+	bool Create(const Scene* scene_, int width_, int height_, unsigned int workerCount_, bool pinThreads_, bool replicateScene_, size_t arenaSize_)
+	{
+		scene = scene_;
+		arenaSize = arenaSize_;
+		workerCount = workerCount_ ? workerCount_ : std::max(1u, std::thread::hardware_concurrency());
+		workers.reset(new Worker[workerCount]);
+
+		topology.Create();
+		if (replicateScene_ && topology.GetNodeCount() > 1)
+			CreateReplicas();
+
+		BuildTileOrder(width_, height_);
+
+		for (unsigned int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+		{
+			slots[i].frameIndex.store(-1);
+			slots[i].complete = true;
+			slots[i].tilesRemaining.store(0);
+			slots[i].firstTouch.store(false);
+			slots[i].sharesClaimed.reset(new std::atomic<bool>[workerCount]);
+			for (unsigned int j = 0; j < workerCount; j++)
+				slots[i].sharesClaimed[j].store(true);
+		}
+
+		for (unsigned int i = 0; i < workerCount; i++)
+		{
+			Worker& worker = workers[i];
+			topology.GetWorkerPlacement(i, worker.cpu, worker.node);
+			worker.pinned = pinThreads_;
+			worker.scene = replicas.empty() ? scene : &replicas[worker.node]->scene;
+		}
+
+		// share and steal from workers on the same node before going remote
+		for (unsigned int i = 0; i < workerCount; i++)
+		{
+			for (unsigned int j = 1; j < workerCount; j++)
+			{
+				unsigned int other = (i + j) % workerCount;
+				if (workers[other].node == workers[i].node)
+					workers[i].victims.push_back(other);
+			}
+			for (unsigned int j = 1; j < workerCount; j++)
+			{
+				unsigned int other = (i + j) % workerCount;
+				if (workers[other].node != workers[i].node)
+					workers[i].victims.push_back(other);
+			}
+		}
+
+		submittedFrame.store(-1);
+		running = true;
+		for (unsigned int i = 0; i < workerCount; i++)
+			workers[i].thread = std::thread(&TileScheduler::WorkerMain, this, i);
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		frameSubmitted.notify_all();
+
+		for (unsigned int i = 0; i < workerCount; i++)
+		{
+			if (workers[i].thread.joinable())
+				workers[i].thread.join();
+		}
+		workers.reset();
+		workerCount = 0;
+		replicas.clear();
+	}
+
+	// Allocates a frame buffer and has every worker fault in the pages of its
+	// own share, so each tile starts out on the node of the worker that will
+	// usually render it.
+	bool CreateFrameBuffer(TiledFrameBuffer& frameBuffer)
+	{
+		if (!frameBuffer.Create(width, height, TILE_SIZE, tilesX, tileOrder))
+			return false;
+
+		CPUFrame frame;
+		frame.camera = Camera();
+		frame.samplesPerPixel = 0;
+		frame.maxDepth = 0;
+		frame.frameBuffer = &frameBuffer;
+		frame.firstTouch = true;
+		WaitFrame(SubmitFrame(frame));
+
+		return true;
+	}
+
+	// returns the index of the submitted frame, frames are numbered from 0. Only
+	// blocks while frame index - MAX_FRAMES_IN_FLIGHT is still being rendered.
+	int SubmitFrame(const CPUFrame& frame_)
+	{
+		int frameIndex = submittedFrame.load(std::memory_order_relaxed) + 1;
+		FrameSlot& slot = slots[frameIndex % MAX_FRAMES_IN_FLIGHT];
+		WaitFrame(frameIndex - MAX_FRAMES_IN_FLIGHT);
+
+		slot.frame = frame_;
+		slot.frameIndex.store(frameIndex, std::memory_order_relaxed);
+		slot.firstTouch.store(frame_.firstTouch, std::memory_order_relaxed);
+		// FindWork reads firstTouch after an acquire load that sees this
+		slot.tilesRemaining.store((int)tileOrder.size(), std::memory_order_release);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			slot.complete = false;
+		}
+
+		// a successful claim reads one of these, which publishes the frame above
+		for (unsigned int i = 0; i < workerCount; i++)
+			slot.sharesClaimed[i].store(false, std::memory_order_release);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			submittedFrame.store(frameIndex, std::memory_order_release);
+		}
+		frameSubmitted.notify_all();
+
+		return frameIndex;
+	}
+
+	void WaitFrame(int frameIndex_)
+	{
+		if (frameIndex_ < 0)
+			return;
+
+		FrameSlot& slot = slots[frameIndex_ % MAX_FRAMES_IN_FLIGHT];
+
+		std::unique_lock<std::mutex> lock(mutex);
+		frameCompleted.wait(lock, [&] { return slot.frameIndex.load() != frameIndex_ || slot.complete; });
+	}
+
+	Stats GetStats() const
+	{
+		Stats stats = { 0, 0, 0, 0, 0, topology.GetNodeCount(), (unsigned int)replicas.size(), 0, 0, 0 };
+		for (unsigned int i = 0; i < workerCount; i++)
+		{
+			stats.arenaPeakBytes = std::max(stats.arenaPeakBytes, workers[i].arenaPeak.load(std::memory_order_relaxed));
+			stats.arenaCapacityBytes += workers[i].arenaCapacity.load(std::memory_order_relaxed);
+			stats.arenaOverflows += workers[i].arenaOverflows.load(std::memory_order_relaxed);
+			stats.tilesRendered += workers[i].tilesRendered.load(std::memory_order_relaxed);
+			stats.tilesStolen += workers[i].tilesStolen.load(std::memory_order_relaxed);
+			stats.sharesClaimed += workers[i].sharesClaimed.load(std::memory_order_relaxed);
+			stats.remoteTiles += workers[i].remoteTiles.load(std::memory_order_relaxed);
+			stats.idleMicroseconds += workers[i].idleMicroseconds.load(std::memory_order_relaxed);
+		}
+
+		return stats;
+	}
+
+	unsigned int GetWorkerCount() const
+	{
+		return workerCount;
+	}
+
+	int GetWidth() const
+	{
+		return width;
+	}
+
+	int GetHeight() const
+	{
+		return height;
+	}
+private:
+	struct Worker
+	{
+		TileDeque deque;
+		std::thread thread;
+		int lastSeenFrame = -1;
+
+		unsigned int cpu = 0;
+		unsigned int node = 0;
+		bool pinned = false;
+		const Scene* scene = nullptr;
+		std::vector<unsigned int> victims;
+
+		std::atomic<uint64_t> tilesRendered{ 0 };
+		std::atomic<uint64_t> tilesStolen{ 0 };
+		std::atomic<uint64_t> sharesClaimed{ 0 };
+		std::atomic<uint64_t> remoteTiles{ 0 };
+		std::atomic<uint64_t> idleMicroseconds{ 0 };
+
+		// only touched by the worker thread itself, the atomics mirror it for GetStats
+		ScratchArena arena;
+		int arenaFrame = -1;
+		std::atomic<uint64_t> arenaPeak{ 0 };
+		std::atomic<uint64_t> arenaCapacity{ 0 };
+		std::atomic<uint64_t> arenaOverflows{ 0 };
+	};
+
+	struct FrameSlot
+	{
+		CPUFrame frame;
+		std::atomic<int> frameIndex;
+		bool complete;
+		std::atomic<int> tilesRemaining;
+		std::atomic<bool> firstTouch;	// frame.firstTouch, readable before a share is claimed
+		std::unique_ptr<std::atomic<bool>[]> sharesClaimed;
+	};
+
+	// a private copy of the read-only scene data per node
+	struct SceneReplica
+	{
+		Scene scene;
+		EnvironmentMap envMap;
+		TextureLayers textures;
+	};
+
+	static int64_t MakeItem(int frameIndex, int rank)
+	{
+		return (int64_t(frameIndex) << 32) | uint32_t(rank);
+	}
+
+	// each copy is made by a thread running on the target node so its pages
+	// are first touched there
+	void CreateReplicas()
+	{
+		replicas.resize(topology.GetNodeCount());
+		for (unsigned int node = 0; node < topology.GetNodeCount(); node++)
+		{
+			std::thread copier([this, node]()
+			{
+				PinCurrentThreadToCore(topology.GetCpus(node)[0]);
+
+				SceneReplica* replica = new SceneReplica;
+				replica->envMap = *scene->envMap;
+				replica->scene = *scene;
+				replica->scene.envMap = &replica->envMap;
+				if (scene->textures)
+				{
+					replica->textures = *scene->textures;
+					replica->scene.textures = &replica->textures;
+				}
+				replicas[node].reset(replica);
+			});
+			copier.join();
+		}
+	}
+
+	void BuildTileOrder(int width_, int height_)
+	{
+		width = width_;
+		height = height_;
+		tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+		tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+		unsigned int n = 1;
+		while (n < (unsigned int)tilesX || n < (unsigned int)tilesY)
+			n <<= 1;
+
+		tileOrder.clear();
+		for (unsigned int d = 0; d < n * n; d++)
+		{
+			unsigned int x, y;
+			HilbertToXY(n, d, x, y);
+			if (x < (unsigned int)tilesX && y < (unsigned int)tilesY)
+				tileOrder.push_back(y * tilesX + x);
+		}
+
+		shareSize = ((int)tileOrder.size() + workerCount - 1) / workerCount;
+		for (unsigned int i = 0; i < workerCount; i++)
+			workers[i].deque.Create(shareSize);
+	}
+
+	// seed a contiguous run of the Hilbert order into our own deque, in reverse
+	// so Pop walks it forward and thieves take from the far end
+	bool ClaimShare(unsigned int workerIndex, FrameSlot& slot, unsigned int share)
+	{
+		if (slot.sharesClaimed[share].exchange(true, std::memory_order_acq_rel))
+			return false;
+
+		// the slot may have been recycled since the caller looked at it, the flag
+		// we just read tells us which frame we really claimed
+		int frameIndex = slot.frameIndex.load(std::memory_order_relaxed);
+
+		int begin = share * shareSize;
+		int end = std::min(begin + shareSize, (int)tileOrder.size());
+		if (slot.frame.firstTouch)
+		{
+			// never stolen: the whole point is that the owner does it
+			for (int rank = begin; rank < end; rank++)
+			{
+				memset(slot.frame.frameBuffer->GetTile(rank), 0, slot.frame.frameBuffer->GetTileFloats() * sizeof(float));
+				slot.frame.frameBuffer->SetHomeNode(rank, workers[workerIndex].node);
+			}
+			CompleteTiles(slot, end - begin);
+
+			return false;
+		}
+
+		for (int rank = end - 1; rank >= begin; rank--)
+			workers[workerIndex].deque.Push(MakeItem(frameIndex, rank));
+
+		return end > begin;
+	}
+
+	bool FindWork(unsigned int workerIndex, int64_t& item)
+	{
+		Worker& worker = workers[workerIndex];
+		if (worker.deque.Pop(item))
+			return true;
+
+		// oldest frame first, so stragglers are helped before new work starts
+		int newest = submittedFrame.load(std::memory_order_acquire);
+		for (int frameIndex = std::max(0, newest - MAX_FRAMES_IN_FLIGHT + 1); frameIndex <= newest; frameIndex++)
+		{
+			FrameSlot& slot = slots[frameIndex % MAX_FRAMES_IN_FLIGHT];
+			if (slot.tilesRemaining.load(std::memory_order_acquire) == 0)
+				continue;
+
+			if (ClaimShare(workerIndex, slot, workerIndex))
+			{
+				worker.sharesClaimed.fetch_add(1, std::memory_order_relaxed);
+				if (worker.deque.Pop(item))
+					return true;
+			}
+
+			// first touch shares are only ever taken by their owner. The slot's
+			// previous frame had finished before this one was stored, so a non
+			// zero tilesRemaining above was this frame's and ordered its flag.
+			if (slot.firstTouch.load(std::memory_order_relaxed))
+				continue;
+
+			for (size_t i = 0; i < worker.victims.size(); i++)
+			{
+				if (ClaimShare(workerIndex, slot, worker.victims[i]))
+				{
+					worker.sharesClaimed.fetch_add(1, std::memory_order_relaxed);
+					if (worker.deque.Pop(item))
+						return true;
+				}
+			}
+
+			for (size_t i = 0; i < worker.victims.size(); i++)
+			{
+				if (workers[worker.victims[i]].deque.Steal(item))
+				{
+					worker.tilesStolen.fetch_add(1, std::memory_order_relaxed);
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	void RenderTile(Worker& worker, const CPUFrame& frame, int frameIndex, int rank)
+	{
+		int tile = tileOrder[rank];
+		int x0 = (tile % tilesX) * TILE_SIZE;
+		int y0 = (tile / tilesX) * TILE_SIZE;
+		int w = std::min((int)TILE_SIZE, width - x0);
+		int h = std::min((int)TILE_SIZE, height - y0);
+		int count = w * h;
+
+		if (worker.arenaFrame != frameIndex)
+		{
+			worker.arena.Reset();
+			worker.arenaFrame = frameIndex;
+		}
+		ScratchArena::Scope tileScope(worker.arena);
+
+		// one ray per pixel per pass; samples are indexed by frame and pass,
+		// so the sequence matches rendering pixel by pixel
+		Vector3* accum = worker.arena.AllocateArray<Vector3>(count);
+
+		for (int s = 0; s < frame.samplesPerPixel; s++)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				SamplerBegin(x0 + i % w, y0 + i / w, width, unsigned(frameIndex) * frame.samplesPerPixel + s);
+
+				float u = (x0 + i % w + GetUniform()) / width;
+				float v = (y0 + i / w + GetUniform()) / height;
+				Ray ray = CameraGetRay(frame.camera, u, v);
+				accum[i] += WorldTrace(*worker.scene, ray, frame.maxDepth);
+			}
+		}
+
+		float* tileColor = frame.frameBuffer->GetTile(rank);
+		for (int i = 0; i < count; i++)
+		{
+			Vector3 col = accum[i] / float(frame.samplesPerPixel);
+
+			float* dst = &tileColor[((i / w) * TILE_SIZE + (i % w)) * 3];
+			dst[0] = col.x;
+			dst[1] = col.y;
+			dst[2] = col.z;
+		}
+
+		worker.arenaPeak.store(worker.arena.GetPeak(), std::memory_order_relaxed);
+		worker.arenaCapacity.store(worker.arena.GetCapacity(), std::memory_order_relaxed);
+		worker.arenaOverflows.store(worker.arena.GetOverflows(), std::memory_order_relaxed);
+	}
+
+	void CompleteTiles(FrameSlot& slot, int count)
+	{
+		if (count > 0 && slot.tilesRemaining.fetch_sub(count, std::memory_order_acq_rel) == count)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				slot.complete = true;
+			}
+			frameCompleted.notify_all();
+		}
+	}
+
+	void WorkerMain(unsigned int workerIndex)
+	{
+		Worker& worker = workers[workerIndex];
+		if (worker.pinned)
+			PinCurrentThreadToCore(worker.cpu);
+
+		// created here so its pages are first touched on this worker's node
+		worker.arena.Create(arenaSize);
+
+		int spins = 0;
+		while (true)
+		{
+			int64_t item;
+			if (FindWork(workerIndex, item))
+			{
+				spins = 0;
+
+				int frameIndex = int(item >> 32);
+				int rank = int(item & 0xFFFFFFFF);
+				FrameSlot& slot = slots[frameIndex % MAX_FRAMES_IN_FLIGHT];
+				RenderTile(worker, slot.frame, frameIndex, rank);
+
+				worker.tilesRendered.fetch_add(1, std::memory_order_relaxed);
+				if (slot.frame.frameBuffer->GetHomeNode(rank) != (int)worker.node)
+					worker.remoteTiles.fetch_add(1, std::memory_order_relaxed);
+
+				CompleteTiles(slot, 1);
+				continue;
+			}
+
+			// a steal can fail on contention with work still around, spin a little first
+			if (++spins < 64)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			auto idleStart = std::chrono::steady_clock::now();
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (!running)
+					break;
+
+				int seen = worker.lastSeenFrame;
+				frameSubmitted.wait_for(lock, std::chrono::milliseconds(1), [&] { return !running || submittedFrame.load(std::memory_order_relaxed) != seen; });
+				worker.lastSeenFrame = submittedFrame.load(std::memory_order_relaxed);
+			}
+			worker.idleMicroseconds.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - idleStart).count(), std::memory_order_relaxed);
+			spins = 0;
+		}
+	}
+private:
+	const Scene* scene;
+	NumaTopology topology;
+	std::vector<std::unique_ptr<SceneReplica>> replicas;
+
+	unsigned int workerCount;
+	std::unique_ptr<Worker[]> workers;
+	FrameSlot slots[MAX_FRAMES_IN_FLIGHT];
+
+	int width;
+	int height;
+	int tilesX;
+	int tilesY;
+	int shareSize;
+	std::vector<int> tileOrder;
+	size_t arenaSize;
+
+	std::atomic<int> submittedFrame;
+	bool running;
+	std::mutex mutex;
+	std::condition_variable frameSubmitted;
+	std::condition_variable frameCompleted;
+};
+
+// Fixed set of worker threads running queued jobs in FIFO order.
+class ThreadPool
+{
+public:
+	ThreadPool()
+		: running(false)
+	{
+	}
+
+	~ThreadPool()
+	{
+		Destroy();
+	}
+
+	bool Create(unsigned int threadCount_)
+	{
+		unsigned int threadCount = threadCount_ ? threadCount_ : std::max(1u, std::thread::hardware_concurrency());
+
+		running = true;
+		for (unsigned int i = 0; i < threadCount; i++)
+			threads.push_back(std::thread(&ThreadPool::WorkerMain, this));
+
+		return true;
+	}
+
+	// finishes the jobs already queued, then joins
+	void Destroy()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		jobQueued.notify_all();
+
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+		threads.clear();
+	}
+
+	void Enqueue(std::function<void()> job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(std::move(job));
+		}
+		jobQueued.notify_one();
+	}
+
+	unsigned int GetThreadCount() const
+	{
+		return (unsigned int)threads.size();
+	}
+private:
+	void WorkerMain()
+	{
+		while (true)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				jobQueued.wait(lock, [this] { return !running || !jobs.empty(); });
+				if (jobs.empty())
+					break;
+
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+
+			job();
+		}
+	}
+private:
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> jobs;
+	bool running;
+	std::mutex mutex;
+	std::condition_variable jobQueued;
+};
+
+// A persistently mapped GL_PIXEL_UNPACK_BUFFER used as a ring. Any thread can
+// reserve a range and write texels straight into it; the GL thread uploads
+// from it and fences the range, which is recycled once the GPU has read it.
+class StagingRing
+{
+public:
+	StagingRing()
+		: handle(0)
+		, mapped(nullptr)
+		, size(0)
+		, head(0)
+		, tail(0)
+	{
+	}
+
+	~StagingRing()
+	{
+	}
+
+	// GL thread. Returns false when persistent mapping is unavailable, callers
+	// then upload from client memory.
+	bool Create(size_t size_)
+	{
+		if (!(GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage))
+			return false;
+
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		glGenBuffers(1, &handle);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, handle);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size_, nullptr, flags);
+		mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size_, flags);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		if (!mapped)
+		{
+			Destroy();
+			return false;
+		}
+
+		size = size_;
+		head = 0;
+		tail = 0;
+
+		return true;
+	}
+
+	// GL thread
+	void Destroy()
+	{
+		for (size_t i = 0; i < allocations.size(); i++)
+		{
+			if (allocations[i].fence)
+				glDeleteSync(allocations[i].fence);
+		}
+		allocations.clear();
+
+		if (handle)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, handle);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &handle);
+			handle = 0;
+		}
+		mapped = nullptr;
+		size = 0;
+	}
+
+	// any thread; on success the returned pointer is writable until Fence()
+	bool Reserve(size_t bytes, size_t& offset, void*& pointer)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!mapped)
+			return false;
+
+		// larger than the whole ring, the caller uploads from client memory
+		bytes = (bytes + 15) & ~size_t(15);
+		if (bytes > size)
+			return false;
+
+		// [tail, head) is in use, possibly wrapped around the end
+		size_t start = head;
+		if (allocations.empty())
+		{
+			start = 0;
+			head = 0;
+			tail = 0;
+		}
+		else if (head >= tail)
+		{
+			if (head + bytes > size)
+			{
+				if (bytes >= tail)
+					return false;
+
+				start = 0;
+			}
+		}
+		else if (head + bytes >= tail)
+		{
+			return false;
+		}
+
+		Allocation allocation;
+		allocation.offset = start;
+		allocation.size = bytes;
+		allocation.fence = 0;
+		allocations.push_back(allocation);
+		head = start + bytes;
+
+		offset = start;
+		pointer = mapped + start;
+
+		return true;
+	}
+
+	// GL thread, after the upload commands reading [offset, offset + bytes) are issued
+	void Fence(size_t offset)
+	{
+		GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < allocations.size(); i++)
+		{
+			if (allocations[i].offset == offset && !allocations[i].fence)
+			{
+				allocations[i].fence = fence;
+				return;
+			}
+		}
+		glDeleteSync(fence);
+	}
+
+	// GL thread, recycles ranges the GPU is done with, oldest first
+	void Retire()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		while (!allocations.empty() && allocations.front().fence)
+		{
+			GLenum status = glClientWaitSync(allocations.front().fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				break;
+
+			glDeleteSync(allocations.front().fence);
+			tail = allocations.front().offset + allocations.front().size;
+			allocations.pop_front();
+		}
+	}
+
+	unsigned int GetHandle() const
+	{
+		return handle;
+	}
+
+	bool IsMapped() const
+	{
+		return mapped != nullptr;
+	}
+private:
+	struct Allocation
+	{
+		size_t offset;
+		size_t size;
+		GLsync fence;
+	};
+
+	unsigned int handle;
+	unsigned char* mapped;
+	size_t size;
+	size_t head;
+	size_t tail;
+	std::deque<Allocation> allocations;
+	std::mutex mutex;
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+	MappedFile()
+		: data(nullptr)
+		, size(0)
+#ifdef _WIN32
+		, file(INVALID_HANDLE_VALUE)
+		, mapping(nullptr)
+#endif
+	{
+	}
+
+	~MappedFile()
+	{
+		Close();
+	}
+
+	bool Open(const char* path)
+	{
+		Close();
+
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+		{
+			Close();
+			return false;
+		}
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping)
+		{
+			Close();
+			return false;
+		}
+
+		data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		size = size_t(fileSize.QuadPart);
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+		{
+			close(fd);
+			return false;
+		}
+
+		void* memory = mmap(nullptr, size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		data = memory == MAP_FAILED ? nullptr : (const unsigned char*)memory;
+		size = size_t(fileStat.st_size);
+#endif
+
+		if (!data)
+		{
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data)
+			munmap((void*)data, size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const unsigned char* GetData() const
+	{
+		return data;
+	}
+
+	size_t GetSize() const
+	{
+		return size;
+	}
+private:
+	const unsigned char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+uint64_t HashFNV1a(const unsigned char* data, size_t size, uint64_t hash = 0xCBF29CE484222325ull)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 0x100000001B3ull;
+	}
+
+	return hash;
+}
+
+unsigned short FloatToHalf(float value)
+{
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	unsigned int sign = (bits >> 16) & 0x8000;
+	int exponent = int((bits >> 23) & 0xFF) - 127 + 15;
+	unsigned int mantissa = bits & 0x7FFFFF;
+
+	if (((bits >> 23) & 0xFF) == 0xFF)
+		return (unsigned short)(sign | 0x7C00 | (mantissa ? 0x200 : 0));	// inf, nan
+	if (exponent >= 31)
+		return (unsigned short)(sign | 0x7C00);								// overflow to inf
+	if (exponent <= 0)
+	{
+		if (exponent < -10)
+			return (unsigned short)sign;									// underflow to zero
+
+		// denormal, round to nearest
+		mantissa |= 0x800000;
+		unsigned int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+
+		return (unsigned short)(sign | half);
+	}
+
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)
+		half++;																// round, may carry into the exponent
+
+	return (unsigned short)half;
+}
+
+// GL_RGB9_E5 packing as given in EXT_texture_shared_exponent
+unsigned int FloatToRGB9E5(float r, float g, float b)
+{
+	const int N = 9;
+	const int B = 15;
+	const float sharedExpMax = 65408.0f;
+
+	float rc = std::min(std::max(r, 0.0f), sharedExpMax);
+	float gc = std::min(std::max(g, 0.0f), sharedExpMax);
+	float bc = std::min(std::max(b, 0.0f), sharedExpMax);
+	float maxrgb = std::max(rc, std::max(gc, bc));
+
+	int expShared = std::max(-B - 1, int(floorf(log2f(std::max(maxrgb, 1e-30f))))) + 1 + B;
+	int maxm = int(floorf(maxrgb / exp2f(float(expShared - B - N)) + 0.5f));
+	if (maxm == (1 << N))
+		expShared++;
+
+	float scale = exp2f(float(expShared - B - N));
+	unsigned int rm = (unsigned int)floorf(rc / scale + 0.5f);
+	unsigned int gm = (unsigned int)floorf(gc / scale + 0.5f);
+	unsigned int bm = (unsigned int)floorf(bc / scale + 0.5f);
+
+	return rm | (gm << 9) | (bm << 18) | ((unsigned int)expShared << 27);
+}
+
+float HalfToFloat(unsigned short half)
+{
+	unsigned int exponent = (half >> 10) & 0x1F;
+	unsigned int mantissa = half & 0x3FF;
+
+	float value;
+	if (exponent == 0)
+		value = ldexpf(float(mantissa), -24);									// zero, denormal
+	else if (exponent == 31)
+		value = mantissa ? NAN : INFINITY;
+	else
+		value = ldexpf(float(mantissa | 0x400), int(exponent) - 25);
+
+	return (half & 0x8000) ? -value : value;
+}
+
+void RGB9E5ToFloat(unsigned int packed, float* rgb)
+{
+	float scale = exp2f(float(int(packed >> 27) - 15 - 9));
+	rgb[0] = float(packed & 0x1FF) * scale;
+	rgb[1] = float((packed >> 9) & 0x1FF) * scale;
+	rgb[2] = float((packed >> 18) & 0x1FF) * scale;
+}
+
+// GL_R11F_G11F_B10F packing: unsigned floats with a 5 bit exponent and 6, 6
+// and 5 bit mantissas, which are halfs without the sign and low mantissa bits.
+// Ties round to even, box filtered mips hit them often enough to drift.
+unsigned int FloatToR11G11B10F(float r, float g, float b)
+{
+	auto pack = [](float value, unsigned int dropped) -> unsigned int
+	{
+		unsigned int half = FloatToHalf(value > 0.0f ? value : 0.0f);
+		unsigned int largest = 0x7BFFu >> dropped;
+		unsigned int rounding = (1u << (dropped - 1)) - 1 + ((half >> dropped) & 1);
+		return std::min((half + rounding) >> dropped, largest);
+	};
+
+	return pack(r, 4) | (pack(g, 4) << 11) | (pack(b, 5) << 22);
+}
+
+void R11G11B10FToFloat(unsigned int packed, float* rgb)
+{
+	rgb[0] = HalfToFloat((unsigned short)((packed & 0x7FF) << 4));
+	rgb[1] = HalfToFloat((unsigned short)(((packed >> 11) & 0x7FF) << 4));
+	rgb[2] = HalfToFloat((unsigned short)(((packed >> 22) & 0x3FF) << 5));
+}
+
+// A GPU-ready mip chain: every level is laid out exactly as glTexImage2D wants
+// it, either in memory owned here or inside a mapped cache file.
+struct TextureImage
+{
+	enum
+	{
+		MAX_LEVELS = 16
+	};
+
+	int width = 0;
+	int height = 0;
+	int levelCount = 0;
+	unsigned int internalFormat = 0;
+	unsigned int format = 0;
+	unsigned int pixelFormat = 0;
+	size_t levelOffsets[MAX_LEVELS] = {};
+	size_t levelSizes[MAX_LEVELS] = {};
+
+	const unsigned char* data = nullptr; // level offsets are relative to this
+	size_t size = 0;
+	std::vector<unsigned char> storage;
+	MappedFile mapping;
+};
+
+// Reads a Radiance RGBE (.hdr) image one scanline at a time, flat or run
+// length encoded, converting to floats the way stbi_loadf does. Only the
+// "-Y H +X W" orientation is accepted, which is also all stbi reads.
+class RadianceReader
+{
+public:
+	RadianceReader()
+		: cursor(nullptr)
+		, end(nullptr)
+		, width(0)
+		, height(0)
+		, row(0)
+		, flat(false)
+	{
+	}
+
+	~RadianceReader()
+	{
+	}
+
+	bool Open(const unsigned char* data_, size_t size_)
+	{
+		cursor = data_;
+		end = data_ + size_;
+		row = 0;
+		flat = false;
+
+		std::string line;
+		if (!ReadLine(line) || (line != "#?RADIANCE" && line != "#?RGBE"))
+			return false;
+
+		while (true)
+		{
+			if (!ReadLine(line))
+				return false;
+			if (line.empty())
+				break;
+			if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe")
+				return false;
+		}
+
+		if (!ReadLine(line) || sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0)
+			return false;
+
+		rgbe.resize(size_t(width) * 4);
+
+		return true;
+	}
+
+	int GetWidth() const
+	{
+		return width;
+	}
+
+	int GetHeight() const
+	{
+		return height;
+	}
+
+	// rgb_ gets width * 3 floats, rows come top first
+	bool ReadRow(float* rgb_)
+	{
+		if (row >= height)
+			return false;
+		row++;
+
+		if (!flat && !ReadRLERow())
+			flat = true;
+
+		if (flat)
+		{
+			if (size_t(end - cursor) < rgbe.size())
+				return false;
+			memcpy(rgbe.data(), cursor, rgbe.size());
+			cursor += rgbe.size();
+		}
+
+		for (int x = 0; x < width; x++)
+		{
+			const unsigned char* texel = &rgbe[size_t(x) * 4];
+			float scale = texel[3] ? ldexpf(1.0f, int(texel[3]) - (128 + 8)) : 0.0f;
+			rgb_[x * 3 + 0] = texel[0] * scale;
+			rgb_[x * 3 + 1] = texel[1] * scale;
+			rgb_[x * 3 + 2] = texel[2] * scale;
+		}
+
+		return true;
+	}
+private:
+	bool ReadLine(std::string& line_)
+	{
+		line_.clear();
+		while (cursor < end && *cursor != '\n')
+			line_ += char(*cursor++);
+		if (cursor == end)
+			return false;
+		cursor++;
+
+		return true;
+	}
+
+	// new style RLE keeps each channel of a row in its own run coded block. As
+	// with stbi, a row without the 2 2 hi lo marker means the image is flat
+	// from there on, and the cursor stays put so the row reads flat.
+	bool ReadRLERow()
+	{
+		if (width < 8 || width >= 32768 || end - cursor < 4 ||
+			cursor[0] != 2 || cursor[1] != 2 || (cursor[2] & 0x80) || ((cursor[2] << 8) | cursor[3]) != width)
+			return false;
+		cursor += 4;
+
+		for (int channel = 0; channel < 4; channel++)
+		{
+			int x = 0;
+			while (x < width)
+			{
+				if (cursor == end)
+					return Truncate();
+
+				int count = *cursor++;
+				if (count > 128)
+				{
+					count -= 128;
+					if (cursor == end || count > width - x)
+						return Truncate();
+					for (int i = 0; i < count; i++)
+						rgbe[size_t(x++) * 4 + channel] = *cursor;
+					cursor++;
+				}
+				else
+				{
+					if (count == 0 || count > width - x || end - cursor < count)
+						return Truncate();
+					for (int i = 0; i < count; i++)
+						rgbe[size_t(x++) * 4 + channel] = *cursor++;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// a damaged row fails the flat read that follows
+	bool Truncate()
+	{
+		cursor = end;
+		return false;
+	}
+private:
+	const unsigned char* cursor;
+	const unsigned char* end;
+	int width;
+	int height;
+	int row;
+	bool flat;
+	std::vector<unsigned char> rgbe;
+};
+
+// Turns a Radiance image into a mip chain in a sized GL format without ever
+// holding it as floats: level 0 is encoded as the scanlines decode and every
+// smaller level is box filtered from the encoded level above, two rows at a
+// time. HDR_AUTO first measures what the two 4 byte formats lose on the image
+// and takes RGB16F, at 6 bytes, only when neither holds it closely enough.
+class HDRImageBuilder
+{
+public:
+	enum HDRFormat
+	{
+		HDR_AUTO,
+		HDR_RGB9E5,
+		HDR_R11G11B10F,
+		HDR_RGB16F
+	};
+
+	// thread safe
+	static bool Build(const unsigned char* data_, size_t size_, HDRFormat format_, TextureImage& image_)
+	{
+		RadianceReader reader;
+		if (!reader.Open(data_, size_))
+			return false;
+
+		int width = reader.GetWidth();
+		int height = reader.GetHeight();
+		std::vector<float> rgb(size_t(width) * 3 * 2);
+
+		if (format_ == HDR_AUTO)
+		{
+			Quality quality;
+			for (int y = 0; y < height; y++)
+			{
+				if (!reader.ReadRow(rgb.data()))
+					return false;
+				quality.AddRow(rgb.data(), width);
+			}
+
+			format_ = quality.Choose();
+			reader.Open(data_, size_);
+		}
+
+		image_.width = width;
+		image_.height = height;
+		GetGLFormats(format_, image_.internalFormat, image_.format, image_.pixelFormat);
+
+		size_t texelSize = GetTexelSize(format_);
+		size_t offset = 0;
+		image_.levelCount = 0;
+		while (true)
+		{
+			int levelWidth = std::max(1, width >> image_.levelCount);
+			int levelHeight = std::max(1, height >> image_.levelCount);
+			image_.levelOffsets[image_.levelCount] = offset;
+			image_.levelSizes[image_.levelCount] = size_t(levelWidth) * levelHeight * texelSize;
+			offset += image_.levelSizes[image_.levelCount];
+			image_.levelCount++;
+
+			if ((levelWidth == 1 && levelHeight == 1) || image_.levelCount == TextureImage::MAX_LEVELS)
+				break;
+		}
+		image_.storage.resize(offset);
+		unsigned char* storage = image_.storage.data();
+
+		for (int y = 0; y < height; y++)
+		{
+			if (!reader.ReadRow(rgb.data()))
+				return false;
+			EncodeRow(format_, rgb.data(), width, storage + size_t(y) * width * texelSize);
+		}
+
+		for (int level = 1; level < image_.levelCount; level++)
+		{
+			int parentWidth = std::max(1, width >> (level - 1));
+			int parentHeight = std::max(1, height >> (level - 1));
+			int levelWidth = std::max(1, width >> level);
+			int levelHeight = std::max(1, height >> level);
+			const unsigned char* parent = storage + image_.levelOffsets[level - 1];
+			float* row0 = rgb.data();
+			float* row1 = rgb.data() + size_t(parentWidth) * 3;
+
+			for (int y = 0; y < levelHeight; y++)
+			{
+				int y0 = std::min(y * 2, parentHeight - 1);
+				int y1 = std::min(y * 2 + 1, parentHeight - 1);
+				DecodeRow(format_, parent + size_t(y0) * parentWidth * texelSize, parentWidth, row0);
+				DecodeRow(format_, parent + size_t(y1) * parentWidth * texelSize, parentWidth, row1);
+
+				// filtered in place, texel x only reads parent texels 2x and 2x + 1
+				for (int x = 0; x < levelWidth; x++)
+				{
+					int x0 = std::min(x * 2, parentWidth - 1);
+					int x1 = std::min(x * 2 + 1, parentWidth - 1);
+					for (int c = 0; c < 3; c++)
+						row0[x * 3 + c] = 0.25f * (row0[x0 * 3 + c] + row0[x1 * 3 + c] + row1[x0 * 3 + c] + row1[x1 * 3 + c]);
+				}
+
+				EncodeRow(format_, row0, levelWidth, storage + image_.levelOffsets[level] + size_t(y) * levelWidth * texelSize);
+			}
+		}
+
+		image_.data = storage;
+		image_.size = image_.storage.size();
+
+		return true;
+	}
+
+	static unsigned int GetTexelSize(HDRFormat format_)
+	{
+		return format_ == HDR_RGB16F ? 6 : 4;
+	}
+
+	static void GetGLFormats(HDRFormat hdrFormat_, unsigned int& internalFormat_, unsigned int& format_, unsigned int& pixelFormat_)
+	{
+		format_ = GL_RGB;
+		if (hdrFormat_ == HDR_RGB16F)
+		{
+			internalFormat_ = GL_RGB16F;
+			pixelFormat_ = GL_HALF_FLOAT;
+		}
+		else if (hdrFormat_ == HDR_R11G11B10F)
+		{
+			internalFormat_ = GL_R11F_G11F_B10F;
+			pixelFormat_ = GL_UNSIGNED_INT_10F_11F_11F_REV;
+		}
+		else
+		{
+			internalFormat_ = GL_RGB9_E5;
+			pixelFormat_ = GL_UNSIGNED_INT_5_9_9_9_REV;
+		}
+	}
+private:
+	// Error of each 4 byte format relative to the texel's luminance, so a
+	// shared exponent flattening the dim channel of a saturated texel counts
+	// for what it does to its brightness. A format passes when it is off by
+	// less than 1/256 on average and 1/16 at worst.
+	struct Quality
+	{
+		double errorSums[2] = {};
+		float maxErrors[2] = {};
+		size_t count = 0;
+
+		void AddRow(const float* rgb_, int width_)
+		{
+			for (int x = 0; x < width_; x++)
+			{
+				const float* texel = &rgb_[x * 3];
+				float luminance = Luminance(texel);
+				if (luminance < 1e-4f)
+					continue;
+
+				float decoded[2][3];
+				RGB9E5ToFloat(FloatToRGB9E5(texel[0], texel[1], texel[2]), decoded[0]);
+				R11G11B10FToFloat(FloatToR11G11B10F(texel[0], texel[1], texel[2]), decoded[1]);
+				for (int i = 0; i < 2; i++)
+				{
+					float difference[3] = { fabsf(decoded[i][0] - texel[0]), fabsf(decoded[i][1] - texel[1]), fabsf(decoded[i][2] - texel[2]) };
+					float error = Luminance(difference) / luminance;
+					errorSums[i] += error;
+					maxErrors[i] = std::max(maxErrors[i], error);
+				}
+				count++;
+			}
+		}
+
+		HDRFormat Choose() const
+		{
+			if (!count)
+				return HDR_RGB9E5;
+
+			int best = errorSums[0] <= errorSums[1] ? 0 : 1;
+			if (errorSums[best] / count > 1.0 / 256.0 || maxErrors[best] > 1.0f / 16.0f)
+				return HDR_RGB16F;
+
+			return best == 0 ? HDR_RGB9E5 : HDR_R11G11B10F;
+		}
+
+		static float Luminance(const float* rgb_)
+		{
+			return 0.2126f * rgb_[0] + 0.7152f * rgb_[1] + 0.0722f * rgb_[2];
+		}
+	};
+
+	static void EncodeRow(HDRFormat format_, const float* rgb_, int width_, unsigned char* texels_)
+	{
+		for (int x = 0; x < width_; x++)
+		{
+			const float* texel = &rgb_[x * 3];
+			if (format_ == HDR_RGB16F)
+			{
+				unsigned short halfs[3] = { FloatToHalf(texel[0]), FloatToHalf(texel[1]), FloatToHalf(texel[2]) };
+				memcpy(&texels_[size_t(x) * 6], halfs, 6);
+			}
+			else
+			{
+				unsigned int packed = format_ == HDR_R11G11B10F ? FloatToR11G11B10F(texel[0], texel[1], texel[2]) : FloatToRGB9E5(texel[0], texel[1], texel[2]);
+				memcpy(&texels_[size_t(x) * 4], &packed, 4);
+			}
+		}
+	}
+
+	static void DecodeRow(HDRFormat format_, const unsigned char* texels_, int width_, float* rgb_)
+	{
+		for (int x = 0; x < width_; x++)
+		{
+			float* texel = &rgb_[x * 3];
+			if (format_ == HDR_RGB16F)
+			{
+				unsigned short halfs[3];
+				memcpy(halfs, &texels_[size_t(x) * 6], 6);
+				texel[0] = HalfToFloat(halfs[0]);
+				texel[1] = HalfToFloat(halfs[1]);
+				texel[2] = HalfToFloat(halfs[2]);
+			}
+			else
+			{
+				unsigned int packed;
+				memcpy(&packed, &texels_[size_t(x) * 4], 4);
+				if (format_ == HDR_R11G11B10F)
+					R11G11B10FToFloat(packed, texel);
+				else
+					RGB9E5ToFloat(packed, texel);
+			}
+		}
+	}
+};
+
+// On-disk cache of decoded, mipmapped texels keyed by a hash of the source
+// file's bytes. A hit maps the cache file and hands its levels out as they
+// are, so neither stbi decoding nor glGenerateMipmap run again. LDR images are
+// stored as RGBA8, HDR images in the sized format HDRImageBuilder gives them.
+class TextureCache
+{
+public:
+	TextureCache()
+		: hdrFormat(HDRImageBuilder::HDR_AUTO)
+		, hits(0)
+		, misses(0)
+	{
+	}
+
+	~TextureCache()
+	{
+	}
+
+	bool Create(const char* directory_, HDRImageBuilder::HDRFormat hdrFormat_)
+	{
+		directory = directory_;
+		hdrFormat = hdrFormat_;
+
+#ifdef _WIN32
+		_mkdir(directory.c_str());
+#else
+		mkdir(directory.c_str(), 0755);
+#endif
+
+		return true;
+	}
+
+	// thread safe
+	bool Load(const char* path, TextureImage& image)
+	{
+		MappedFile source;
+		if (!source.Open(path))
+			return false;
+
+		uint64_t hash = HashFNV1a(source.GetData(), source.GetSize());
+		hash = HashFNV1a((const unsigned char*)&hdrFormat, sizeof(hdrFormat), hash);
+
+		std::string cachePath = GetCachePath(hash);
+		if (LoadCacheFile(cachePath.c_str(), hash, image))
+		{
+			hits++;
+			return true;
+		}
+		misses++;
+
+		if (!Build(source, image))
+			return false;
+
+		WriteCacheFile(cachePath, hash, image);
+
+		return true;
+	}
+
+	// thread safe, a material layer: one size_ x size_ RGBA8 level box
+	// filtered like TextureLayers::SetLayer, keyed by the source and the size
+	bool LoadLayer(const char* path, int size_, TextureImage& image)
+	{
+		MappedFile source;
+		if (!source.Open(path))
+			return false;
+
+		static const char tag[] = "layer";
+		uint64_t hash = HashFNV1a(source.GetData(), source.GetSize());
+		hash = HashFNV1a((const unsigned char*)tag, sizeof(tag), hash);
+		hash = HashFNV1a((const unsigned char*)&size_, sizeof(size_), hash);
+
+		std::string cachePath = GetCachePath(hash);
+		if (LoadCacheFile(cachePath.c_str(), hash, image))
+		{
+			if (image.levelSizes[0] == size_t(size_) * size_ * 4)
+			{
+				hits++;
+				return true;
+			}
+			image.mapping.Close();
+		}
+		misses++;
+
+		if (!BuildLayer(source, size_, image))
+			return false;
+
+		WriteCacheFile(cachePath, hash, image);
+
+		return true;
+	}
+
+	unsigned int GetHits() const
+	{
+		return hits;
+	}
+
+	unsigned int GetMisses() const
+	{
+		return misses;
+	}
+private:
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t sourceHash;
+		uint32_t width;
+		uint32_t height;
+		uint32_t levelCount;
+		uint32_t internalFormat;
+		uint32_t format;
+		uint32_t pixelFormat;
+		uint64_t levelOffsets[TextureImage::MAX_LEVELS];
+		uint64_t levelSizes[TextureImage::MAX_LEVELS];
+	};
+
+	enum
+	{
+		VERSION = 2
+	};
+
+	std::string GetCachePath(uint64_t hash) const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.texcache", (unsigned long long)hash);
+		return directory + name;
+	}
+
+	bool LoadCacheFile(const char* cachePath, uint64_t hash, TextureImage& image)
+	{
+		if (!image.mapping.Open(cachePath))
+			return false;
+
+		const unsigned char* file = image.mapping.GetData();
+		size_t fileSize = image.mapping.GetSize();
+
+		Header header;
+		if (fileSize < sizeof(header))
+			return false;
+		memcpy(&header, file, sizeof(header));
+
+		if (memcmp(header.magic, "GTXC", 4) != 0 || header.version != VERSION || header.sourceHash != hash ||
+			header.levelCount == 0 || header.levelCount > TextureImage::MAX_LEVELS)
+		{
+			image.mapping.Close();
+			return false;
+		}
+
+		for (uint32_t level = 0; level < header.levelCount; level++)
+		{
+			if (header.levelOffsets[level] + header.levelSizes[level] > fileSize)
+			{
+				image.mapping.Close();
+				return false;
+			}
+
+			image.levelOffsets[level] = size_t(header.levelOffsets[level]);
+			image.levelSizes[level] = size_t(header.levelSizes[level]);
+		}
+
+		image.width = header.width;
+		image.height = header.height;
+		image.levelCount = header.levelCount;
+		image.internalFormat = header.internalFormat;
+		image.format = header.format;
+		image.pixelFormat = header.pixelFormat;
+		image.data = file;
+		image.size = fileSize;
+
+		return true;
+	}
+
+	void WriteCacheFile(const std::string& cachePath, uint64_t hash, const TextureImage& image)
+	{
+		Header header = {};
+		memcpy(header.magic, "GTXC", 4);
+		header.version = VERSION;
+		header.sourceHash = hash;
+		header.width = image.width;
+		header.height = image.height;
+		header.levelCount = image.levelCount;
+		header.internalFormat = image.internalFormat;
+		header.format = image.format;
+		header.pixelFormat = image.pixelFormat;
+
+		// levels follow the header, each 16 byte aligned
+		uint64_t offset = (sizeof(header) + 15) & ~uint64_t(15);
+		for (int level = 0; level < image.levelCount; level++)
+		{
+			header.levelOffsets[level] = offset;
+			header.levelSizes[level] = image.levelSizes[level];
+			offset = (offset + image.levelSizes[level] + 15) & ~uint64_t(15);
+		}
+
+		// written under a temporary name so a reader never maps a partial file
+		std::string tempPath = cachePath + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+		std::ofstream file(tempPath.c_str(), std::ios::binary);
+		if (!file)
+			return;
+
+		static const char zeros[16] = {};
+		file.write((const char*)&header, sizeof(header));
+		file.write(zeros, header.levelOffsets[0] - sizeof(header));
+		for (int level = 0; level < image.levelCount; level++)
+		{
+			file.write((const char*)image.data + image.levelOffsets[level], image.levelSizes[level]);
+			file.write(zeros, ((image.levelSizes[level] + 15) & ~size_t(15)) - image.levelSizes[level]);
+		}
+		file.close();
+
+		if (!file || std::rename(tempPath.c_str(), cachePath.c_str()) != 0)
+			std::remove(tempPath.c_str());
+	}
+
+	// decode with stbi, box filter the mip chain in float and encode each level.
+	// HDR images stream through HDRImageBuilder instead.
+	bool Build(const MappedFile& source, TextureImage& image)
+	{
+		if (stbi_is_hdr_from_memory(source.GetData(), (int)source.GetSize()))
+			return HDRImageBuilder::Build(source.GetData(), source.GetSize(), hdrFormat, image);
+
+		int width, height, nrComponents;
+		unsigned char* data = stbi_load_from_memory(source.GetData(), (int)source.GetSize(), &width, &height, &nrComponents, 0);
+		if (!data)
+			return false;
+
+		// same channel mapping as uploading the stbi result as GL_RED/GL_RGB/GL_RGBA
+		std::vector<float> texels(size_t(width) * height * 4);
+		for (size_t i = 0; i < size_t(width) * height; i++)
+		{
+			const unsigned char* src = &data[i * nrComponents];
+			texels[i * 4 + 0] = src[0];
+			texels[i * 4 + 1] = nrComponents >= 3 ? src[1] : 0.0f;
+			texels[i * 4 + 2] = nrComponents >= 3 ? src[2] : 0.0f;
+			texels[i * 4 + 3] = nrComponents == 4 ? src[3] : 255.0f;
+		}
+		stbi_image_free(data);
+
+		image.width = width;
+		image.height = height;
+		image.internalFormat = GL_RGBA8;
+		image.format = GL_RGBA;
+		image.pixelFormat = GL_UNSIGNED_BYTE;
+
+		image.levelCount = 0;
+		int levelWidth = width;
+		int levelHeight = height;
+		while (true)
+		{
+			size_t texelCount = size_t(levelWidth) * levelHeight;
+			size_t offset = image.storage.size();
+			image.levelOffsets[image.levelCount] = offset;
+
+			image.storage.resize(offset + texelCount * 4);
+			for (size_t i = 0; i < texelCount * 4; i++)
+				image.storage[offset + i] = (unsigned char)std::min(255.0f, texels[i] + 0.5f);
+			image.levelSizes[image.levelCount] = image.storage.size() - offset;
+			image.levelCount++;
+
+			if ((levelWidth == 1 && levelHeight == 1) || image.levelCount == TextureImage::MAX_LEVELS)
+				break;
+
+			int nextWidth = std::max(1, levelWidth / 2);
+			int nextHeight = std::max(1, levelHeight / 2);
+			std::vector<float> next(size_t(nextWidth) * nextHeight * 4);
+			for (int y = 0; y < nextHeight; y++)
+			{
+				for (int x = 0; x < nextWidth; x++)
+				{
+					int x0 = std::min(x * 2, levelWidth - 1);
+					int x1 = std::min(x * 2 + 1, levelWidth - 1);
+					int y0 = std::min(y * 2, levelHeight - 1);
+					int y1 = std::min(y * 2 + 1, levelHeight - 1);
+					for (int c = 0; c < 4; c++)
+					{
+						next[(size_t(y) * nextWidth + x) * 4 + c] = 0.25f * (
+							texels[(size_t(y0) * levelWidth + x0) * 4 + c] + texels[(size_t(y0) * levelWidth + x1) * 4 + c] +
+							texels[(size_t(y1) * levelWidth + x0) * 4 + c] + texels[(size_t(y1) * levelWidth + x1) * 4 + c]);
+					}
+				}
+			}
+			texels.swap(next);
+			levelWidth = nextWidth;
+			levelHeight = nextHeight;
+		}
+
+		image.data = image.storage.data();
+		image.size = image.storage.size();
+
+		return true;
+	}
+
+	bool BuildLayer(const MappedFile& source, int size, TextureImage& image)
+	{
+		int width, height, nrComponents;
+		unsigned char* data = stbi_load_from_memory(source.GetData(), (int)source.GetSize(), &width, &height, &nrComponents, 4);
+		if (!data)
+			return false;
+
+		image.storage.resize(size_t(size) * size * 4);
+		TextureLayers::BoxFilter(data, width, height, size, image.storage.data());
+		stbi_image_free(data);
+
+		image.width = size;
+		image.height = size;
+		image.levelCount = 1;
+		image.internalFormat = GL_RGBA8;
+		image.format = GL_RGBA;
+		image.pixelFormat = GL_UNSIGNED_BYTE;
+		image.levelOffsets[0] = 0;
+		image.levelSizes[0] = image.storage.size();
+		image.data = image.storage.data();
+		image.size = image.storage.size();
+
+		return true;
+	}
+private:
+	std::string directory;
+	HDRImageBuilder::HDRFormat hdrFormat;
+	std::atomic<unsigned int> hits;
+	std::atomic<unsigned int> misses;
+};
+
+// Decodes image files on a thread pool and uploads them through the staging
+// ring as they finish. Load() hands back immediately with a 1x1 placeholder
+// in the texture, which keeps its GL name when the real texels replace it, so
+// rendering can start before anything has been decoded.
+class TextureLoader
+{
+public:
+	TextureLoader()
+		: pool(nullptr)
+		, cache(nullptr)
+		, hdrFormat(HDRImageBuilder::HDR_AUTO)
+		, pending(0)
+	{
+	}
+
+	~TextureLoader()
+	{
+	}
+
+	// cache_ may be null, every load then decodes the source image, HDR ones
+	// into hdrFormat_
+	bool Create(ThreadPool* pool_, size_t stagingSize_, TextureCache* cache_ = nullptr, HDRImageBuilder::HDRFormat hdrFormat_ = HDRImageBuilder::HDR_AUTO)
+	{
+		pool = pool_;
+		cache = cache_;
+		hdrFormat = hdrFormat_;
+		pending = 0;
+
+		if (!staging.Create(stagingSize_))
+			std::cout << "TextureLoader: persistent mapping unavailable, uploading from client memory" << std::endl;
+
+		return true;
+	}
+
+	// GL thread, waits for decodes still in flight
+	void Destroy()
+	{
+		while (pending > 0)
+		{
+			Update(~size_t(0));
+			std::this_thread::yield();
+		}
+
+		staging.Destroy();
+	}
+
+	void Load(Texture2D& texture_, const char* path_, float placeholderR_ = 0.5f, float placeholderG_ = 0.5f, float placeholderB_ = 0.5f)
+	{
+		float placeholder[] = { placeholderR_, placeholderG_, placeholderB_, 1.0f };
+		texture_.Create(1, 1, 4, true, placeholder);
+
+		std::shared_ptr<Request> request(new Request);
+		request->texture = &texture_;
+		request->path = path_;
+		pending++;
+
+		pool->Enqueue([this, request]()
+		{
+			Decode(*request);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			decoded.push_back(request);
+		});
+	}
+
+	// a material texture, box filtered to the array's layer size into both the
+	// CPU copy and the GL layer. With a cache the filtered layer is kept there,
+	// so later runs skip the decode and the filter.
+	void Load(TextureArray& array_, TextureLayers& layers_, int layer_, const char* path_)
+	{
+		std::shared_ptr<Request> request(new Request);
+		request->array = &array_;
+		request->layers = &layers_;
+		request->layer = layer_;
+		request->path = path_;
+		pending++;
+
+		pool->Enqueue([this, request]()
+		{
+			DecodeLayer(*request);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			decoded.push_back(request);
+		});
+	}
+
+	// GL thread, once per frame. Uploads finished decodes until about
+	// uploadBudget_ bytes have gone out, at least one per call.
+	void Update(size_t uploadBudget_)
+	{
+		staging.Retire();
+
+		size_t uploaded = 0;
+		while (uploaded < uploadBudget_)
+		{
+			std::shared_ptr<Request> request;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (decoded.empty())
+					break;
+
+				request = decoded.front();
+				decoded.pop_front();
+			}
+
+			Upload(*request);
+			uploaded += request->size;
+			pending--;
+		}
+	}
+
+	int GetPendingCount() const
+	{
+		return pending;
+	}
+private:
+	struct Request
+	{
+		Texture2D* texture = nullptr;
+		TextureArray* array = nullptr;
+		TextureLayers* layers = nullptr;
+		int layer = 0;
+		std::string path;
+
+		int width = 0;
+		int height = 0;
+		int nrComponents = 0;
+		size_t size = 0;
+
+		void* data = nullptr; // stbi memory, if it did not fit in the staging ring
+		std::unique_ptr<TextureImage> image; // mip chain from the texture cache or HDRImageBuilder
+		bool staged = false;
+		size_t stagingOffset = 0;
+	};
+
+	// moves the image's levels into the staging ring, keeping its layout
+	bool StageImage(Request& request)
+	{
+		TextureImage& image = *request.image;
+
+		void* pointer;
+		if (!staging.Reserve(request.size, request.stagingOffset, pointer))
+			return false;
+
+		memcpy(pointer, image.data + image.levelOffsets[0], request.size);
+		image.storage.clear();
+		image.storage.shrink_to_fit();
+		image.mapping.Close();
+		image.data = nullptr;
+		request.staged = true;
+
+		return true;
+	}
+
+	// pool thread
+	void Decode(Request& request)
+	{
+		if (cache || stbi_is_hdr(request.path.c_str()))
+		{
+			request.image.reset(new TextureImage);
+			if (!(cache ? cache->Load(request.path.c_str(), *request.image) : BuildHDRImage(request.path.c_str(), *request.image)))
+			{
+				request.image.reset();
+				return;
+			}
+
+			request.size = request.image->size - request.image->levelOffsets[0];
+			StageImage(request);
+
+			return;
+		}
+
+		request.data = stbi_load(request.path.c_str(), &request.width, &request.height, &request.nrComponents, 0);
+		if (!request.data)
+			return;
+
+		request.size = size_t(request.width) * request.height * request.nrComponents;
+
+		void* pointer;
+		if (staging.Reserve(request.size, request.stagingOffset, pointer))
+		{
+			memcpy(pointer, request.data, request.size);
+			stbi_image_free(request.data);
+			request.data = nullptr;
+			request.staged = true;
+		}
+	}
+
+	// pool thread, without a cache the source is converted straight into GL
+	// ready levels, with no float copy in between
+	bool BuildHDRImage(const char* path, TextureImage& image)
+	{
+		MappedFile source;
+		if (!source.Open(path))
+			return false;
+
+		return HDRImageBuilder::Build(source.GetData(), source.GetSize(), hdrFormat, image);
+	}
+
+	// pool thread, fills the CPU copy of the layer and stages it for the GL one
+	void DecodeLayer(Request& request)
+	{
+		int size = request.layers->GetSize();
+		if (cache)
+		{
+			TextureImage image;
+			if (!cache->LoadLayer(request.path.c_str(), size, image))
+				return;
+
+			request.layers->SetLayer(request.layer, image.data + image.levelOffsets[0], size, size);
+		}
+		else
+		{
+			unsigned char* data = stbi_load(request.path.c_str(), &request.width, &request.height, &request.nrComponents, 4);
+			if (!data)
+				return;
+
+			request.layers->SetLayer(request.layer, data, request.width, request.height);
+			stbi_image_free(data);
+		}
+		request.size = size_t(size) * size * 4;
+
+		StageLayer(request);
+	}
+
+	// copies the finished CPU layer into the staging ring
+	bool StageLayer(Request& request)
+	{
+		void* pointer;
+		if (!staging.Reserve(request.size, request.stagingOffset, pointer))
+			return false;
+
+		memcpy(pointer, request.layers->GetLayer(request.layer), request.size);
+		request.staged = true;
+
+		return true;
+	}
+
+	// GL thread
+	void Upload(Request& request)
+	{
+		if (request.array)
+		{
+			UploadLayer(request);
+			return;
+		}
+
+		if (request.image)
+		{
+			UploadImage(request);
+			return;
+		}
+
+		if (!request.staged && !request.data)
+		{
+			std::cout << "TextureLoader: failed to load " << request.path << ", keeping placeholder" << std::endl;
+			return;
+		}
+
+		// decoded while the ring was full, try again now that it has drained
+		void* pointer;
+		if (!request.staged && staging.Reserve(request.size, request.stagingOffset, pointer))
+		{
+			memcpy(pointer, request.data, request.size);
+			stbi_image_free(request.data);
+			request.data = nullptr;
+			request.staged = true;
+		}
+
+		if (request.staged)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.GetHandle());
+			request.texture->Create(request.width, request.height, request.nrComponents, false, (void*)request.stagingOffset);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+			staging.Fence(request.stagingOffset);
+		}
+		else
+		{
+			request.texture->Create(request.width, request.height, request.nrComponents, false, request.data);
+
+			stbi_image_free(request.data);
+			request.data = nullptr;
+		}
+	}
+
+	// GL thread
+	void UploadLayer(Request& request)
+	{
+		if (!request.size)
+		{
+			std::cout << "TextureLoader: failed to load " << request.path << ", keeping a white layer" << std::endl;
+			return;
+		}
+
+		// decoded while the ring was full, try again now that it has drained
+		if (!request.staged && !StageLayer(request))
+		{
+			request.array->Update(request.layer, request.layers->GetLayer(request.layer));
+			return;
+		}
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.GetHandle());
+		request.array->Update(request.layer, (const void*)request.stagingOffset);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		staging.Fence(request.stagingOffset);
+	}
+
+	// GL thread, every level goes up as stored, no glGenerateMipmap
+	void UploadImage(Request& request)
+	{
+		TextureImage& image = *request.image;
+		if (!request.staged)
+			StageImage(request);
+
+		const void* levels[TextureImage::MAX_LEVELS];
+		for (int level = 0; level < image.levelCount; level++)
+		{
+			size_t offset = image.levelOffsets[level] - image.levelOffsets[0];
+			if (request.staged)
+				levels[level] = (const void*)(request.stagingOffset + offset);
+			else
+				levels[level] = image.data + image.levelOffsets[level];
+		}
+
+		if (request.staged)
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.GetHandle());
+		request.texture->Create(image.width, image.height, image.levelCount, image.internalFormat, image.format, image.pixelFormat, levels);
+		if (request.staged)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			staging.Fence(request.stagingOffset);
+		}
+
+		request.image.reset();
+	}
+private:
+	ThreadPool* pool;
+	TextureCache* cache;
+	HDRImageBuilder::HDRFormat hdrFormat;
+	StagingRing staging;
+	std::deque<std::shared_ptr<Request>> decoded;
+	std::mutex mutex;
+	int pending; // GL thread only
+};
+
+// Tile streamed texture for images too large to keep resident, like 16K
+// HDRIs. The mip chain is cut once into bordered tiles in a file next to the
+// texture cache entries, then only the tiles the feedback pass asks for are
+// read on the pool and paged into a fixed size physical texture. The page
+// table holds, for every tile of every level, the slot of that tile or of its
+// closest resident ancestor, so a lookup is one fetch and a missing tile shows
+// a blurrier level until it arrives. The single tile of the coarsest level is
+// always resident.
+class VirtualTexture
+{
+public:
+	enum
+	{
+		TILE_SIZE = 128,		// must match VirtualTexture.glsl
+		TILE_BORDER = 1,
+		PAGE_SIZE = TILE_SIZE + 2 * TILE_BORDER,
+		MAX_LEVELS = 16,
+		MAX_CACHE_SIDE = 256	// slots are 16 bits in the page table
+	};
+
+	VirtualTexture()
+		: pool(nullptr)
+		, dataOffset(0)
+		, width(0)
+		, height(0)
+		, levelCount(0)
+		, tileCount(0)
+		, cacheSide(0)
+		, frame(0)
+		, pending(0)
+	{
+	}
+
+	~VirtualTexture()
+	{
+	}
+
+	// GL thread, cacheSide_ x cacheSide_ tiles stay resident
+	bool Create(ThreadPool* pool_, const char* directory_, const char* path_, int cacheSide_)
+	{
+		pool = pool_;
+
+		MappedFile source;
+		if (!source.Open(path_))
+		{
+			std::cout << "VirtualTexture: failed to open " << path_ << std::endl;
+			return false;
+		}
+
+		uint64_t hash = HashFNV1a(source.GetData(), source.GetSize());
+
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.vtiles", (unsigned long long)hash);
+		std::string tilePath = std::string(directory_) + name;
+		if (!OpenTileFile(tilePath.c_str(), hash))
+		{
+			std::cout << "VirtualTexture: cutting " << path_ << " into tiles" << std::endl;
+			if (!BuildTileFile(source, tilePath, hash) || !OpenTileFile(tilePath.c_str(), hash))
+			{
+				std::cout << "VirtualTexture: failed to build " << tilePath << std::endl;
+				return false;
+			}
+		}
+
+		// the physical texture must fit the GL limit, and its allocation is
+		// checked since a failed one would just sample black
+		GLint maxTextureSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+		cacheSide = std::min(std::max(cacheSide_, 2), std::min((int)MAX_CACHE_SIDE, int(maxTextureSize) / PAGE_SIZE));
+		if (cacheSide < cacheSide_)
+			std::cout << "VirtualTexture: cache clamped to " << cacheSide << " tiles per side" << std::endl;
+
+		while (glGetError() != GL_NO_ERROR)
+		{
+		}
+		const void* levels[] = { nullptr };
+		physical.Create(cacheSide * PAGE_SIZE, cacheSide * PAGE_SIZE, 1, GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT, levels);
+		if (glGetError() != GL_NO_ERROR)
+		{
+			std::cout << "VirtualTexture: failed to allocate a " << cacheSide * PAGE_SIZE << " texel physical texture" << std::endl;
+			physical.Destroy();
+			mapping.Close();
+			levelCount = 0;
+			return false;
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		tiles.assign(tileCount, Tile());
+		slots.assign(cacheSide * cacheSide, Slot());
+		pageTable.assign(tileCount, 0);
+
+		// the coarsest tile, pinned in slot 0
+		int root = tileCount - 1;
+		UploadTile(0, GetTileData(root));
+		tiles[root].slot = 0;
+		slots[0].tile = root;
+		UpdatePageTable();
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		while (pending > 0)
+		{
+			Update(~0u);
+			std::this_thread::yield();
+		}
+
+		physical.Destroy();
+		pageTableBuffer.Destroy();
+		mapping.Close();
+		tiles.clear();
+		slots.clear();
+		pageTable.clear();
+		levelCount = 0;
+	}
+
+	bool IsCreated() const
+	{
+		return levelCount > 0;
+	}
+
+	// GL thread. Ids are 1 + the page table index of a tile, 0 for a pixel
+	// that looked nothing up. Tiles asked for in this call are not evicted
+	// before the next one.
+	void Request(const unsigned int* ids_, size_t count_)
+	{
+		frame++;
+		for (size_t i = 0; i < count_; i++)
+		{
+			if (ids_[i] == 0 || ids_[i] > (unsigned int)tileCount)
+				continue;
+
+			int tile = int(ids_[i] - 1);
+			tiles[tile].lastUsed = frame;
+			if (tiles[tile].slot >= 0)
+			{
+				slots[tiles[tile].slot].lastUsed = frame;
+				continue;
+			}
+			if (tiles[tile].loading)
+				continue;
+
+			tiles[tile].loading = true;
+			pending++;
+
+			// touching the mapping here is what reads the tile from disk
+			pool->Enqueue([this, tile]()
+			{
+				std::shared_ptr<LoadedTile> loaded(new LoadedTile);
+				loaded->tile = tile;
+				const unsigned char* data = GetTileData(tile);
+				loaded->texels.assign(data, data + TILE_BYTES);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				finished.push_back(loaded);
+			});
+		}
+	}
+
+	// GL thread, moves at most maxTiles_ finished reads into the cache
+	void Update(unsigned int maxTiles_)
+	{
+		bool changed = false;
+		for (unsigned int i = 0; i < maxTiles_; i++)
+		{
+			std::shared_ptr<LoadedTile> loaded;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (finished.empty())
+					break;
+
+				loaded = finished.front();
+				finished.pop_front();
+			}
+
+			Tile& tile = tiles[loaded->tile];
+			tile.loading = false;
+			pending--;
+
+			// the cache is full of tiles still in view, it stays at its fallback
+			int slot = FindSlot();
+			if (slot < 0)
+				continue;
+
+			if (slots[slot].tile >= 0)
+				tiles[slots[slot].tile].slot = -1;
+			slots[slot].tile = loaded->tile;
+			slots[slot].lastUsed = tile.lastUsed;
+			tile.slot = slot;
+
+			UploadTile(slot, loaded->texels.data());
+			changed = true;
+		}
+
+		if (changed)
+			UpdatePageTable();
+	}
+
+	// GL thread, blocks until every requested tile is resident or turned away
+	void Wait()
+	{
+		while (pending > 0)
+		{
+			Update(~0u);
+			if (pending > 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	int GetPendingCount() const
+	{
+		return pending;
+	}
+
+	// the finest level with no more texels across than a view width_ pixels
+	// wide shows, for the environment's two periods over 360 degrees and a 90
+	// degree field of view
+	int GetLevel(int width_) const
+	{
+		float texelsPerRadian = float(width) / PI;
+		float pixelsPerRadian = float(width_) / 2.0f;
+		int level = int(floorf(log2f(std::max(texelsPerRadian / pixelsPerRadian, 1.0f))));
+
+		return std::min(level, levelCount - 1);
+	}
+
+	void Bind(ShaderProgram& program_, unsigned int pageTableUnit_, unsigned int physicalUnit_, int outputWidth_)
+	{
+		int levels[MAX_LEVELS * 4] = {};
+		for (int level = 0; level < levelCount; level++)
+		{
+			levels[level * 4 + 0] = levelOffsets[level];
+			levels[level * 4 + 1] = GetTilesX(level);
+			levels[level * 4 + 2] = GetLevelWidth(level);
+			levels[level * 4 + 3] = GetLevelHeight(level);
+		}
+
+		program_.SetUniform1i("vtPageTable", pageTableUnit_);
+		program_.SetUniform1i("vtPhysical", physicalUnit_);
+		program_.SetUniform4iv("vtLevels", MAX_LEVELS, levels);
+		program_.SetUniform1i("vtLevel", GetLevel(outputWidth_));
+		program_.SetUniform1i("vtCacheSide", cacheSide);
+
+		pageTableBuffer.Bind(pageTableUnit_);
+		physical.Bind(physicalUnit_);
+	}
+private:
+	enum
+	{
+		TILE_BYTES = PAGE_SIZE * PAGE_SIZE * 4 * 2,	// RGBA16F
+		VERSION = 1
+	};
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t sourceHash;
+		uint32_t width;
+		uint32_t height;
+		uint32_t tileSize;
+		uint32_t tileBorder;
+	};
+
+	struct Tile
+	{
+		int slot = -1;
+		bool loading = false;
+		unsigned int lastUsed = 0;
+	};
+
+	struct Slot
+	{
+		int tile = -1;
+		unsigned int lastUsed = 0;
+	};
+
+	// the rows of one level while the tile file is built, enough for a row of
+	// bordered tiles and for the rows the next level is filtered from
+	struct LevelBand
+	{
+		int width = 0;
+		int height = 0;
+		int rowCount = 0;
+		int received = 0;
+		int tileRow = 0;	// next row of tiles to write
+		std::vector<float> rows;
+	};
+
+	struct LoadedTile
+	{
+		int tile = 0;
+		std::vector<unsigned char> texels;
+	};
+
+	int GetLevelWidth(int level) const
+	{
+		return std::max(1, width >> level);
+	}
+
+	int GetLevelHeight(int level) const
+	{
+		return std::max(1, height >> level);
+	}
+
+	int GetTilesX(int level) const
+	{
+		return (GetLevelWidth(level) + TILE_SIZE - 1) / TILE_SIZE;
+	}
+
+	int GetTilesY(int level) const
+	{
+		return (GetLevelHeight(level) + TILE_SIZE - 1) / TILE_SIZE;
+	}
+
+	// levels down to the first that fits in one tile, their tiles numbered
+	// row by row, level after level
+	void SetLayout(int width_, int height_)
+	{
+		width = width_;
+		height = height_;
+		levelCount = 0;
+		tileCount = 0;
+		while (levelCount < MAX_LEVELS)
+		{
+			levelOffsets[levelCount] = tileCount;
+			tileCount += GetTilesX(levelCount) * GetTilesY(levelCount);
+			levelCount++;
+			if (GetTilesX(levelCount - 1) == 1 && GetTilesY(levelCount - 1) == 1)
+				break;
+		}
+	}
+
+	const unsigned char* GetTileData(int tile) const
+	{
+		return mapping.GetData() + dataOffset + size_t(tile) * TILE_BYTES;
+	}
+
+	bool OpenTileFile(const char* tilePath, uint64_t hash)
+	{
+		if (!mapping.Open(tilePath))
+			return false;
+
+		Header header;
+		if (mapping.GetSize() < sizeof(header))
+		{
+			mapping.Close();
+			return false;
+		}
+		memcpy(&header, mapping.GetData(), sizeof(header));
+
+		if (memcmp(header.magic, "GVTX", 4) != 0 || header.version != VERSION || header.sourceHash != hash ||
+			header.tileSize != TILE_SIZE || header.tileBorder != TILE_BORDER || header.width == 0 || header.height == 0)
+		{
+			mapping.Close();
+			return false;
+		}
+
+		SetLayout(int(header.width), int(header.height));
+		dataOffset = (sizeof(header) + 15) & ~size_t(15);
+		if (mapping.GetSize() < dataOffset + size_t(tileCount) * TILE_BYTES)
+		{
+			mapping.Close();
+			levelCount = 0;
+			return false;
+		}
+
+		return true;
+	}
+
+	// decodes the source once and writes every level's tiles with their
+	// borders: repeating across like GL_REPEAT, clamped top and bottom
+	// streams the source top to bottom through a band of rows per level, so a
+	// Radiance source is never decoded whole
+	bool BuildTileFile(const MappedFile& source, const std::string& tilePath, uint64_t hash)
+	{
+		int sourceWidth, sourceHeight, nrComponents;
+		RadianceReader reader;
+		float* hdrData = nullptr;
+		unsigned char* ldrData = nullptr;
+		if (reader.Open(source.GetData(), source.GetSize()))
+		{
+			sourceWidth = reader.GetWidth();
+			sourceHeight = reader.GetHeight();
+		}
+		else if (stbi_is_hdr_from_memory(source.GetData(), (int)source.GetSize()))
+		{
+			hdrData = stbi_loadf_from_memory(source.GetData(), (int)source.GetSize(), &sourceWidth, &sourceHeight, &nrComponents, 3);
+			if (!hdrData)
+				return false;
+		}
+		else
+		{
+			ldrData = stbi_load_from_memory(source.GetData(), (int)source.GetSize(), &sourceWidth, &sourceHeight, &nrComponents, 3);
+			if (!ldrData)
+				return false;
+		}
+
+		SetLayout(sourceWidth, sourceHeight);
+
+		Header header = {};
+		memcpy(header.magic, "GVTX", 4);
+		header.version = VERSION;
+		header.sourceHash = hash;
+		header.width = width;
+		header.height = height;
+		header.tileSize = TILE_SIZE;
+		header.tileBorder = TILE_BORDER;
+
+		// written under a temporary name so a reader never maps a partial file
+		std::string tempPath = tilePath + ".tmp";
+		std::ofstream file(tempPath.c_str(), std::ios::binary);
+		bool read = true;
+		if (file)
+		{
+			static const char zeros[16] = {};
+			file.write((const char*)&header, sizeof(header));
+			file.write(zeros, ((sizeof(header) + 15) & ~size_t(15)) - sizeof(header));
+
+			std::vector<LevelBand> bands(levelCount);
+			for (int level = 0; level < levelCount; level++)
+			{
+				bands[level].width = GetLevelWidth(level);
+				bands[level].height = GetLevelHeight(level);
+				bands[level].rowCount = std::min(int(PAGE_SIZE), bands[level].height);
+				bands[level].rows.resize(size_t(bands[level].rowCount) * bands[level].width * 3);
+			}
+
+			std::vector<unsigned short> page(PAGE_SIZE * PAGE_SIZE * 4);
+			size_t rowSize = size_t(width) * 3;
+			for (int y = 0; y < height && read; y++)
+			{
+				float* row = GetBandRow(bands[0], bands[0].received);
+				if (hdrData)
+				{
+					memcpy(row, hdrData + y * rowSize, rowSize * sizeof(float));
+				}
+				else if (ldrData)
+				{
+					// sampled as UNORM like the whole texture would be, no gamma expansion
+					for (size_t i = 0; i < rowSize; i++)
+						row[i] = ldrData[y * rowSize + i] / 255.0f;
+				}
+				else
+				{
+					read = reader.ReadRow(row);
+				}
+
+				if (read)
+					AddBandRow(bands, 0, file, page);
+			}
+			file.close();
+		}
+		stbi_image_free(hdrData);
+		stbi_image_free(ldrData);
+		levelCount = 0;
+
+		if (!read || !file || std::rename(tempPath.c_str(), tilePath.c_str()) != 0)
+		{
+			std::remove(tempPath.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	// row y of the band, which holds its last rowCount rows
+	float* GetBandRow(LevelBand& band, int y) const
+	{
+		return &band.rows[size_t(y % band.rowCount) * band.width * 3];
+	}
+
+	// takes the row just written at GetBandRow(band, band.received), writes
+	// every tile row whose bottom border it completes and passes the filtered
+	// rows on to the next level
+	void AddBandRow(std::vector<LevelBand>& bands, int level, std::ofstream& file, std::vector<unsigned short>& page)
+	{
+		LevelBand& band = bands[level];
+		int row = band.received++;
+
+		while (band.tileRow < GetTilesY(level) && std::min(band.tileRow * TILE_SIZE + TILE_SIZE, band.height - 1) <= row)
+		{
+			int ty = band.tileRow++;
+
+			// levels are written as their bands fill, so each row of tiles is placed by offset
+			size_t dataStart = (sizeof(Header) + 15) & ~size_t(15);
+			file.seekp(dataStart + size_t(levelOffsets[level] + ty * GetTilesX(level)) * TILE_BYTES);
+			for (int tx = 0; tx < GetTilesX(level); tx++)
+			{
+				for (int y = 0; y < PAGE_SIZE; y++)
+				{
+					int sy = std::min(std::max(ty * TILE_SIZE - TILE_BORDER + y, 0), band.height - 1);
+					const float* source = GetBandRow(band, sy);
+					for (int x = 0; x < PAGE_SIZE; x++)
+					{
+						int sx = ((tx * TILE_SIZE - TILE_BORDER + x) % band.width + band.width) % band.width;
+						const float* t = &source[size_t(sx) * 3];
+						unsigned short* p = &page[(y * PAGE_SIZE + x) * 4];
+						p[0] = FloatToHalf(t[0]);
+						p[1] = FloatToHalf(t[1]);
+						p[2] = FloatToHalf(t[2]);
+						p[3] = FloatToHalf(1.0f);
+					}
+				}
+				file.write((const char*)page.data(), TILE_BYTES);
+			}
+		}
+
+		if (level + 1 == levelCount)
+			return;
+
+		// 2x2 box filter, the last row or column repeated for odd sizes
+		LevelBand& next = bands[level + 1];
+		int y = next.received;
+		if (y >= next.height || std::min(y * 2 + 1, band.height - 1) > row)
+			return;
+
+		const float* row0 = GetBandRow(band, std::min(y * 2, band.height - 1));
+		const float* row1 = GetBandRow(band, std::min(y * 2 + 1, band.height - 1));
+		float* filtered = GetBandRow(next, y);
+		for (int x = 0; x < next.width; x++)
+		{
+			int x0 = std::min(x * 2, band.width - 1);
+			int x1 = std::min(x * 2 + 1, band.width - 1);
+			for (int c = 0; c < 3; c++)
+				filtered[x * 3 + c] = 0.25f * (row0[x0 * 3 + c] + row0[x1 * 3 + c] + row1[x0 * 3 + c] + row1[x1 * 3 + c]);
+		}
+		AddBandRow(bands, level + 1, file, page);
+	}
+
+	// a free slot, else the least recently used one not asked for by the
+	// latest request and not the pinned root
+	int FindSlot() const
+	{
+		int best = -1;
+		for (int slot = 1; slot < int(slots.size()); slot++)
+		{
+			if (slots[slot].tile < 0)
+				return slot;
+			if (slots[slot].lastUsed < frame && (best < 0 || slots[slot].lastUsed < slots[best].lastUsed))
+				best = slot;
+		}
+
+		return best;
+	}
+
+	void UploadTile(int slot, const unsigned char* texels)
+	{
+		physical.Bind(0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % cacheSide) * PAGE_SIZE, (slot / cacheSide) * PAGE_SIZE, PAGE_SIZE, PAGE_SIZE, GL_RGBA, GL_HALF_FLOAT, texels);
+	}
+
+	// coarse to fine, a tile that is not resident inherits its parent's entry
+	void UpdatePageTable()
+	{
+		for (int level = levelCount - 1; level >= 0; level--)
+		{
+			for (int ty = 0; ty < GetTilesY(level); ty++)
+			{
+				for (int tx = 0; tx < GetTilesX(level); tx++)
+				{
+					int tile = levelOffsets[level] + ty * GetTilesX(level) + tx;
+					if (tiles[tile].slot >= 0)
+					{
+						pageTable[tile] = (unsigned int)tiles[tile].slot | ((unsigned int)level << 16);
+					}
+					else
+					{
+						int px = std::min(tx / 2, GetTilesX(level + 1) - 1);
+						int py = std::min(ty / 2, GetTilesY(level + 1) - 1);
+						pageTable[tile] = pageTable[levelOffsets[level + 1] + py * GetTilesX(level + 1) + px];
+					}
+				}
+			}
+		}
+
+		pageTableBuffer.Create(GL_R32UI, pageTable.data(), (unsigned int)(pageTable.size() * sizeof(unsigned int)));
+	}
+private:
+	ThreadPool* pool;
+	MappedFile mapping;
+	size_t dataOffset;
+	int width;
+	int height;
+	int levelCount;
+	int levelOffsets[MAX_LEVELS];
+	int tileCount;
+	int cacheSide;
+
+	Texture2D physical;
+	TextureBuffer pageTableBuffer;
+	std::vector<Tile> tiles;
+	std::vector<Slot> slots;
+	std::vector<unsigned int> pageTable;
+	unsigned int frame;
+
+	std::deque<std::shared_ptr<LoadedTile>> finished;
+	std::mutex mutex;
+	int pending; // GL thread only
+};
+
+// Environment lighting for the --preview-lighting program, computed on the
+// pool from the environment map: L2 spherical harmonics of the irradiance for
+// diffuse hits and a mip chain prefiltered with the GGX lobe for glossy hits,
+// level i holding roughness i / (LEVEL_COUNT - 1). The chain is laid out by
+// SphereGetUV, which wraps once around, where the envMap lookup wraps twice.
+class LightingCache
+{
+public:
+	enum
+	{
+		BASE_WIDTH = 256,
+		LEVEL_COUNT = 6,
+		SUPERSAMPLES = 8,	// per side, for each base texel of the 4000 texel wide source
+		SAMPLE_COUNT = 64,
+		BAND_ROWS = 8,
+		SH_COUNT = 9,
+		SH_LEVEL = 2		// the source level projected onto the harmonics
+	};
+
+	LightingCache()
+		: pool(nullptr)
+		, pending(0)
+		, computed(false)
+		, uploaded(false)
+	{
+		memset(sh, 0, sizeof(sh));
+	}
+
+	~LightingCache()
+	{
+	}
+
+	// returns at once, loading and filtering run on pool_
+	bool Create(ThreadPool* pool_, const char* path_)
+	{
+		pool = pool_;
+		path = path_;
+		computed = false;
+		uploaded = false;
+
+		pending = 1;
+		pool->Enqueue([this]()
+		{
+			Prepare();
+			pending--;
+		});
+
+		return true;
+	}
+
+	// GL thread, waits for the jobs still in flight
+	void Destroy()
+	{
+		while (pending > 0)
+			std::this_thread::yield();
+
+		texture.Destroy();
+		sources.clear();
+		levels.clear();
+		computed = false;
+		uploaded = false;
+	}
+
+	// GL thread, uploads the levels once the pool is done with them
+	void Update()
+	{
+		if (uploaded || !computed || pending > 0)
+			return;
+
+		const void* data[LEVEL_COUNT];
+		for (int level = 0; level < LEVEL_COUNT; level++)
+			data[level] = levels[level].data();
+		texture.Create(BASE_WIDTH, BASE_WIDTH / 2, LEVEL_COUNT, GL_RGB16F, GL_RGB, GL_FLOAT, data);
+
+		sources.clear();
+		levels.clear();
+		uploaded = true;
+	}
+
+	bool IsReady() const
+	{
+		return uploaded;
+	}
+
+	void Bind(ShaderProgram& program_, int unit_)
+	{
+		program_.SetUniform3fv("shIrradiance", SH_COUNT, &sh[0][0]);
+		program_.SetUniform1i("prefilteredEnv", unit_);
+		program_.SetUniform1f("prefilteredLevels", float(LEVEL_COUNT));
+
+		texture.Bind(unit_);
+	}
+private:
+	struct Level
+	{
+		int width;
+		int height;
+		std::vector<float> texels;
+	};
+
+	static Vector3 GetDirection(float u_, float v_)
+	{
+		float azimuth = (u_ - 0.5f) * 2.0f * PI;
+		float polar = v_ * PI;
+
+		return Vector3(sinf(polar) * sinf(azimuth), cosf(polar), sinf(polar) * cosf(azimuth));
+	}
+
+	// pool thread
+	void Prepare()
+	{
+		EnvironmentMap envMap;
+		if (!envMap.Create(path.c_str()))
+		{
+			std::cout << "LightingCache: failed to load " << path << ", previewing with the full path tracer" << std::endl;
+			return;
+		}
+
+		// the base level resamples the environment, later ones are 2x2 boxes
+		for (int width = BASE_WIDTH; width >= 2; width /= 2)
+		{
+			Level source;
+			source.width = width;
+			source.height = width / 2;
+			source.texels.resize(size_t(source.width) * source.height * 3);
+			for (int y = 0; y < source.height; y++)
+			{
+				for (int x = 0; x < source.width; x++)
+				{
+					Vector3 color;
+					if (sources.empty())
+					{
+						for (int i = 0; i < SUPERSAMPLES * SUPERSAMPLES; i++)
+						{
+							Vector3 dir = GetDirection((x + (i % SUPERSAMPLES + 0.5f) / SUPERSAMPLES) / source.width, (y + (i / SUPERSAMPLES + 0.5f) / SUPERSAMPLES) / source.height);
+							color += envMap.Sample((atan2f(dir.x, dir.z) + (PI / 2.0f)) / PI, acosf(dir.y) / PI);
+						}
+						color = color / float(SUPERSAMPLES * SUPERSAMPLES);
+					}
+					else
+					{
+						const Level& parent = sources.back();
+						color = 0.25f * (Texel(parent, x * 2, y * 2) + Texel(parent, x * 2 + 1, y * 2) + Texel(parent, x * 2, y * 2 + 1) + Texel(parent, x * 2 + 1, y * 2 + 1));
+					}
+
+					float* texel = &source.texels[(size_t(y) * source.width + x) * 3];
+					texel[0] = color.x;
+					texel[1] = color.y;
+					texel[2] = color.z;
+				}
+			}
+			sources.push_back(std::move(source));
+		}
+
+		ProjectIrradiance(sources[SH_LEVEL]);
+
+		levels.resize(LEVEL_COUNT);
+		levels[0] = sources[0].texels;
+		for (int level = 1; level < LEVEL_COUNT; level++)
+		{
+			int height = (BASE_WIDTH >> level) / 2;
+			levels[level].resize(size_t(BASE_WIDTH >> level) * height * 3);
+			for (int y = 0; y < height; y += BAND_ROWS)
+			{
+				pending++;
+				pool->Enqueue([this, level, y, height]()
+				{
+					for (int row = y; row < std::min(y + BAND_ROWS, height); row++)
+						Prefilter(level, row);
+					pending--;
+				});
+			}
+		}
+
+		computed = true;
+	}
+
+	// the cosine lobe convolution scales band l by 1, 2/3 and 1/4 once divided
+	// by PI, so shIrradiance times the basis is the light a white Lambertian
+	// surface reflects
+	void ProjectIrradiance(const Level& source)
+	{
+		const float bandScales[3] = { 1.0f, 2.0f / 3.0f, 0.25f };
+
+		memset(sh, 0, sizeof(sh));
+		for (int y = 0; y < source.height; y++)
+		{
+			float v = (y + 0.5f) / source.height;
+			float solidAngle = (2.0f * PI / source.width) * (PI / source.height) * sinf(v * PI);
+			for (int x = 0; x < source.width; x++)
+			{
+				Vector3 dir = GetDirection((x + 0.5f) / source.width, v);
+				const float basis[SH_COUNT] =
+				{
+					0.282095f,
+					0.488603f * dir.y, 0.488603f * dir.z, 0.488603f * dir.x,
+					1.092548f * dir.x * dir.y, 1.092548f * dir.y * dir.z, 0.315392f * (3.0f * dir.z * dir.z - 1.0f),
+					1.092548f * dir.x * dir.z, 0.546274f * (dir.x * dir.x - dir.y * dir.y)
+				};
+
+				Vector3 color = Texel(source, x, y);
+				for (int i = 0; i < SH_COUNT; i++)
+				{
+					float weight = basis[i] * solidAngle * bandScales[i == 0 ? 0 : i < 4 ? 1 : 2];
+					sh[i][0] += color.x * weight;
+					sh[i][1] += color.y * weight;
+					sh[i][2] += color.z * weight;
+				}
+			}
+		}
+	}
+
+	// pool thread. With the view along the normal, GGX samples are weighted by
+	// their cosine and read from the source level whose texels cover about the
+	// solid angle each sample stands for.
+	void Prefilter(int level, int y)
+	{
+		float roughness = float(level) / float(LEVEL_COUNT - 1);
+		float alpha = roughness * roughness;
+		int width = BASE_WIDTH >> level;
+		int height = width / 2;
+		float texelSolidAngle = 4.0f * PI / (float(sources[0].width) * sources[0].height);
+
+		for (int x = 0; x < width; x++)
+		{
+			Vector3 n = GetDirection((x + 0.5f) / width, (y + 0.5f) / height);
+			Vector3 color;
+			float weight = 0.0f;
+			for (int i = 0; i < SAMPLE_COUNT; i++)
+			{
+				unsigned int bits = i;
+				bits = (bits << 16) | (bits >> 16);
+				bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+				bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+				bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+				bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+
+				Vector3 h = SampleGGXVNDF(Vector3(0.0f, 0.0f, 1.0f), alpha, (i + 0.5f) / SAMPLE_COUNT, bits * 2.3283064e-10f);
+				Vector3 wi = reflect(Vector3(0.0f, 0.0f, -1.0f), h);
+				if (wi.z <= 0.0f)
+					continue;
+
+				float pdf = GGXD(h, alpha) / 4.0f;
+				float sampleSolidAngle = 1.0f / (SAMPLE_COUNT * pdf);
+				float lod = std::max(0.0f, 0.5f * log2f(sampleSolidAngle / texelSolidAngle) + 1.0f);
+
+				color += Sample(LocalToWorld(wi, n), lod) * wi.z;
+				weight += wi.z;
+			}
+			color = color / std::max(weight, 1e-6f);
+
+			float* texel = &levels[level][(size_t(y) * width + x) * 3];
+			texel[0] = color.x;
+			texel[1] = color.y;
+			texel[2] = color.z;
+		}
+	}
+
+	// trilinear across the source levels
+	Vector3 Sample(const Vector3& dir, float lod) const
+	{
+		lod = std::min(lod, float(sources.size() - 1));
+		int level0 = int(lod);
+		int level1 = std::min(level0 + 1, int(sources.size() - 1));
+		float u = atan2f(dir.x, dir.z) / (2.0f * PI) + 0.5f;
+		float v = acosf(std::min(std::max(dir.y, -1.0f), 1.0f)) / PI;
+		float t = lod - level0;
+
+		return Bilinear(sources[level0], u, v) * (1.0f - t) + Bilinear(sources[level1], u, v) * t;
+	}
+
+	static Vector3 Bilinear(const Level& source, float u, float v)
+	{
+		float x = u * source.width - 0.5f;
+		float y = v * source.height - 0.5f;
+		int x0 = (int)floorf(x);
+		int y0 = (int)floorf(y);
+		float fx = x - x0;
+		float fy = y - y0;
+
+		return (Texel(source, x0, y0) * (1.0f - fx) + Texel(source, x0 + 1, y0) * fx) * (1.0f - fy) +
+			(Texel(source, x0, y0 + 1) * (1.0f - fx) + Texel(source, x0 + 1, y0 + 1) * fx) * fy;
+	}
+
+	// wraps around the azimuth, clamps at the poles
+	static Vector3 Texel(const Level& source, int x, int y)
+	{
+		x = ((x % source.width) + source.width) % source.width;
+		y = std::min(std::max(y, 0), source.height - 1);
+		const float* t = &source.texels[(size_t(y) * source.width + x) * 3];
+
+		return Vector3(t[0], t[1], t[2]);
+	}
+private:
+	ThreadPool* pool;
+	std::string path;
+	std::atomic<int> pending;
+	std::atomic<bool> computed;
+	bool uploaded;
+
+	std::vector<Level> sources;
+	std::vector<std::vector<float>> levels;
+	float sh[SH_COUNT][3];
+	Texture2D texture;
+};
+
+// Reports files that changed on disk. inotify on Linux watches the files'
+// directories, so editors that save by renaming a temporary are seen too;
+// elsewhere modification times are polled.
+class FileWatcher
+{
+public:
+	FileWatcher()
+#ifdef __linux__
+		: fd(-1)
+#endif
+	{
+	}
+
+	~FileWatcher()
+	{
+	}
+
+	bool Create()
+	{
+#ifdef __linux__
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0)
+			return false;
+#endif
+		return true;
+	}
+
+	void Destroy()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+		directories.clear();
+#endif
+		files.clear();
+	}
+
+	void Watch(const std::string& path_)
+	{
+		if (files.find(path_) != files.end())
+			return;
+
+		files[path_] = GetModifiedTime(path_);
+
+#ifdef __linux__
+		std::string directory = ".";
+		size_t slash = path_.find_last_of('/');
+		if (slash != std::string::npos)
+			directory = path_.substr(0, slash);
+
+		int wd = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+		if (wd >= 0)
+			directories[wd] = slash != std::string::npos ? directory + "/" : "";
+#endif
+	}
+
+	// blocks up to timeoutMs_, returns the watched files written since the last call
+	void Wait(int timeoutMs_, std::vector<std::string>& changed_)
+	{
+		changed_.clear();
+
+#ifdef __linux__
+		pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, timeoutMs_) <= 0)
+			return;
+
+		alignas(inotify_event) char buffer[4096];
+		ssize_t length;
+		while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+		{
+			for (char* p = buffer; p < buffer + length; p += sizeof(inotify_event) + ((inotify_event*)p)->len)
+			{
+				const inotify_event* event = (const inotify_event*)p;
+				if (!event->len || directories.find(event->wd) == directories.end())
+					continue;
+
+				std::string path = directories[event->wd] + event->name;
+				if (files.find(path) != files.end() && std::find(changed_.begin(), changed_.end(), path) == changed_.end())
+					changed_.push_back(path);
+			}
+		}
+#else
+		std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs_));
+
+		for (auto& file : files)
+		{
+			long long modified = GetModifiedTime(file.first);
+			if (modified != file.second)
+			{
+				file.second = modified;
+				changed_.push_back(file.first);
+			}
+		}
+#endif
+	}
+private:
+	static long long GetModifiedTime(const std::string& path_)
+	{
+		struct stat fileStat;
+		if (stat(path_.c_str(), &fileStat) != 0)
+			return 0;
+
+		return (long long)fileStat.st_mtime;
+	}
+private:
+	std::map<std::string, long long> files;
+#ifdef __linux__
+	int fd;
+	std::map<int, std::string> directories;
+#endif
+};
+
+// Rebuilds programs whose sources changed. Compiling happens on a thread that
+// owns a hidden context sharing objects with the main window, and the new
+// program replaces the old one at the next Update() on the GL thread only if
+// it linked; a broken edit leaves the running program untouched. Without a
+// shared context the thread only watches and Update() rebuilds in place.
+class ShaderReloader
+{
+public:
+	ShaderReloader()
+		: context(nullptr)
+		, running(false)
+	{
+	}
+
+	~ShaderReloader()
+	{
+	}
+
+	// GL thread, window_ is the context the programs are used from
+	bool Create(GLFWwindow* window_)
+	{
+		if (!watcher.Create())
+			return false;
+
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		context = glfwCreateWindow(1, 1, "ShaderReloader", nullptr, window_);
+		glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+		if (!context)
+			std::cout << "ShaderReloader: no shared context, rebuilding on the GL thread" << std::endl;
+
+		running = true;
+		thread = std::thread(&ShaderReloader::ThreadMain, this);
+
+		return true;
+	}
+
+	// GL thread
+	void Destroy()
+	{
+		if (running)
+		{
+			running = false;
+			thread.join();
+		}
+
+		if (context)
+		{
+			glfwDestroyWindow(context);
+			context = nullptr;
+		}
+
+		for (auto& entry : entries)
+			entry->rebuilt.Destroy();
+		entries.clear();
+		watcher.Destroy();
+	}
+
+	// GL thread, program_ must outlive the reloader
+	void Add(ShaderProgram* program_)
+	{
+		std::shared_ptr<Entry> entry(new Entry);
+		entry->program = program_;
+		entry->vertexPath = program_->GetVertexPath();
+		entry->fragmentPath = program_->GetFragmentPath();
+		entry->defines = program_->GetDefines();
+		entry->files = program_->GetSourceFiles();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.push_back(entry);
+		added.push_back(entry);
+	}
+
+	// GL thread, once per frame
+	void Update()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& entry : entries)
+		{
+			if (entry->state == Entry::REBUILT)
+			{
+				entry->program->Swap(entry->rebuilt);
+				entry->rebuilt.Destroy();
+				std::cout << "ShaderReloader: reloaded " << entry->fragmentPath << std::endl;
+			}
+			else if (entry->state == Entry::STALE)
+			{
+				if (entry->program->Recreate())
+					std::cout << "ShaderReloader: reloaded " << entry->fragmentPath << std::endl;
+				else
+					std::cout << "ShaderReloader: " << entry->fragmentPath << " failed, keeping the previous program" << std::endl;
+			}
+
+			entry->state = Entry::CURRENT;
+		}
+	}
+private:
+	struct Entry
+	{
+		enum State
+		{
+			CURRENT,
+			STALE,		// sources changed, rebuild on the GL thread
+			REBUILT		// rebuilt holds the new program
+		};
+
+		ShaderProgram* program = nullptr;
+		std::string vertexPath;
+		std::string fragmentPath;
+		ShaderDefines defines;
+		std::vector<std::string> files; // reload thread only once added
+
+		State state = CURRENT;
+		ShaderProgram rebuilt;
+	};
+
+	void ThreadMain()
+	{
+		if (context)
+			glfwMakeContextCurrent(context);
+
+		std::vector<std::shared_ptr<Entry>> watched;
+		std::vector<std::string> changed;
+		while (running)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				for (auto& entry : added)
+				{
+					watched.push_back(entry);
+					for (auto& file : entry->files)
+						watcher.Watch(file);
+				}
+				added.clear();
+			}
+
+			watcher.Wait(100, changed);
+			if (changed.empty())
+				continue;
+
+			for (auto& entry : watched)
+			{
+				bool dirty = false;
+				for (auto& file : changed)
+					dirty = dirty || std::find(entry->files.begin(), entry->files.end(), file) != entry->files.end();
+				if (!dirty)
+					continue;
+
+				if (!context)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					entry->state = Entry::STALE;
+					continue;
+				}
+
+				ShaderProgram program;
+				if (!program.Create(entry->vertexPath.c_str(), entry->fragmentPath.c_str(), entry->defines))
+				{
+					std::cout << "ShaderReloader: " << entry->fragmentPath << " failed, keeping the previous program" << std::endl;
+					continue;
+				}
+
+				// the main context may only use the program once it is complete
+				glFinish();
+
+				// an edit can add includes
+				entry->files = program.GetSourceFiles();
+				for (auto& file : entry->files)
+					watcher.Watch(file);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				if (entry->state == Entry::REBUILT)
+					entry->rebuilt.Destroy();
+				entry->rebuilt.Swap(program);
+				entry->state = Entry::REBUILT;
+			}
+		}
+
+		if (context)
+			glfwMakeContextCurrent(nullptr);
+	}
+private:
+	GLFWwindow* context;
+	FileWatcher watcher;
+	std::thread thread;
+	std::atomic<bool> running;
+
+	std::mutex mutex;
+	std::vector<std::shared_ptr<Entry>> entries;
+	std::vector<std::shared_ptr<Entry>> added;
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+// image output, rgb_ is float RGB with the top row first
+
+// Portable float map, little endian, rows bottom to top
+bool WritePFM(const char* path_, int width_, int height_, const float* rgb_)
+{
+	std::ofstream file(path_, std::ios::binary);
+	if (!file)
+		return false;
+
+	file << "PF\n" << width_ << " " << height_ << "\n-1.0\n";
+	for (int y = height_ - 1; y >= 0; y--)
+		file.write((const char*)&rgb_[size_t(y) * width_ * 3], size_t(width_) * 3 * sizeof(float));
+
+	return bool(file);
+}
+
+unsigned int UpdateCRC32(unsigned int crc_, const unsigned char* data_, size_t size_)
+{
+	static unsigned int table[256];
+	static bool tableReady = false;
+	if (!tableReady)
+	{
+		for (unsigned int n = 0; n < 256; n++)
+		{
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		tableReady = true;
+	}
+
+	crc_ = ~crc_;
+	for (size_t i = 0; i < size_; i++)
+		crc_ = table[(crc_ ^ data_[i]) & 0xFF] ^ (crc_ >> 8);
+
+	return ~crc_;
+}
+
+// 8 bit RGB, clamped like the window shows it. The zlib stream uses stored
+// blocks, output speed matters more here than file size.
+bool WritePNG(const char* path_, int width_, int height_, const float* rgb_)
+{
+	std::vector<unsigned char> raw;
+	raw.reserve((size_t(width_) * 3 + 1) * height_);
+	for (int y = 0; y < height_; y++)
+	{
+		raw.push_back(0); // filter: none
+		for (int x = 0; x < width_ * 3; x++)
+		{
+			float value = std::min(std::max(rgb_[size_t(y) * width_ * 3 + x], 0.0f), 1.0f);
+			raw.push_back((unsigned char)(value * 255.0f + 0.5f));
+		}
+	}
+
+	std::vector<unsigned char> zlib = { 0x78, 0x01 };
+	unsigned int a = 1, b = 0;
+	for (size_t offset = 0; offset < raw.size() || offset == 0; )
+	{
+		size_t length = std::min(raw.size() - offset, size_t(65535));
+		bool last = offset + length == raw.size();
+		zlib.push_back(last ? 1 : 0);
+		zlib.push_back(length & 0xFF);
+		zlib.push_back((length >> 8) & 0xFF);
+		zlib.push_back(~length & 0xFF);
+		zlib.push_back((~length >> 8) & 0xFF);
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+
+		for (size_t i = offset; i < offset + length; i++)
+		{
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+
+		offset += length;
+		if (last)
+			break;
+	}
+	unsigned int adler = (b << 16) | a;
+	unsigned char adlerBytes[] = { (unsigned char)(adler >> 24), (unsigned char)(adler >> 16), (unsigned char)(adler >> 8), (unsigned char)adler };
+	zlib.insert(zlib.end(), adlerBytes, adlerBytes + 4);
+
+	std::ofstream file(path_, std::ios::binary);
+	if (!file)
+		return false;
+
+	auto writeChunk = [&file](const char* type, const unsigned char* data, size_t size)
+	{
+		unsigned char header[8] = { (unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size,
+			(unsigned char)type[0], (unsigned char)type[1], (unsigned char)type[2], (unsigned char)type[3] };
+		unsigned int crc = UpdateCRC32(UpdateCRC32(0, header + 4, 4), data, size);
+		unsigned char footer[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+
+		file.write((const char*)header, 8);
+		file.write((const char*)data, size);
+		file.write((const char*)footer, 4);
+	};
+
+	static const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	file.write((const char*)signature, sizeof(signature));
+
+	unsigned char ihdr[13] = { (unsigned char)(width_ >> 24), (unsigned char)(width_ >> 16), (unsigned char)(width_ >> 8), (unsigned char)width_,
+		(unsigned char)(height_ >> 24), (unsigned char)(height_ >> 16), (unsigned char)(height_ >> 8), (unsigned char)height_,
+		8, 2, 0, 0, 0 }; // 8 bit, truecolor
+	writeChunk("IHDR", ihdr, sizeof(ihdr));
+	writeChunk("IDAT", zlib.data(), zlib.size());
+	writeChunk("IEND", nullptr, 0);
+
+	return bool(file);
+}
+
+// Half float RGB OpenEXR, one uncompressed scanline per chunk, keeps the
+// radiance unclamped for compositing. Written little endian like the format.
+bool WriteEXR(const char* path_, int width_, int height_, const float* rgb_)
+{
+	std::vector<unsigned char> header;
+	auto put = [&header](const void* data, size_t size)
+	{
+		header.insert(header.end(), (const unsigned char*)data, (const unsigned char*)data + size);
+	};
+	auto putInt = [&put](int value)
+	{
+		put(&value, 4);
+	};
+	auto putAttribute = [&put, &putInt](const char* name, const char* type, int size)
+	{
+		put(name, strlen(name) + 1);
+		put(type, strlen(type) + 1);
+		putInt(size);
+	};
+
+	const int magic[] = { 20000630, 2 };
+	put(magic, sizeof(magic));
+
+	// channels are stored in alphabetical order, each HALF without subsampling
+	putAttribute("channels", "chlist", 3 * 18 + 1);
+	for (const char* channel : { "B", "G", "R" })
+	{
+		const unsigned char linearAndReserved[4] = {};
+		put(channel, 2);
+		putInt(1);
+		put(linearAndReserved, 4);
+		putInt(1);
+		putInt(1);
+	}
+	header.push_back(0);
+
+	putAttribute("compression", "compression", 1);
+	header.push_back(0);
+
+	const int window[] = { 0, 0, width_ - 1, height_ - 1 };
+	putAttribute("dataWindow", "box2i", 16);
+	put(window, sizeof(window));
+	putAttribute("displayWindow", "box2i", 16);
+	put(window, sizeof(window));
+
+	putAttribute("lineOrder", "lineOrder", 1);
+	header.push_back(0); // increasing y
+
+	const float one = 1.0f;
+	const float center[] = { 0.0f, 0.0f };
+	putAttribute("pixelAspectRatio", "float", 4);
+	put(&one, 4);
+	putAttribute("screenWindowCenter", "v2f", 8);
+	put(center, sizeof(center));
+	putAttribute("screenWindowWidth", "float", 4);
+	put(&one, 4);
+	header.push_back(0);
+
+	// then the offset table, one entry per scanline chunk
+	size_t lineSize = size_t(width_) * 3 * sizeof(unsigned short);
+	uint64_t offset = header.size() + uint64_t(height_) * 8;
+	for (int y = 0; y < height_; y++)
+	{
+		put(&offset, 8);
+		offset += 8 + lineSize;
+	}
+
+	std::ofstream file(path_, std::ios::binary);
+	if (!file)
+		return false;
+	file.write((const char*)header.data(), header.size());
+
+	std::vector<unsigned short> line(size_t(width_) * 3);
+	for (int y = 0; y < height_; y++)
+	{
+		const float* src = &rgb_[size_t(y) * width_ * 3];
+		for (int x = 0; x < width_; x++)
+		{
+			line[x] = FloatToHalf(src[x * 3 + 2]);
+			line[width_ + x] = FloatToHalf(src[x * 3 + 1]);
+			line[width_ * 2 + x] = FloatToHalf(src[x * 3 + 0]);
+		}
+
+		const int chunk[] = { y, (int)lineSize };
+		file.write((const char*)chunk, sizeof(chunk));
+		file.write((const char*)line.data(), lineSize);
+	}
+
+	return bool(file);
+}
+
+bool HasExtension(const std::string& path_, const char* extension_)
+{
+	size_t length = strlen(extension_);
+	if (path_.size() < length)
+		return false;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		if (tolower(path_[path_.size() - length + i]) != tolower(extension_[i]))
+			return false;
+	}
+
+	return true;
+}
+
+// picks the format from the extension, .pfm and .exr keep the radiance unclamped
+bool WriteImage(const char* path_, int width_, int height_, const float* rgb_)
+{
+	if (HasExtension(path_, ".pfm"))
+		return WritePFM(path_, width_, height_, rgb_);
+	else if (HasExtension(path_, ".exr"))
+		return WriteEXR(path_, width_, height_, rgb_);
+	else if (HasExtension(path_, ".png"))
+		return WritePNG(path_, width_, height_, rgb_);
+
+	std::cout << "WriteImage: unknown format " << path_ << std::endl;
+	return false;
+}
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IMAGE_DENOISER_SSE2
+#endif
+
+// Joint non-local means filter for finished renders, after Rousselle et al.
+// 2012. Every pixel becomes a weighted mean of the pixels in a search window.
+// A neighbour weighs by how alike the 3x3 patches around both pixels are once
+// the difference their variance explains is discounted, and by how alike their
+// first hit albedo and normal are, so edges and texture the guides show stay
+// sharp. Bands of rows run on the thread pool; each pixel only depends on the
+// input and the SSE2 lanes and the scalar tail do the same arithmetic, so the
+// result is the same for any thread count.
+class ImageDenoiser
+{
+public:
+	ImageDenoiser()
+		: pool(nullptr)
+		, searchRadius(7)
+		, k(0.45f)
+		, albedoSigma2(0.01f)
+		, normalSigma2(0.1f)
+	{
+	}
+
+	~ImageDenoiser()
+	{
+	}
+
+	void Create(ThreadPool& pool_, int searchRadius_ = 7)
+	{
+		pool = &pool_;
+		searchRadius = std::max(1, searchRadius_);
+	}
+
+	void Destroy()
+	{
+		pool = nullptr;
+	}
+
+	// variance of the mean of n samples from their mean and mean square
+	static float GetMeanVariance(float mean_, float meanSquare_, float n_)
+	{
+		return std::max(0.0f, meanSquare_ - mean_ * mean_) / std::max(n_ - 1.0f, 1.0f);
+	}
+
+	// every buffer RGB float, top row first. variance_ holds the variance of
+	// each channel's mean, normal_ the averaged first hit normals, 0 where
+	// rays escaped. output_ must not alias the inputs.
+	void Apply(int width_, int height_, const float* color_, const float* variance_, const float* albedo_, const float* normal_, float* output_) const
+	{
+		Input input;
+		input.width = width_;
+		input.height = height_;
+		input.pad = searchRadius + PATCH_RADIUS;
+		input.stride = width_ + 2 * input.pad;
+
+		// the variance is too noisy per pixel to compare against
+		std::vector<float> variance(size_t(width_) * height_ * 3);
+		for (int y = 0; y < height_; y++)
+		{
+			for (int x = 0; x < width_; x++)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					float sum = 0.0f;
+					for (int j = -1; j <= 1; j++)
+					{
+						for (int i = -1; i <= 1; i++)
+						{
+							int sx = std::min(std::max(x + i, 0), width_ - 1);
+							int sy = std::min(std::max(y + j, 0), height_ - 1);
+							sum += variance_[(size_t(sy) * width_ + sx) * 3 + c];
+						}
+					}
+					variance[(size_t(y) * width_ + x) * 3 + c] = sum / 9.0f;
+				}
+			}
+		}
+
+		const float* sources[] = { color_, variance.data(), albedo_, normal_ };
+		for (int i = 0; i < CHANNELS; i++)
+			input.Pad(i, sources[i / 3], i % 3);
+
+		const int bandHeight = 16;
+		int bandCount = (height_ + bandHeight - 1) / bandHeight;
+		std::atomic<int> nextBand(0);
+		int remaining = (int)pool->GetThreadCount();
+		std::mutex mutex;
+		std::condition_variable done;
+		for (unsigned int t = 0; t < pool->GetThreadCount(); t++)
+		{
+			pool->Enqueue([&]()
+			{
+				for (int band = nextBand++; band < bandCount; band = nextBand++)
+					FilterRows(input, band * bandHeight, std::min(height_, (band + 1) * bandHeight), output_);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--remaining == 0)
+					done.notify_one();
+			});
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&remaining]() { return remaining == 0; });
+	}
+private:
+	enum
+	{
+		PATCH_RADIUS = 1,
+		COLOR = 0,
+		VARIANCE = 3,
+		ALBEDO = 6,
+		NORMAL = 9,
+		CHANNELS = 12
+	};
+
+	// one plane per channel, edges repeated out to the search and patch radius
+	struct Input
+	{
+		int width;
+		int height;
+		int pad;
+		int stride;
+		std::vector<float> planes[CHANNELS];
+
+		void Pad(int plane_, const float* rgb_, int channel_)
+		{
+			planes[plane_].resize(size_t(stride) * (height + 2 * pad));
+			for (int y = -pad; y < height + pad; y++)
+			{
+				const float* src = rgb_ + size_t(std::min(std::max(y, 0), height - 1)) * width * 3 + channel_;
+				float* dst = &planes[plane_][size_t(y + pad) * stride];
+				for (int x = -pad; x < width + pad; x++)
+					dst[x + pad] = src[std::min(std::max(x, 0), width - 1) * 3];
+			}
+		}
+
+		const float* Row(int plane_, int x_, int y_) const
+		{
+			return &planes[plane_][size_t(y_ + pad) * stride + x_ + pad];
+		}
+	};
+
+	// exp(x_) for x_ <= 0, to about 2e-5
+	static float Exp(float x_)
+	{
+		float t = std::max(x_, -80.0f) * 1.44269504f;
+		int i = (int)t;
+		float y = (t - (float)i) * 0.693147181f;
+		float p = 1.0f / 720.0f;
+		p = p * y + 1.0f / 120.0f;
+		p = p * y + 1.0f / 24.0f;
+		p = p * y + 1.0f / 6.0f;
+		p = p * y + 0.5f;
+		p = p * y + 1.0f;
+		p = p * y + 1.0f;
+
+		uint32_t bits = uint32_t(i + 127) << 23;
+		float scale;
+		memcpy(&scale, &bits, sizeof(scale));
+		return p * scale;
+	}
+
+#ifdef IMAGE_DENOISER_SSE2
+	static __m128 Exp(__m128 x_)
+	{
+		__m128 t = _mm_mul_ps(_mm_max_ps(x_, _mm_set1_ps(-80.0f)), _mm_set1_ps(1.44269504f));
+		__m128i i = _mm_cvttps_epi32(t);
+		__m128 y = _mm_mul_ps(_mm_sub_ps(t, _mm_cvtepi32_ps(i)), _mm_set1_ps(0.693147181f));
+		__m128 p = _mm_set1_ps(1.0f / 720.0f);
+		p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f / 120.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f / 24.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f / 6.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(0.5f));
+		p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f));
+
+		__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+		return _mm_mul_ps(p, scale);
+	}
+#endif
+
+	// variance cancelled squared difference of count_ pixels of row y_ from
+	// x_ on to the pixels dx_, dy_ away, summed over the color channels
+	void GetPixelDistances(const Input& input_, int x_, int y_, int dx_, int dy_, int count_, float* distances_) const
+	{
+		float k2 = k * k;
+		for (int x = 0; x < count_; x++)
+			distances_[x] = 0.0f;
+
+		for (int c = 0; c < 3; c++)
+		{
+			const float* up = input_.Row(COLOR + c, x_, y_);
+			const float* uq = input_.Row(COLOR + c, x_ + dx_, y_ + dy_);
+			const float* vp = input_.Row(VARIANCE + c, x_, y_);
+			const float* vq = input_.Row(VARIANCE + c, x_ + dx_, y_ + dy_);
+
+			int x = 0;
+#ifdef IMAGE_DENOISER_SSE2
+			for (; x + 4 <= count_; x += 4)
+			{
+				__m128 d = _mm_sub_ps(_mm_loadu_ps(up + x), _mm_loadu_ps(uq + x));
+				__m128 p = _mm_loadu_ps(vp + x);
+				__m128 q = _mm_loadu_ps(vq + x);
+				__m128 numerator = _mm_sub_ps(_mm_mul_ps(d, d), _mm_add_ps(p, _mm_min_ps(p, q)));
+				__m128 denominator = _mm_add_ps(_mm_set1_ps(1e-10f), _mm_mul_ps(_mm_set1_ps(k2), _mm_add_ps(p, q)));
+				_mm_storeu_ps(distances_ + x, _mm_add_ps(_mm_loadu_ps(distances_ + x), _mm_div_ps(numerator, denominator)));
+			}
+#endif
+			for (; x < count_; x++)
+			{
+				float d = up[x] - uq[x];
+				float p = vp[x];
+				float q = vq[x];
+				float numerator = d * d - (p + std::min(p, q));
+				float denominator = 1e-10f + k2 * (p + q);
+				distances_[x] = distances_[x] + numerator / denominator;
+			}
+		}
+	}
+
+	// adds the neighbours dx_, dy_ away to row y_, weighed by the patch
+	// distances summed over the three rows of distance sums h0_..h2_
+	void AccumulateRow(const Input& input_, int y_, int dx_, int dy_, const float* h0_, const float* h1_, const float* h2_, float* sums_) const
+	{
+		const float patchScale = 1.0f / (3.0f * (2 * PATCH_RADIUS + 1) * (2 * PATCH_RADIUS + 1));
+		float albedoScale = 1.0f / albedoSigma2;
+		float normalScale = 1.0f / normalSigma2;
+		const float* ap[3];
+		const float* aq[3];
+		const float* np[3];
+		const float* nq[3];
+		const float* cq[3];
+		for (int c = 0; c < 3; c++)
+		{
+			ap[c] = input_.Row(ALBEDO + c, 0, y_);
+			aq[c] = input_.Row(ALBEDO + c, dx_, y_ + dy_);
+			np[c] = input_.Row(NORMAL + c, 0, y_);
+			nq[c] = input_.Row(NORMAL + c, dx_, y_ + dy_);
+			cq[c] = input_.Row(COLOR + c, dx_, y_ + dy_);
+		}
+
+		int width = input_.width;
+		float* sumR = sums_;
+		float* sumG = sums_ + width;
+		float* sumB = sums_ + width * 2;
+		float* sumW = sums_ + width * 3;
+
+		int x = 0;
+#ifdef IMAGE_DENOISER_SSE2
+		for (; x + 4 <= width; x += 4)
+		{
+			__m128 patch = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(h0_ + x), _mm_loadu_ps(h1_ + x)), _mm_loadu_ps(h2_ + x));
+			__m128 albedoDistance = _mm_setzero_ps();
+			__m128 normalDistance = _mm_setzero_ps();
+			for (int c = 0; c < 3; c++)
+			{
+				__m128 a = _mm_sub_ps(_mm_loadu_ps(ap[c] + x), _mm_loadu_ps(aq[c] + x));
+				__m128 n = _mm_sub_ps(_mm_loadu_ps(np[c] + x), _mm_loadu_ps(nq[c] + x));
+				albedoDistance = _mm_add_ps(albedoDistance, _mm_mul_ps(a, a));
+				normalDistance = _mm_add_ps(normalDistance, _mm_mul_ps(n, n));
+			}
+			__m128 exponent = _mm_add_ps(_mm_max_ps(_mm_mul_ps(patch, _mm_set1_ps(patchScale)), _mm_setzero_ps()),
+				_mm_add_ps(_mm_mul_ps(albedoDistance, _mm_set1_ps(albedoScale)), _mm_mul_ps(normalDistance, _mm_set1_ps(normalScale))));
+			__m128 weight = Exp(_mm_sub_ps(_mm_setzero_ps(), exponent));
+
+			_mm_storeu_ps(sumR + x, _mm_add_ps(_mm_loadu_ps(sumR + x), _mm_mul_ps(weight, _mm_loadu_ps(cq[0] + x))));
+			_mm_storeu_ps(sumG + x, _mm_add_ps(_mm_loadu_ps(sumG + x), _mm_mul_ps(weight, _mm_loadu_ps(cq[1] + x))));
+			_mm_storeu_ps(sumB + x, _mm_add_ps(_mm_loadu_ps(sumB + x), _mm_mul_ps(weight, _mm_loadu_ps(cq[2] + x))));
+			_mm_storeu_ps(sumW + x, _mm_add_ps(_mm_loadu_ps(sumW + x), weight));
+		}
+#endif
+		for (; x < width; x++)
+		{
+			float patch = (h0_[x] + h1_[x]) + h2_[x];
+			float albedoDistance = 0.0f;
+			float normalDistance = 0.0f;
+			for (int c = 0; c < 3; c++)
+			{
+				float a = ap[c][x] - aq[c][x];
+				float n = np[c][x] - nq[c][x];
+				albedoDistance = albedoDistance + a * a;
+				normalDistance = normalDistance + n * n;
+			}
+			float exponent = std::max(patch * patchScale, 0.0f) + (albedoDistance * albedoScale + normalDistance * normalScale);
+			float weight = Exp(0.0f - exponent);
+
+			sumR[x] = sumR[x] + weight * cq[0][x];
+			sumG[x] = sumG[x] + weight * cq[1][x];
+			sumB[x] = sumB[x] + weight * cq[2][x];
+			sumW[x] = sumW[x] + weight;
+		}
+	}
+
+	void FilterRows(const Input& input_, int y0_, int y1_, float* output_) const
+	{
+		int width = input_.width;
+		int rows = y1_ - y0_;
+		int span = width + 2 * PATCH_RADIUS;
+		std::vector<float> distances(span);
+		std::vector<float> horizontal(size_t(rows + 2 * PATCH_RADIUS) * width);
+		std::vector<float> sums(size_t(rows) * width * 4, 0.0f);
+
+		for (int dy = -searchRadius; dy <= searchRadius; dy++)
+		{
+			for (int dx = -searchRadius; dx <= searchRadius; dx++)
+			{
+				// pixel distances summed across the patch width, then its height
+				for (int r = 0; r < rows + 2 * PATCH_RADIUS; r++)
+				{
+					GetPixelDistances(input_, -PATCH_RADIUS, y0_ - PATCH_RADIUS + r, dx, dy, span, distances.data());
+
+					float* dst = &horizontal[size_t(r) * width];
+					for (int x = 0; x < width; x++)
+						dst[x] = (distances[x] + distances[x + 1]) + distances[x + 2];
+				}
+
+				for (int r = 0; r < rows; r++)
+				{
+					AccumulateRow(input_, y0_ + r, dx, dy, &horizontal[size_t(r) * width], &horizontal[size_t(r + 1) * width],
+						&horizontal[size_t(r + 2) * width], &sums[size_t(r) * width * 4]);
+				}
+			}
+		}
+
+		for (int r = 0; r < rows; r++)
+		{
+			const float* sum = &sums[size_t(r) * width * 4];
+			float* dst = output_ + size_t(y0_ + r) * width * 3;
+			for (int x = 0; x < width; x++)
+			{
+				// the pixel itself always weighs 1
+				float weight = 1.0f / sum[width * 3 + x];
+				dst[x * 3 + 0] = sum[x] * weight;
+				dst[x * 3 + 1] = sum[width + x] * weight;
+				dst[x * 3 + 2] = sum[width * 2 + x] * weight;
+			}
+		}
+	}
+
+	ThreadPool* pool;
+	int searchRadius;
+	float k;				// how many standard deviations of difference count as alike
+	float albedoSigma2;		// falloff of the squared guide differences
+	float normalSigma2;
+};
+
+// Part of a render that can be merged with others: per pixel sample sums,
+// sample counts and optionally sums of squared samples. Merging only adds, so
+// partials combine in any order and more can be merged in as they arrive.
+// The sample index ranges that went in are kept to catch overlapping
+// (correlated) renders, and the render key rejects partials of another view.
+class PartialImage
+{
+public:
+	struct SampleRange
+	{
+		unsigned int first;
+		unsigned int count;
+	};
+
+	PartialImage()
+		: width(0)
+		, height(0)
+		, hasMoments(false)
+		, renderKey(0)
+	{
+	}
+
+	~PartialImage()
+	{
+	}
+
+	void Create(int width_, int height_, bool moments_, uint64_t renderKey_)
+	{
+		width = width_;
+		height = height_;
+		hasMoments = moments_;
+		renderKey = renderKey_;
+
+		sums.assign(size_t(width) * height * 3, 0.0f);
+		counts.assign(size_t(width) * height, 0);
+		squares.assign(hasMoments ? sums.size() : 0, 0.0f);
+		ranges.clear();
+	}
+
+	// mean_ and meanSquares_ (optional) are per pixel averages over samples_
+	void AddRegion(int x_, int y_, int width_, int height_, const float* mean_, const float* meanSquares_, unsigned int samples_)
+	{
+		for (int y = 0; y < height_; y++)
+		{
+			for (int x = 0; x < width_; x++)
+			{
+				size_t pixel = size_t(y_ + y) * width + x_ + x;
+				size_t src = (size_t(y) * width_ + x) * 3;
+				for (int c = 0; c < 3; c++)
+				{
+					sums[pixel * 3 + c] += mean_[src + c] * samples_;
+					if (hasMoments)
+						squares[pixel * 3 + c] += meanSquares_ ? meanSquares_[src + c] * samples_ : 0.0f;
+				}
+				counts[pixel] += samples_;
+			}
+		}
+
+		// without squares the moments no longer describe every sample
+		if (!meanSquares_)
+			DropMoments();
+	}
+
+	void AddRange(unsigned int first_, unsigned int count_)
+	{
+		SampleRange range = { first_, count_ };
+		ranges.push_back(range);
+	}
+
+	// false if other_ renders something else, overlapping_ reports reused sample indices
+	bool Merge(const PartialImage& other_, bool& overlapping_)
+	{
+		if (other_.width != width || other_.height != height || other_.renderKey != renderKey)
+			return false;
+
+		overlapping_ = false;
+		for (auto& a : ranges)
+		{
+			for (auto& b : other_.ranges)
+				overlapping_ = overlapping_ || (a.first < b.first + b.count && b.first < a.first + a.count);
+		}
+		ranges.insert(ranges.end(), other_.ranges.begin(), other_.ranges.end());
+
+		for (size_t i = 0; i < sums.size(); i++)
+			sums[i] += other_.sums[i];
+		for (size_t i = 0; i < counts.size(); i++)
+			counts[i] += other_.counts[i];
+
+		if (hasMoments && other_.hasMoments)
+		{
+			for (size_t i = 0; i < squares.size(); i++)
+				squares[i] += other_.squares[i];
+		}
+		else
+		{
+			DropMoments();
+		}
+
+		return true;
+	}
+
+	// mean radiance, float RGB top row first
+	void Resolve(std::vector<float>& rgb_) const
+	{
+		rgb_.resize(sums.size());
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			float weight = counts[i] ? 1.0f / counts[i] : 0.0f;
+			for (int c = 0; c < 3; c++)
+				rgb_[i * 3 + c] = sums[i * 3 + c] * weight;
+		}
+	}
+
+	// variance of each pixel's mean, float RGB, needs moments
+	bool ResolveVariance(std::vector<float>& rgb_) const
+	{
+		if (!hasMoments)
+			return false;
+
+		rgb_.resize(sums.size());
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				if (counts[i] < 2)
+				{
+					rgb_[i * 3 + c] = 0.0f;
+					continue;
+				}
+
+				float n = (float)counts[i];
+				float mean = sums[i * 3 + c] / n;
+				float sampleVariance = std::max(0.0f, squares[i * 3 + c] / n - mean * mean) * n / (n - 1.0f);
+				rgb_[i * 3 + c] = sampleVariance / n;
+			}
+		}
+
+		return true;
+	}
+
+	bool Write(const char* path_) const
+	{
+		std::ofstream file(path_, std::ios::binary);
+		if (!file)
+			return false;
+
+		Header header = {};
+		memcpy(header.magic, "GPRT", 4);
+		header.version = VERSION;
+		header.width = width;
+		header.height = height;
+		header.flags = hasMoments ? FLAG_MOMENTS : 0;
+		header.rangeCount = (uint32_t)ranges.size();
+		header.renderKey = renderKey;
+
+		file.write((const char*)&header, sizeof(header));
+		file.write((const char*)ranges.data(), ranges.size() * sizeof(SampleRange));
+		file.write((const char*)sums.data(), sums.size() * sizeof(float));
+		file.write((const char*)counts.data(), counts.size() * sizeof(uint32_t));
+		file.write((const char*)squares.data(), squares.size() * sizeof(float));
+
+		return bool(file);
+	}
+
+	bool Read(const char* path_)
+	{
+		std::ifstream file(path_, std::ios::binary | std::ios::ate);
+		uint64_t fileSize = file ? uint64_t(file.tellg()) : 0;
+		file.seekg(0);
+
+		Header header;
+		if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, "GPRT", 4) != 0 || header.version != VERSION ||
+			header.width == 0 || header.height == 0 || header.width > 65536 || header.height > 65536)
+		{
+			return false;
+		}
+
+		// the counts are untrusted, a truncated or damaged file must not size the buffers
+		uint64_t pixelCount = uint64_t(header.width) * header.height;
+		uint64_t pixelSize = 3 * sizeof(float) + sizeof(uint32_t) + ((header.flags & FLAG_MOMENTS) ? 3 * sizeof(float) : 0);
+		if (fileSize != sizeof(header) + uint64_t(header.rangeCount) * sizeof(SampleRange) + pixelCount * pixelSize)
+		{
+			return false;
+		}
+
+		Create(header.width, header.height, (header.flags & FLAG_MOMENTS) != 0, header.renderKey);
+		ranges.resize(header.rangeCount);
+		file.read((char*)ranges.data(), ranges.size() * sizeof(SampleRange));
+		file.read((char*)sums.data(), sums.size() * sizeof(float));
+		file.read((char*)counts.data(), counts.size() * sizeof(uint32_t));
+		file.read((char*)squares.data(), squares.size() * sizeof(float));
+
+		return bool(file);
+	}
+
+	int GetWidth() const
+	{
+		return width;
+	}
+
+	int GetHeight() const
+	{
+		return height;
+	}
+
+	bool HasMoments() const
+	{
+		return hasMoments;
+	}
+
+	void GetSampleCountRange(unsigned int& min_, unsigned int& max_) const
+	{
+		min_ = counts.empty() ? 0 : *std::min_element(counts.begin(), counts.end());
+		max_ = counts.empty() ? 0 : *std::max_element(counts.begin(), counts.end());
+	}
+private:
+	void DropMoments()
+	{
+		hasMoments = false;
+		squares.clear();
+		squares.shrink_to_fit();
+	}
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t flags;
+		uint32_t rangeCount;
+		uint64_t renderKey;
+	};
+
+	enum
+	{
+		VERSION = 1,
+		FLAG_MOMENTS = 1
+	};
+
+	int width;
+	int height;
+	bool hasMoments;
+	uint64_t renderKey;
+	std::vector<float> sums;
+	std::vector<uint32_t> counts;
+	std::vector<float> squares;
+	std::vector<SampleRange> ranges;
+};
+
+// identifies what a partial image is a render of
+uint64_t MakeRenderKey(int width_, int height_, const float* camera_, const std::string& variant_)
+{
+	int size[] = { width_, height_ };
+	uint64_t hash = HashFNV1a((const unsigned char*)size, sizeof(size));
+	hash = HashFNV1a((const unsigned char*)camera_, 9 * sizeof(float), hash);
+
+	return HashFNV1a((const unsigned char*)variant_.data(), variant_.size(), hash);
+}
+
+// replaces to_ in one step, so a crash leaves either the old or the new file
+bool ReplaceFileWith(const std::string& from_, const std::string& to_)
+{
+#ifdef _WIN32
+	return MoveFileExA(from_.c_str(), to_.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return std::rename(from_.c_str(), to_.c_str()) == 0;
+#endif
+}
+
+// Everything needed to continue a progressive render: the raw accumulation
+// targets as ProgressiveRenderer::ReadSnapshot() returns them, the passes they
+// hold and the frame index of the first one. The render key guards against
+// resuming another scene, view, size or depth.
+struct RenderCheckpoint
+{
+	int width = 0;
+	int height = 0;
+	unsigned int firstSample = 0;
+	int passCount = 0;
+	uint64_t renderKey = 0;
+	std::vector<float> sums;		// RGBA, alpha counts passes, bottom row first
+	std::vector<float> moments;
+
+	bool Write(const char* path_) const
+	{
+		Header header = {};
+		memcpy(header.magic, "GCKP", 4);
+		header.version = VERSION;
+		header.width = width;
+		header.height = height;
+		header.firstSample = firstSample;
+		header.passCount = passCount;
+		header.renderKey = renderKey;
+
+		std::string tempPath = std::string(path_) + ".tmp";
+		std::ofstream file(tempPath.c_str(), std::ios::binary);
+		if (!file)
+			return false;
+
+		file.write((const char*)&header, sizeof(header));
+		file.write((const char*)sums.data(), sums.size() * sizeof(float));
+		file.write((const char*)moments.data(), moments.size() * sizeof(float));
+		file.close();
+
+		if (!file || !ReplaceFileWith(tempPath, path_))
+		{
+			std::remove(tempPath.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	bool Read(const char* path_)
+	{
+		std::ifstream file(path_, std::ios::binary | std::ios::ate);
+		uint64_t fileSize = file ? uint64_t(file.tellg()) : 0;
+		file.seekg(0);
+
+		Header header;
+		if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, "GCKP", 4) != 0 || header.version != VERSION ||
+			header.width == 0 || header.height == 0 || header.width > 65536 || header.height > 65536)
+		{
+			return false;
+		}
+
+		// RGBA sums and moments per pixel, a stale or damaged header must not size the buffers
+		if (fileSize != sizeof(header) + uint64_t(header.width) * header.height * 8 * sizeof(float))
+		{
+			return false;
+		}
+
+		width = header.width;
+		height = header.height;
+		firstSample = header.firstSample;
+		passCount = header.passCount;
+		renderKey = header.renderKey;
+		sums.resize(size_t(width) * height * 4);
+		moments.resize(sums.size());
+		file.read((char*)sums.data(), sums.size() * sizeof(float));
+		file.read((char*)moments.data(), moments.size() * sizeof(float));
+
+		return bool(file);
+	}
+private:
+	enum
+	{
+		VERSION = 1
+	};
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t firstSample;
+		uint32_t passCount;
+		uint64_t renderKey;
+	};
+};
+
+// Writes checkpoints on a background thread so rendering never waits on the
+// disk. Only the newest checkpoint matters, so a pending one is replaced.
+class CheckpointWriter
+{
+public:
+	CheckpointWriter()
+		: running(false)
+		, busy(false)
+		, hasPending(false)
+		, writtenPassCount(0)
+	{
+	}
+
+	~CheckpointWriter()
+	{
+	}
+
+	void Create(const std::string& path_)
+	{
+		path = path_;
+		running = true;
+		thread = std::thread(&CheckpointWriter::Run, this);
+	}
+
+	void Destroy()
+	{
+		if (!running)
+			return;
+
+		Flush();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		wake.notify_one();
+		thread.join();
+	}
+
+	// takes the contents of checkpoint_
+	void Submit(RenderCheckpoint& checkpoint_)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::swap(pending, checkpoint_);
+			hasPending = true;
+		}
+		wake.notify_one();
+	}
+
+	// waits until every submitted checkpoint is on disk
+	void Flush()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [this]() { return !hasPending && !busy; });
+	}
+
+	// passes held by the newest checkpoint on disk
+	int GetWrittenPassCount()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return writtenPassCount;
+	}
+private:
+	void Run()
+	{
+		RenderCheckpoint checkpoint;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [this]() { return hasPending || !running; });
+			if (!hasPending)
+				break;
+
+			std::swap(checkpoint, pending);
+			hasPending = false;
+			busy = true;
+			lock.unlock();
+
+			bool written = checkpoint.Write(path.c_str());
+			if (!written)
+				std::cout << "Checkpoint: failed to write " << path << std::endl;
+
+			lock.lock();
+			busy = false;
+			if (written)
+				writtenPassCount = checkpoint.passCount;
+			idle.notify_all();
+		}
+	}
+
+	std::string path;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	bool running;
+	bool busy;
+	bool hasPending;
+	int writtenPassCount;
+	RenderCheckpoint pending;
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+// Stream socket, a Unix domain socket for local control or TCP between machines.
+// Lines are '\n' terminated, binary payloads follow a line that gives their size.
+class Socket
+{
+public:
+#ifdef _WIN32
+	typedef SOCKET Handle;
+#else
+	typedef int Handle;
+#endif
+
+	Socket()
+		: handle(INVALID)
+	{
+	}
+
+	~Socket()
+	{
+	}
+
+	static bool Startup()
+	{
+#ifdef _WIN32
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+		signal(SIGPIPE, SIG_IGN); // a peer that went away shows up as a failed send
+		return true;
+#endif
+	}
+
+	bool Listen(const char* path_)
+	{
+		sockaddr_un address = {};
+		if (strlen(path_) >= sizeof(address.sun_path))
+			return false;
+
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, path_);
+#ifdef _WIN32
+		DeleteFileA(path_);
+#else
+		unlink(path_);
+#endif
+
+		handle = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (handle == INVALID || bind(handle, (sockaddr*)&address, sizeof(address)) != 0 || listen(handle, 16) != 0)
+		{
+			Close();
+			return false;
+		}
+
+		path = path_;
+
+		return true;
+	}
+
+	bool Connect(const char* path_)
+	{
+		sockaddr_un address = {};
+		if (strlen(path_) >= sizeof(address.sun_path))
+			return false;
+
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, path_);
+
+		handle = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (handle == INVALID || connect(handle, (sockaddr*)&address, sizeof(address)) != 0)
+		{
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+
+	bool ListenTCP(int port_)
+	{
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons((unsigned short)port_);
+
+		handle = socket(AF_INET, SOCK_STREAM, 0);
+		int reuse = 1;
+		if (handle == INVALID || setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) != 0 ||
+			bind(handle, (sockaddr*)&address, sizeof(address)) != 0 || listen(handle, 64) != 0)
+		{
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+
+	bool ConnectTCP(const char* host_, int port_)
+	{
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		addrinfo* addresses = nullptr;
+		if (getaddrinfo(host_, std::to_string(port_).c_str(), &hints, &addresses) != 0)
+			return false;
+
+		for (addrinfo* address = addresses; address; address = address->ai_next)
+		{
+			handle = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+			if (handle != INVALID && connect(handle, address->ai_addr, (int)address->ai_addrlen) == 0)
+				break;
+
+			Close();
+		}
+		freeaddrinfo(addresses);
+
+		if (handle == INVALID)
+			return false;
+
+		// requests are single short lines
+		int noDelay = 1;
+		setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+		return true;
+	}
+
+	// blocking receives fail after seconds_ without data
+	void SetReceiveTimeout(int seconds_)
+	{
+#ifdef _WIN32
+		DWORD milliseconds = seconds_ * 1000;
+		setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, (const char*)&milliseconds, sizeof(milliseconds));
+#else
+		timeval time = { seconds_, 0 };
+		setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, (const char*)&time, sizeof(time));
+#endif
+	}
+
+	bool Accept(Socket& client_)
+	{
+		client_.handle = accept(handle, nullptr, nullptr);
+
+		return client_.handle != INVALID;
+	}
+
+	void Close()
+	{
+		if (handle != INVALID)
+		{
+#ifdef _WIN32
+			closesocket(handle);
+#else
+			close(handle);
+#endif
+			handle = INVALID;
+		}
+
+		if (!path.empty())
+		{
+#ifdef _WIN32
+			DeleteFileA(path.c_str());
+#else
+			unlink(path.c_str());
+#endif
+			path.clear();
+		}
+
+		buffer.clear();
+	}
+
+	bool IsOpen() const
+	{
+		return handle != INVALID;
+	}
+
+	bool Send(const void* data_, size_t size_)
+	{
+		const char* data = (const char*)data_;
+		while (size_ > 0)
+		{
+			int sent = send(handle, data, (int)std::min(size_, size_t(1 << 30)), 0);
+			if (sent <= 0)
+				return false;
+
+			data += sent;
+			size_ -= sent;
+		}
+
+		return true;
+	}
+
+	bool SendLine(const std::string& line_)
+	{
+		std::string line = line_ + "\n";
+
+		return Send(line.data(), line.size());
+	}
+
+	// reads whatever has arrived, false once the peer closed the connection
+	bool ReceiveAvailable()
+	{
+		char chunk[4096];
+		int received = recv(handle, chunk, sizeof(chunk), 0);
+		if (received <= 0)
+			return false;
+
+		buffer.append(chunk, received);
+
+		return true;
+	}
+
+	// takes a complete line out of what has been received
+	bool PopLine(std::string& line_)
+	{
+		size_t end = buffer.find('\n');
+		if (end == std::string::npos)
+			return false;
+
+		line_ = buffer.substr(0, end);
+		if (!line_.empty() && line_.back() == '\r')
+			line_.pop_back();
+		buffer.erase(0, end + 1);
+
+		return true;
+	}
+
+	// blocking
+	bool ReceiveLine(std::string& line_)
+	{
+		while (!PopLine(line_))
+		{
+			if (!ReceiveAvailable())
+				return false;
+		}
+
+		return true;
+	}
+
+	// blocking, takes buffered bytes first
+	bool Receive(void* data_, size_t size_)
+	{
+		char* data = (char*)data_;
+		size_t buffered = std::min(size_, buffer.size());
+		memcpy(data, buffer.data(), buffered);
+		buffer.erase(0, buffered);
+		data += buffered;
+		size_ -= buffered;
+
+		while (size_ > 0)
+		{
+			int received = recv(handle, data, (int)std::min(size_, size_t(1 << 30)), 0);
+			if (received <= 0)
+				return false;
+
+			data += received;
+			size_ -= received;
+		}
+
+		return true;
+	}
+
+	bool HasBufferedLine() const
+	{
+		return buffer.find('\n') != std::string::npos;
+	}
+
+	// waits up to timeoutMs_ for any of sockets_ to become readable, readable_[i] reports which
+	static int Select(const std::vector<Socket*>& sockets_, int timeoutMs_, std::vector<bool>& readable_)
+	{
+		fd_set set;
+		FD_ZERO(&set);
+		Handle maxHandle = 0;
+		for (auto socket : sockets_)
+		{
+			FD_SET(socket->handle, &set);
+			maxHandle = std::max(maxHandle, socket->handle);
+		}
+
+		timeval timeout;
+		timeout.tv_sec = timeoutMs_ / 1000;
+		timeout.tv_usec = (timeoutMs_ % 1000) * 1000;
+		int count = select((int)maxHandle + 1, &set, nullptr, nullptr, &timeout);
+
+		readable_.assign(sockets_.size(), false);
+		for (size_t i = 0; i < sockets_.size() && count > 0; i++)
+			readable_[i] = FD_ISSET(sockets_[i]->handle, &set) != 0;
+
+		return count;
+	}
+private:
+#ifdef _WIN32
+	static const Handle INVALID = INVALID_SOCKET;
+#else
+	static const Handle INVALID = -1;
+#endif
+
+	Handle handle;
+	std::string path;
+	std::string buffer;
+};
+
+// key=value arguments of a protocol line, "render width=800 spp=64"
+class LineArguments
+{
+public:
+	explicit LineArguments(const std::string& line_)
+	{
+		std::istringstream stream(line_);
+		stream >> command;
+
+		std::string token;
+		while (stream >> token)
+		{
+			size_t equals = token.find('=');
+			if (equals != std::string::npos)
+				values[token.substr(0, equals)] = token.substr(equals + 1);
+		}
+	}
+
+	const std::string& GetCommand() const
+	{
+		return command;
+	}
+
+	bool Has(const char* key_) const
+	{
+		return values.find(key_) != values.end();
+	}
+
+	std::string GetString(const char* key_, const char* default_ = "") const
+	{
+		auto found = values.find(key_);
+
+		return found != values.end() ? found->second : default_;
+	}
+
+	int GetInt(const char* key_, int default_) const
+	{
+		auto found = values.find(key_);
+
+		return found != values.end() ? atoi(found->second.c_str()) : default_;
+	}
+
+	// comma separated floats, false unless exactly count_ are given
+	bool GetFloats(const char* key_, float* values_, int count_) const
+	{
+		auto found = values.find(key_);
+		if (found == values.end())
+			return false;
+
+		std::istringstream stream(found->second);
+		std::string item;
+		int count = 0;
+		while (std::getline(stream, item, ',') && count < count_)
+			values_[count++] = (float)atof(item.c_str());
+
+		return count == count_ && !std::getline(stream, item, ',');
+	}
+private:
+	std::string command;
+	std::map<std::string, std::string> values;
+};
+
+// Copies a framebuffer attachment into a pixel buffer object without waiting
+// for the GPU. Begin() queues the copy behind the draws already submitted,
+// IsReady() polls its fence and Read() maps the buffer once it signalled.
+class PixelReadback
+{
+public:
+	PixelReadback()
+		: handle(0)
+		, size(0)
+		, fence(0)
+	{
+	}
+
+	~PixelReadback()
+	{
+	}
+
+	bool Create(size_t size_)
+	{
+		glGenBuffers(1, &handle);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, handle);
+		glBufferData(GL_PIXEL_PACK_BUFFER, size_, nullptr, GL_STREAM_READ);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		size = size_;
+
+		return handle != 0;
+	}
+
+	void Destroy()
+	{
+		if (fence)
+		{
+			glDeleteSync(fence);
+			fence = 0;
+		}
+
+		if (handle)
+		{
+			glDeleteBuffers(1, &handle);
+			handle = 0;
+		}
+		size = 0;
+	}
+
+	// rows bottom up like glReadPixels, at most GetSize() bytes
+	void Begin(FrameBufferObject& framebuffer_, int attachment_, int x_, int y_, int width_, int height_, unsigned int format_, unsigned int type_)
+	{
+		if (fence)
+			glDeleteSync(fence);
+
+		framebuffer_.Bind();
+		glReadBuffer(GL_COLOR_ATTACHMENT0 + attachment_);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, handle);
+		glReadPixels(x_, y_, width_, height_, format_, type_, nullptr);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		framebuffer_.Unbind();
+
+		fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glFlush(); // the fence must reach the GPU even if nothing else is submitted
+	}
+
+	bool IsPending() const
+	{
+		return fence != 0;
+	}
+
+	// never blocks
+	bool IsReady()
+	{
+		if (!fence)
+			return false;
+
+		GLenum status = glClientWaitSync(fence, 0, 0);
+		return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+	}
+
+	// copies the first size_ bytes out, waiting for the copy if it is not done yet
+	bool Read(void* data_, size_t size_)
+	{
+		if (!fence || size_ > size)
+			return false;
+
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+		{
+		}
+		glDeleteSync(fence);
+		fence = 0;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, handle);
+		const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size_, GL_MAP_READ_BIT);
+		if (mapped)
+		{
+			memcpy(data_, mapped, size_);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		return mapped != nullptr;
+	}
+
+	size_t GetSize() const
+	{
+		return size;
+	}
+private:
+	unsigned int handle;
+	size_t size;
+	GLsync fence;
+};
+
+// Adds passes of the path tracer into a float target with additive blending.
+// Alpha counts the passes that reached each pixel, so Read() can average and
+// any number of samples can be taken at any resolution. A second target sums
+// squared radiance for programs built with OUTPUT_MOMENTS. Snapshots of both
+// read back asynchronously and Restore() continues from one.
+class ProgressiveRenderer
+{
+public:
+	ProgressiveRenderer()
+		: passCount(0)
+		, snapshotPassCount(0)
+	{
+	}
+
+	~ProgressiveRenderer()
+	{
+	}
+
+	// guides_ adds the albedo and normal/depth sums of programs built with OUTPUT_GBUFFER
+	bool Create(unsigned int width_, unsigned int height_, bool guides_ = false)
+	{
+		const unsigned int formats[] = { GL_RGBA32F, GL_RGBA32F, GL_RGBA32F, GL_RGBA32F };
+		if (!target.Create(width_, height_, formats, guides_ ? 4 : 2))
+			return false;
+
+		Reset();
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		snapshots[0].Destroy();
+		snapshots[1].Destroy();
+		target.Destroy();
+		passCount = 0;
+	}
+
+	void Reset()
+	{
+		target.Bind();
+		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+		target.Unbind();
+
+		passCount = 0;
+	}
+
+	// draw one full screen pass between these
+	void BeginPass()
+	{
+		target.Bind();
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE);
+	}
+
+	// only the region, y_ counted from the top, is shaded and accumulated
+	void BeginPass(int x_, int y_, int width_, int height_)
+	{
+		BeginPass();
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(x_, target.GetHeight() - y_ - height_, width_, height_);
+	}
+
+	void EndPass()
+	{
+		glDisable(GL_SCISSOR_TEST);
+		glDisable(GL_BLEND);
+		target.Unbind();
+
+		passCount++;
+	}
+
+	// averaged radiance as float RGB, top row first. Blocks until the GPU is done.
+	void Read(std::vector<float>& rgb_)
+	{
+		Read(rgb_, 0, 0, target.GetWidth(), target.GetHeight());
+	}
+
+	// a region, y_ counted from the top. squares_ receives the mean squared radiance.
+	void Read(std::vector<float>& rgb_, int x_, int y_, int width_, int height_, std::vector<float>* squares_ = nullptr)
+	{
+		unsigned int width = width_;
+		unsigned int height = height_;
+
+		std::vector<float> rgba(size_t(width) * height * 4);
+		std::vector<float> moments(squares_ ? rgba.size() : 0);
+		target.Bind();
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glReadPixels(x_, target.GetHeight() - y_ - height_, width, height, GL_RGBA, GL_FLOAT, rgba.data());
+		if (squares_)
+		{
+			glReadBuffer(GL_COLOR_ATTACHMENT1);
+			glReadPixels(x_, target.GetHeight() - y_ - height_, width, height, GL_RGBA, GL_FLOAT, moments.data());
+			squares_->resize(size_t(width) * height * 3);
+		}
+		target.Unbind();
+
+		rgb_.resize(size_t(width) * height * 3);
+		for (unsigned int y = 0; y < height; y++)
+		{
+			size_t src = size_t(height - 1 - y) * width * 4;
+			size_t dst = size_t(y) * width * 3;
+			for (unsigned int x = 0; x < width; x++)
+			{
+				float weight = rgba[src + x * 4 + 3] > 0.0f ? 1.0f / rgba[src + x * 4 + 3] : 0.0f;
+				for (int c = 0; c < 3; c++)
+				{
+					rgb_[dst + x * 3 + c] = rgba[src + x * 4 + c] * weight;
+					if (squares_)
+						(*squares_)[dst + x * 3 + c] = moments[src + x * 4 + c] * weight;
+				}
+			}
+		}
+	}
+
+	// the averaged first hit albedo and normal, top row first. Averaged by their
+	// own pass count, as a resumed render only has guides from after the resume.
+	bool ReadGuides(std::vector<float>& albedo_, std::vector<float>& normal_)
+	{
+		if (target.GetColorMapCount() < 4)
+			return false;
+
+		unsigned int width = GetWidth();
+		unsigned int height = GetHeight();
+		std::vector<float> albedo(size_t(width) * height * 4);
+		std::vector<float> normal(albedo.size());
+		target.Bind();
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadBuffer(GL_COLOR_ATTACHMENT2);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, albedo.data());
+		glReadBuffer(GL_COLOR_ATTACHMENT3);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, normal.data());
+		target.Unbind();
+
+		albedo_.resize(size_t(width) * height * 3);
+		normal_.resize(albedo_.size());
+		ResolveGuides(width, height, albedo.data(), normal.data(), albedo_.data(), normal_.data());
+
+		return true;
+	}
+
+	// averages albedo_ by its alpha and normalizes the summed normals, flipping
+	// RGBA bottom row first to RGB top row first
+	static void ResolveGuides(unsigned int width_, unsigned int height_, const float* albedo_, const float* normal_, float* albedoRGB_, float* normalRGB_)
+	{
+		for (unsigned int y = 0; y < height_; y++)
+		{
+			size_t src = size_t(height_ - 1 - y) * width_ * 4;
+			size_t dst = size_t(y) * width_ * 3;
+			for (unsigned int x = 0; x < width_; x++)
+			{
+				const float* a = albedo_ + src + x * 4;
+				const float* n = normal_ + src + x * 4;
+				float weight = a[3] > 0.0f ? 1.0f / a[3] : 0.0f;
+				float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				float scale = length > 0.0f ? 1.0f / length : 0.0f;
+				for (int c = 0; c < 3; c++)
+				{
+					albedoRGB_[dst + x * 3 + c] = a[c] * weight;
+					normalRGB_[dst + x * 3 + c] = n[c] * scale;
+				}
+			}
+		}
+	}
+
+	// queues a copy of the raw sums and moments behind the passes drawn so far
+	void BeginSnapshot()
+	{
+		size_t size = size_t(GetWidth()) * GetHeight() * 4 * sizeof(float);
+		for (int i = 0; i < 2; i++)
+		{
+			if (snapshots[i].GetSize() != size)
+			{
+				snapshots[i].Destroy();
+				snapshots[i].Create(size);
+			}
+			snapshots[i].Begin(target, i, 0, 0, GetWidth(), GetHeight(), GL_RGBA, GL_FLOAT);
+		}
+		snapshotPassCount = passCount;
+	}
+
+	bool IsSnapshotPending() const
+	{
+		return snapshots[0].IsPending();
+	}
+
+	// never blocks
+	bool IsSnapshotReady()
+	{
+		return snapshots[0].IsReady() && snapshots[1].IsReady();
+	}
+
+	// RGBA with alpha counting passes, bottom row first. Returns the passes held.
+	int ReadSnapshot(std::vector<float>& sums_, std::vector<float>& moments_)
+	{
+		sums_.resize(size_t(GetWidth()) * GetHeight() * 4);
+		moments_.resize(sums_.size());
+		snapshots[0].Read(sums_.data(), sums_.size() * sizeof(float));
+		snapshots[1].Read(moments_.data(), moments_.size() * sizeof(float));
+
+		return snapshotPassCount;
+	}
+
+	// continues from what ReadSnapshot() returned
+	void Restore(const std::vector<float>& sums_, const std::vector<float>& moments_, int passCount_)
+	{
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, target.GetColorMap(0).GetHandle());
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GetWidth(), GetHeight(), GL_RGBA, GL_FLOAT, sums_.data());
+		glBindTexture(GL_TEXTURE_2D, target.GetColorMap(1).GetHandle());
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GetWidth(), GetHeight(), GL_RGBA, GL_FLOAT, moments_.data());
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		passCount = passCount_;
+	}
+
+	int GetPassCount() const
+	{
+		return passCount;
+	}
+
+	// RGBA sums, alpha counting passes
+	FrameBufferObject& GetTarget()
+	{
+		return target;
+	}
+
+	unsigned int GetWidth() const
+	{
+		return target.GetWidth();
+	}
+
+	unsigned int GetHeight() const
+	{
+		return target.GetHeight();
+	}
+private:
+	FrameBufferObject target;
+	int passCount;
+	PixelReadback snapshots[2];
+	int snapshotPassCount;
+};
+
+// Saves accumulation targets without stalling the GL thread. Submit() queues a
+// copy into the next pixel buffer object of a ring, Update() hands the copies
+// whose fence signalled to an encoder thread that averages them and writes the
+// file, so reading frame N back overlaps drawing frame N + 1. Submit() only
+// waits when the ring or the encoder has fallen a whole ring behind. With a
+// denoiser, targets holding moments and guides are also denoised there.
+class ImageOutputQueue
+{
+public:
+	// called on the GL thread from Update() or Flush(), with whether the file was written
+	typedef std::function<void(bool)> Callback;
+
+	ImageOutputQueue()
+		: next(0)
+		, denoiser(nullptr)
+		, running(false)
+		, busy(false)
+	{
+	}
+
+	~ImageOutputQueue()
+	{
+	}
+
+	void Create(int ringSize_ = 3, const ImageDenoiser* denoiser_ = nullptr)
+	{
+		slots.resize(std::max(1, ringSize_));
+		next = 0;
+		denoiser = denoiser_;
+		running = true;
+		thread = std::thread(&ImageOutputQueue::Run, this);
+	}
+
+	void Destroy()
+	{
+		if (!running)
+			return;
+
+		Flush();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		wake.notify_one();
+		thread.join();
+
+		for (auto& slot : slots)
+		{
+			for (auto& readback : slot.readbacks)
+				readback.Destroy();
+		}
+		slots.clear();
+	}
+
+	// target_ holds RGBA sums with alpha counting samples, like ProgressiveRenderer's,
+	// which are denoised when it also holds the moments and guides
+	void Submit(FrameBufferObject& target_, const std::string& path_, Callback done_ = Callback())
+	{
+		Slot& slot = slots[next];
+		if (slot.readbacks[0].IsPending())
+			Retire(next);
+
+		size_t size = size_t(target_.GetWidth()) * target_.GetHeight() * 4 * sizeof(float);
+		slot.planeCount = denoiser && target_.GetColorMapCount() >= PLANES ? PLANES : 1;
+		for (int i = 0; i < slot.planeCount; i++)
+		{
+			if (slot.readbacks[i].GetSize() != size)
+			{
+				slot.readbacks[i].Destroy();
+				slot.readbacks[i].Create(size);
+			}
+		}
+
+		slot.width = target_.GetWidth();
+		slot.height = target_.GetHeight();
+		slot.path = path_;
+		slot.done = done_;
+		for (int i = 0; i < slot.planeCount; i++)
+			slot.readbacks[i].Begin(target_, i, 0, 0, slot.width, slot.height, GL_RGBA, GL_FLOAT);
+		inFlight.push_back(next);
+
+		next = (next + 1) % (int)slots.size();
+	}
+
+	// retires finished copies in submission order and reports written files
+	void Update()
+	{
+		while (!inFlight.empty() && IsReady(slots[inFlight.front()]))
+			Retire(inFlight.front());
+
+		std::deque<Encode> done;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::swap(done, finished);
+		}
+		for (auto& encode : done)
+		{
+			if (encode.done)
+				encode.done(encode.written);
+		}
+	}
+
+	// waits until everything submitted is written
+	void Flush()
+	{
+		while (!inFlight.empty())
+			Retire(inFlight.front());
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			idle.wait(lock, [this]() { return queue.empty() && !busy; });
+		}
+
+		Update();
+	}
+
+	// copies and encodes not reported yet
+	int GetPendingCount()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return int(inFlight.size() + queue.size() + finished.size()) + (busy ? 1 : 0);
+	}
+private:
+	enum
+	{
+		PLANES = 4		// sums, moments, albedo, normal/depth
+	};
+
+	struct Slot
+	{
+		PixelReadback readbacks[PLANES];
+		int planeCount = 1;
+		int width = 0;
+		int height = 0;
+		std::string path;
+		Callback done;
+	};
+
+	struct Encode
+	{
+		std::vector<float> planes[PLANES];
+		int planeCount = 1;
+		int width = 0;
+		int height = 0;
+		std::string path;
+		Callback done;
+		bool written = false;
+	};
+
+	static bool IsReady(Slot& slot_)
+	{
+		for (int i = 0; i < slot_.planeCount; i++)
+		{
+			if (!slot_.readbacks[i].IsReady())
+				return false;
+		}
+
+		return true;
+	}
+
+	// the oldest copy in flight, blocks if the GPU has not finished it
+	void Retire(int index_)
+	{
+		Slot& slot = slots[index_];
+
+		Encode encode;
+		encode.planeCount = slot.planeCount;
+		encode.width = slot.width;
+		encode.height = slot.height;
+		encode.path = slot.path;
+		encode.done = slot.done;
+		for (int i = 0; i < slot.planeCount; i++)
+		{
+			encode.planes[i].resize(size_t(slot.width) * slot.height * 4);
+			slot.readbacks[i].Read(encode.planes[i].data(), encode.planes[i].size() * sizeof(float));
+		}
+		slot.done = Callback();
+		inFlight.pop_front();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		space.wait(lock, [this]() { return queue.size() < slots.size(); });
+		queue.push_back(std::move(encode));
+		wake.notify_one();
+	}
+
+	void Run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [this]() { return !queue.empty() || !running; });
+			if (queue.empty())
+				break;
+
+			Encode encode = std::move(queue.front());
+			queue.pop_front();
+			busy = true;
+			space.notify_one();
+			lock.unlock();
+
+			// average and flip to top row first
+			std::vector<float> rgb(size_t(encode.width) * encode.height * 3);
+			std::vector<float> variance(encode.planeCount == PLANES ? rgb.size() : 0);
+			for (int y = 0; y < encode.height; y++)
+			{
+				size_t src = size_t(encode.height - 1 - y) * encode.width * 4;
+				size_t dst = size_t(y) * encode.width * 3;
+				for (int x = 0; x < encode.width; x++)
+				{
+					const float* sum = &encode.planes[0][src + x * 4];
+					float weight = sum[3] > 0.0f ? 1.0f / sum[3] : 0.0f;
+					for (int c = 0; c < 3; c++)
+					{
+						rgb[dst + x * 3 + c] = sum[c] * weight;
+						if (!variance.empty())
+							variance[dst + x * 3 + c] = ImageDenoiser::GetMeanVariance(sum[c] * weight, encode.planes[1][src + x * 4 + c] * weight, sum[3]);
+					}
+				}
+			}
+
+			if (encode.planeCount == PLANES)
+			{
+				std::vector<float> albedo(rgb.size());
+				std::vector<float> normal(rgb.size());
+				ProgressiveRenderer::ResolveGuides(encode.width, encode.height, encode.planes[2].data(), encode.planes[3].data(), albedo.data(), normal.data());
+
+				std::vector<float> denoised(rgb.size());
+				denoiser->Apply(encode.width, encode.height, rgb.data(), variance.data(), albedo.data(), normal.data(), denoised.data());
+				rgb.swap(denoised);
+			}
+
+			encode.written = WriteImage(encode.path.c_str(), encode.width, encode.height, rgb.data());
+			for (auto& plane : encode.planes)
+				plane.clear();
+
+			lock.lock();
+			busy = false;
+			finished.push_back(std::move(encode));
+			idle.notify_all();
+		}
+	}
+
+	std::vector<Slot> slots;
+	std::deque<int> inFlight;
+	int next;
+	const ImageDenoiser* denoiser;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable space;
+	std::condition_variable idle;
+	bool running;
+	bool busy;
+	std::deque<Encode> queue;
+	std::deque<Encode> finished;
+};
+
+// Reuses earlier frames while the camera moves. Resolve() takes the radiance
+// and first hits of a path traced frame, reprojects each first hit into the
+// previous camera, drops the history where that camera saw
+// another surface and blends the new frame in exponentially, never weighting
+// it below 1 / maxHistory so stale history fades out.
+class TemporalAccumulator
+{
+public:
+	TemporalAccumulator()
+		: current(0)
+		, hasHistory(false)
+	{
+	}
+
+	~TemporalAccumulator()
+	{
+	}
+
+	bool Create(unsigned int width_, unsigned int height_)
+	{
+		const unsigned int formats[] = { GL_RGBA32F, GL_RGBA32F };
+		if (!history[0].Create(width_, height_, formats, 2) || !history[1].Create(width_, height_, formats, 2))
+			return false;
+
+		Reset();
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		history[0].Destroy();
+		history[1].Destroy();
+	}
+
+	// the next frame starts over
+	void Reset()
+	{
+		hasHistory = false;
+	}
+
+	// camera_ is what the frame was traced with, program_ a TemporalPS program
+	void Resolve(ShaderProgram& program_, VertexArrayObject& quad_, Texture2D& frameColor_, Texture2D& frameHit_, const Camera& camera_, int maxHistory_, float hitTolerance_)
+	{
+		FrameBufferObject& target = history[current];
+		FrameBufferObject& previous = history[1 - current];
+
+		target.Bind();
+		program_.Bind();
+		program_.SetUniform1i("frameColor", 0);
+		program_.SetUniform1i("frameHit", 1);
+		program_.SetUniform1i("historyColor", 2);
+		program_.SetUniform1i("historyHit", 3);
+		program_.SetUniform1i("hasHistory", hasHistory ? 1 : 0);
+		program_.SetUniform3f("previousOrigin", previousCamera.origin.x, previousCamera.origin.y, previousCamera.origin.z);
+		program_.SetUniform3f("previousLowerLeft", previousCamera.lower_left_corner.x, previousCamera.lower_left_corner.y, previousCamera.lower_left_corner.z);
+		program_.SetUniform3f("previousHorizontal", previousCamera.horizontal.x, previousCamera.horizontal.y, previousCamera.horizontal.z);
+		program_.SetUniform3f("previousVertical", previousCamera.vertical.x, previousCamera.vertical.y, previousCamera.vertical.z);
+		program_.SetUniform1f("maxHistory", (float)maxHistory_);
+		program_.SetUniform1f("hitTolerance", hitTolerance_);
+
+		frameColor_.Bind(0);
+		frameHit_.Bind(1);
+		previous.GetColorMap(0).Bind(2);
+		previous.GetColorMap(1).Bind(3);
+
+		quad_.Bind();
+		quad_.Draw(GL_TRIANGLES, 6);
+		target.Unbind();
+
+		previousCamera = camera_;
+		hasHistory = true;
+		current = 1 - current;
+	}
+
+	// blended radiance, alpha counts the frames in it
+	Texture2D& GetOutput()
+	{
+		return history[1 - current].GetColorMap(0);
+	}
+private:
+	FrameBufferObject history[2];
+	int current;
+	bool hasHistory;
+	Camera previousCamera;
+};
+
+// SVGF style spatial denoiser for low sample previews. The variance pass
+// divides the albedo out of the radiance and estimates the variance of what is
+// left, then each a-trous iteration doubles the filter's reach while normal,
+// depth and variance scaled luminance differences keep it off edges. The
+// result is still lighting only, the tonemap pass multiplies the albedo back.
+class Denoiser
+{
+public:
+	Denoiser()
+		: output(0)
+	{
+	}
+
+	~Denoiser()
+	{
+	}
+
+	bool Create(unsigned int width_, unsigned int height_)
+	{
+		return targets[0].Create(width_, height_, GL_RGBA32F) && targets[1].Create(width_, height_, GL_RGBA32F);
+	}
+
+	void Destroy()
+	{
+		targets[0].Destroy();
+		targets[1].Destroy();
+	}
+
+	// variance_ and atrous_ are DenoiseVariancePS and DenoiseATrousPS programs
+	void Apply(ShaderProgram& variance_, ShaderProgram& atrous_, VertexArrayObject& quad_, Texture2D& color_, Texture2D& albedo_, Texture2D& normalDepth_, int iterations_)
+	{
+		quad_.Bind();
+
+		targets[0].Bind();
+		variance_.Bind();
+		variance_.SetUniform1i("colorMap", 0);
+		variance_.SetUniform1i("albedoMap", 1);
+		variance_.SetUniform1i("normalDepthMap", 2);
+		color_.Bind(0);
+		albedo_.Bind(1);
+		normalDepth_.Bind(2);
+		quad_.Draw(GL_TRIANGLES, 6);
+
+		atrous_.Bind();
+		atrous_.SetUniform1i("illuminationMap", 0);
+		atrous_.SetUniform1i("normalDepthMap", 1);
+		atrous_.SetUniform1f("sigmaLuminance", 4.0f);
+		atrous_.SetUniform1f("sigmaNormal", 128.0f);
+		atrous_.SetUniform1f("sigmaDepth", 0.01f);
+		normalDepth_.Bind(1);
+
+		output = 0;
+		for (int i = 0; i < iterations_; i++)
+		{
+			targets[1 - output].Bind();
+			atrous_.SetUniform1i("stepSize", 1 << i);
+			targets[output].GetColorMap().Bind(0);
+			quad_.Draw(GL_TRIANGLES, 6);
+
+			output = 1 - output;
+		}
+		targets[output].Unbind();
+	}
+
+	// lighting with the albedo divided out, a = its variance
+	Texture2D& GetOutput()
+	{
+		return targets[output].GetColorMap();
+	}
+private:
+	FrameBufferObject targets[2];
+	int output;
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+// Distributed rendering. A coordinator splits the frame into tiles, and each
+// tile's samples into sample ranges, and hands them to workers over TCP:
+//   worker -> coordinator: hello backend=gpu|cpu once connected
+//   coordinator -> worker: tile id=I x=X y=Y w=W h=H width=FW height=FH first=S spp=N depth=D camera=...
+//   worker -> coordinator: result id=I samples=N bytes=B and the tile as float RGB, top row first
+//   coordinator -> worker: bye when the frame is complete
+// Sample range [first, first + spp) uses frame indices first.. like the passes of
+// a single machine render, so results merge by sample-weighted averaging.
+struct RenderTileRequest
+{
+	int id = 0;
+	int x = 0;
+	int y = 0;			// from the top
+	int w = 0;
+	int h = 0;
+	int width = 0;		// whole frame
+	int height = 0;
+	unsigned int first = 0;
+	int samples = 0;
+	int depth = 0;
+	float camera[9] = {};
+
+	std::string Format() const
+	{
+		std::ostringstream line;
+		line << "tile id=" << id << " x=" << x << " y=" << y << " w=" << w << " h=" << h
+			<< " width=" << width << " height=" << height << " first=" << first << " spp=" << samples << " depth=" << depth << " camera=";
+		for (int i = 0; i < 9; i++)
+			line << (i ? "," : "") << camera[i];
+
+		return line.str();
+	}
+
+	bool Parse(const LineArguments& args_)
+	{
+		id = args_.GetInt("id", 0);
+		x = args_.GetInt("x", -1);
+		y = args_.GetInt("y", -1);
+		w = args_.GetInt("w", 0);
+		h = args_.GetInt("h", 0);
+		width = args_.GetInt("width", 0);
+		height = args_.GetInt("height", 0);
+		first = (unsigned int)args_.GetInt("first", 0);
+		samples = args_.GetInt("spp", 0);
+		depth = args_.GetInt("depth", 0);
+
+		return args_.GetFloats("camera", camera, 9) && x >= 0 && y >= 0 && w > 0 && h > 0 &&
+			x + w <= width && y + h <= height && samples > 0 && depth > 0;
+	}
+};
+
+// Hands out work units to whichever workers are connected, merges their
+// results and puts the unit of a worker that disconnects or stays silent
+// past the timeout back at the front of the queue. Workers may join at any time.
+class RenderCoordinator
+{
+public:
+	RenderCoordinator()
+		: width(0)
+		, height(0)
+		, timeout(0)
+		, completed(0)
+	{
+	}
+
+	~RenderCoordinator()
+	{
+	}
+
+	bool Create(int port_, int width_, int height_, int tileSize_, int samples_, int sampleSplit_, int depth_, const float* camera_, int timeoutSeconds_)
+	{
+		if (!Socket::Startup() || !listener.ListenTCP(port_))
+		{
+			std::cout << "RenderCoordinator: failed to listen on port " << port_ << std::endl;
+			return false;
+		}
+
+		width = width_;
+		height = height_;
+		timeout = timeoutSeconds_;
+
+		// workers send means only, so there are no moments to merge
+		std::string variant = "depth=" + std::to_string(depth_);
+		partial.Create(width, height, false, MakeRenderKey(width, height, camera_, variant));
+
+		sampleSplit_ = std::max(1, std::min(sampleSplit_, samples_));
+		for (int split = 0; split < sampleSplit_; split++)
+		{
+			unsigned int first = samples_ * split / sampleSplit_;
+			partial.AddRange(first, samples_ * (split + 1) / sampleSplit_ - first);
+		}
+
+		for (int y = 0; y < height; y += tileSize_)
+		{
+			for (int x = 0; x < width; x += tileSize_)
+			{
+				for (int split = 0; split < sampleSplit_; split++)
+				{
+					RenderTileRequest request;
+					request.id = (int)units.size();
+					request.x = x;
+					request.y = y;
+					request.w = std::min(tileSize_, width - x);
+					request.h = std::min(tileSize_, height - y);
+					request.width = width;
+					request.height = height;
+					request.first = (unsigned int)(samples_ * split / sampleSplit_);
+					request.samples = samples_ * (split + 1) / sampleSplit_ - (int)request.first;
+					request.depth = depth_;
+					memcpy(request.camera, camera_, sizeof(request.camera));
+
+					queue.push_back((int)units.size());
+					units.push_back(Unit());
+					units.back().request = request;
+				}
+			}
+		}
+
+		std::cout << "RenderCoordinator: " << units.size() << " work units, waiting for workers on port " << port_ << std::endl;
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		for (auto& worker : workers)
+		{
+			worker->socket.SendLine("bye");
+			worker->socket.Close();
+		}
+		workers.clear();
+
+		listener.Close();
+	}
+
+	// returns once every unit has been merged
+	void Run()
+	{
+		while (completed < (int)units.size())
+		{
+			std::vector<Socket*> sockets;
+			sockets.push_back(&listener);
+			for (auto& worker : workers)
+				sockets.push_back(&worker->socket);
+
+			std::vector<bool> readable;
+			if (Socket::Select(sockets, 100, readable) > 0)
+			{
+				if (readable[0])
+				{
+					std::shared_ptr<Worker> worker(new Worker);
+					if (listener.Accept(worker->socket))
+					{
+						worker->socket.SetReceiveTimeout(timeout);
+						workers.push_back(worker);
+					}
+				}
+
+				for (size_t i = 1; i < readable.size(); i++)
+				{
+					std::shared_ptr<Worker> worker = workers[i - 1];
+					if (!readable[i])
+						continue;
+
+					if (!worker->socket.ReceiveAvailable())
+					{
+						Fail(*worker, "disconnected");
+						continue;
+					}
+
+					std::string line;
+					while (worker->socket.IsOpen() && worker->socket.PopLine(line))
+						HandleLine(*worker, line);
+				}
+			}
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			for (auto& worker : workers)
+			{
+				if (worker->socket.IsOpen() && worker->unit >= 0 && now - worker->dispatchTime > std::chrono::seconds(timeout))
+					Fail(*worker, "timed out");
+			}
+
+			workers.erase(std::remove_if(workers.begin(), workers.end(), [](const std::shared_ptr<Worker>& worker) { return !worker->socket.IsOpen(); }), workers.end());
+
+			for (auto& worker : workers)
+			{
+				if (worker->ready && worker->unit < 0 && !queue.empty())
+				{
+					worker->unit = queue.front();
+					queue.pop_front();
+					worker->dispatchTime = now;
+					if (!worker->socket.SendLine(units[worker->unit].request.Format()))
+						Fail(*worker, "send failed");
+				}
+			}
+		}
+	}
+
+	// the sample-weighted merge of every result
+	const PartialImage& GetPartialImage() const
+	{
+		return partial;
+	}
+private:
+	struct Unit
+	{
+		RenderTileRequest request;
+		bool done = false;
+	};
+
+	struct Worker
+	{
+		Socket socket;
+		bool ready = false;
+		std::string backend;
+		int unit = -1;
+		int completed = 0;
+		std::chrono::steady_clock::time_point dispatchTime;
+	};
+
+	void HandleLine(Worker& worker_, const std::string& line_)
+	{
+		LineArguments args(line_);
+		if (args.GetCommand() == "hello")
+		{
+			worker_.ready = true;
+			worker_.backend = args.GetString("backend", "gpu");
+			std::cout << "RenderCoordinator: " << worker_.backend << " worker joined" << std::endl;
+		}
+		else if (args.GetCommand() == "result")
+		{
+			int id = args.GetInt("id", -1);
+			if (id != worker_.unit)
+			{
+				Fail(worker_, "sent a result it was not asked for");
+				return;
+			}
+
+			const RenderTileRequest& request = units[id].request;
+			size_t bytes = size_t(request.w) * request.h * 3 * sizeof(float);
+			if (args.GetInt("bytes", 0) != (int)bytes || args.GetInt("samples", 0) != request.samples)
+			{
+				Fail(worker_, "sent a malformed result");
+				return;
+			}
+
+			std::vector<float> rgb(size_t(request.w) * request.h * 3);
+			if (!worker_.socket.Receive(rgb.data(), bytes))
+			{
+				Fail(worker_, "disconnected during a result");
+				return;
+			}
+
+			partial.AddRegion(request.x, request.y, request.w, request.h, rgb.data(), nullptr, request.samples);
+			units[id].done = true;
+			worker_.unit = -1;
+			worker_.completed++;
+			completed++;
+
+			if (completed % 64 == 0 || completed == (int)units.size())
+				std::cout << "RenderCoordinator: " << completed << "/" << units.size() << " units" << std::endl;
+		}
+	}
+
+	void Fail(Worker& worker_, const char* reason_)
+	{
+		std::cout << "RenderCoordinator: " << worker_.backend << " worker " << reason_;
+		if (worker_.unit >= 0 && !units[worker_.unit].done)
+		{
+			queue.push_front(worker_.unit);
+			std::cout << ", unit " << worker_.unit << " requeued";
+		}
+		std::cout << std::endl;
+
+		worker_.unit = -1;
+		worker_.socket.Close();
+	}
+private:
+	Socket listener;
+	int width;
+	int height;
+	int timeout;
+
+	std::vector<Unit> units;
+	std::deque<int> queue;
+	int completed;
+	std::vector<std::shared_ptr<Worker>> workers;
+
+	PartialImage partial;
+};
+
+// Keyframed camera and sphere motion for batch renders, read from a text file:
+//   camera FRAME px py pz tx ty tz ux uy uz
+//   sphere FRAME INDEX dx dy dz scale
+// with '#' starting a comment. Sphere keys translate and scale a sphere of
+// WorldConstructor(). Each track is a Catmull-Rom spline through its keys and
+// holds still outside them, so a few keys give a smooth fly-through and a ring
+// of them a turntable.
+class Animation
+{
+public:
+	enum
+	{
+		MAX_SPHERES = 10
+	};
+
+	Animation()
+	{
+	}
+
+	~Animation()
+	{
+	}
+
+	bool Load(const char* path_)
+	{
+		std::ifstream file(path_);
+		if (!file)
+		{
+			std::cout << "Animation: failed to open " << path_ << std::endl;
+			return false;
+		}
+
+		camera.clear();
+		for (int i = 0; i < MAX_SPHERES; i++)
+			spheres[i].clear();
+
+		std::string line;
+		for (int lineNumber = 1; std::getline(file, line); lineNumber++)
+		{
+			line = line.substr(0, line.find('#'));
+			std::istringstream stream(line);
+			std::string type;
+			if (!(stream >> type))
+				continue;
+
+			Key key;
+			int sphere = 0;
+			bool valid;
+			if (type == "camera")
+			{
+				valid = bool(stream >> key.frame);
+				for (int i = 0; i < 9; i++)
+					valid = valid && stream >> key.values[i];
+				if (valid)
+					camera.push_back(key);
+			}
+			else if (type == "sphere")
+			{
+				valid = stream >> key.frame >> sphere && sphere >= 0 && sphere < MAX_SPHERES;
+				for (int i = 0; i < 4; i++)
+					valid = valid && stream >> key.values[i];
+				if (valid)
+					spheres[sphere].push_back(key);
+			}
+			else
+			{
+				valid = false;
+			}
+
+			if (!valid)
+			{
+				std::cout << "Animation: " << path_ << "(" << lineNumber << "): bad key " << line << std::endl;
+				return false;
+			}
+		}
+
+		if (camera.empty())
+		{
+			std::cout << "Animation: " << path_ << " has no camera keys" << std::endl;
+			return false;
+		}
+
+		auto earlier = [](const Key& a, const Key& b) { return a.frame < b.frame; };
+		std::stable_sort(camera.begin(), camera.end(), earlier);
+		for (int i = 0; i < MAX_SPHERES; i++)
+			std::stable_sort(spheres[i].begin(), spheres[i].end(), earlier);
+
+		return true;
+	}
+
+	// camera_ gets position, target and up, transforms_ the translation and
+	// scale of each sphere, identity for spheres without keys
+	void Evaluate(float frame_, float* camera_, float (*transforms_)[4]) const
+	{
+		Sample(camera, 9, frame_, camera_);
+		for (int i = 0; i < MAX_SPHERES; i++)
+		{
+			if (spheres[i].empty())
+			{
+				transforms_[i][0] = transforms_[i][1] = transforms_[i][2] = 0.0f;
+				transforms_[i][3] = 1.0f;
+			}
+			else
+			{
+				Sample(spheres[i], 4, frame_, transforms_[i]);
+			}
+		}
+	}
+
+	// up to and including the last key
+	int GetFrameCount() const
+	{
+		float last = camera.back().frame;
+		for (int i = 0; i < MAX_SPHERES; i++)
+		{
+			if (!spheres[i].empty())
+				last = std::max(last, spheres[i].back().frame);
+		}
+
+		return std::max(1, (int)floor(last) + 1);
+	}
+private:
+	struct Key
+	{
+		float frame = 0.0f;
+		float values[9] = {};
+	};
+
+	static void Sample(const std::vector<Key>& keys_, int count_, float frame_, float* values_)
+	{
+		size_t last = keys_.size() - 1;
+		size_t i = 0;
+		while (i < last && keys_[i + 1].frame <= frame_)
+			i++;
+
+		const Key& k1 = keys_[i];
+		const Key& k2 = keys_[std::min(i + 1, last)];
+		const Key& k0 = keys_[i > 0 ? i - 1 : 0];
+		const Key& k3 = keys_[std::min(i + 2, last)];
+
+		float span = k2.frame - k1.frame;
+		float t = span > 0.0f ? std::min(std::max((frame_ - k1.frame) / span, 0.0f), 1.0f) : 0.0f;
+		float t2 = t * t;
+		float t3 = t2 * t;
+		for (int c = 0; c < count_; c++)
+		{
+			float p0 = k0.values[c], p1 = k1.values[c], p2 = k2.values[c], p3 = k3.values[c];
+			values_[c] = 0.5f * (2.0f * p1 + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 + (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+		}
+	}
+
+	std::vector<Key> camera;
+	std::vector<Key> spheres[MAX_SPHERES];
+};
+
+struct Options
+{
+	bool useCPU = false;
+	unsigned int cpuThreads = 0;
+	int cpuSamples = 8;
+	int gpuSamples = 100;
+	int maxDepth = 50;
+	bool pinThreads = true;
+	bool replicateScene = false;
+	size_t arenaSize = 256 * 1024;
+	bool hotReload = true;
+	std::string serverSocket;
+	int coordinatorPort = 0;
+	std::string workerAddress;
+	std::string output = "render.png";
+	int renderWidth = SCR_WIDTH;
+	int renderHeight = SCR_HEIGHT;
+	int tileSize = 64;
+	int sampleSplit = 1;
+	int workerTimeout = 120;
+	bool render = false;
+	unsigned int firstSample = 0;
+	std::string checkpointPath;
+	int checkpointInterval = 600;
+	bool resume = false;
+	std::string animationPath;
+	int frameCount = 0;
+	bool temporal = false;
+	int temporalHistory = 64;
+	bool denoise = false;			// filters the preview on the GPU, or the written images of headless modes on the CPU
+	int denoiseIterations = 5;
+	float exposure = 1.0f;
+	bool tonemap = false;			// --exposure was given, the window shows exposed, ACES mapped, gamma corrected colors
+	std::string mergeOutput;
+	std::vector<std::string> mergeInputs;
+	std::string textureCache = "texcache";
+	HDRImageBuilder::HDRFormat hdrFormat = HDRImageBuilder::HDR_AUTO;	// GPU storage of HDR images, auto picks per image
+	SamplerTables::Type sampler = SamplerTables::SOBOL;
+	int virtualTexture = 0;			// physical cache tiles per side when the environment map is streamed, 0 loads it whole
+	bool previewLighting = false;	// the window shows paths ended early with precomputed environment lighting
+	bool selfTest = false;			// runs the numeric checks of the CPU sampling code and exits
+};
+
+Options options;
+
+// modes that render without showing a window
+bool isHeadless()
+{
+	return !options.serverSocket.empty() || !options.workerAddress.empty() || options.render || !options.animationPath.empty();
+}
+
+bool parseOptions(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--cpu")
+		{
+			options.useCPU = true;
+		}
+		else if (arg == "--threads" && i + 1 < argc)
+		{
+			options.cpuThreads = atoi(argv[++i]);
+		}
+		else if (arg == "--spp" && i + 1 < argc)
+		{
+			options.cpuSamples = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--gpu-spp" && i + 1 < argc)
+		{
+			options.gpuSamples = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--depth" && i + 1 < argc)
+		{
+			options.maxDepth = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--no-pin")
+		{
+			options.pinThreads = false;
+		}
+		else if (arg == "--numa-replicate")
+		{
+			options.replicateScene = true;
+		}
+		else if (arg == "--arena-kb" && i + 1 < argc)
+		{
+			options.arenaSize = size_t(std::max(1, atoi(argv[++i]))) * 1024;
+		}
+		else if (arg == "--server" && i + 1 < argc)
+		{
+			options.serverSocket = argv[++i];
+		}
+		else if (arg == "--coordinator" && i + 1 < argc)
+		{
+			options.coordinatorPort = atoi(argv[++i]);
+		}
+		else if (arg == "--worker" && i + 1 < argc)
+		{
+			options.workerAddress = argv[++i];
+		}
+		else if (arg == "--output" && i + 1 < argc)
+		{
+			options.output = argv[++i];
+		}
+		else if (arg == "--size" && i + 2 < argc)
+		{
+			options.renderWidth = std::max(1, atoi(argv[++i]));
+			options.renderHeight = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--tile" && i + 1 < argc)
+		{
+			options.tileSize = std::max(8, atoi(argv[++i]));
+		}
+		else if (arg == "--sample-split" && i + 1 < argc)
+		{
+			options.sampleSplit = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--worker-timeout" && i + 1 < argc)
+		{
+			options.workerTimeout = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--render")
+		{
+			options.render = true;
+		}
+		else if (arg == "--first" && i + 1 < argc)
+		{
+			options.firstSample = (unsigned int)std::max(0, atoi(argv[++i]));
+		}
+		else if (arg == "--checkpoint" && i + 1 < argc)
+		{
+			options.checkpointPath = argv[++i];
+		}
+		else if (arg == "--checkpoint-interval" && i + 1 < argc)
+		{
+			options.checkpointInterval = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--resume")
+		{
+			options.resume = true;
+		}
+		else if (arg == "--animate" && i + 1 < argc)
+		{
+			options.animationPath = argv[++i];
+		}
+		else if (arg == "--frames" && i + 1 < argc)
+		{
+			options.frameCount = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--temporal")
+		{
+			options.temporal = true;
+		}
+		else if (arg == "--temporal-history" && i + 1 < argc)
+		{
+			options.temporalHistory = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--denoise")
+		{
+			options.denoise = true;
+		}
+		else if (arg == "--denoise-iterations" && i + 1 < argc)
+		{
+			options.denoiseIterations = std::min(std::max(1, atoi(argv[++i])), 10);
+		}
+		else if (arg == "--exposure" && i + 1 < argc)
+		{
+			options.exposure = (float)atof(argv[++i]);
+			options.tonemap = true;
+		}
+		else if (arg == "--merge" && i + 2 < argc)
+		{
+			options.mergeOutput = argv[++i];
+			while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+				options.mergeInputs.push_back(argv[++i]);
+		}
+		else if (arg == "--camera" && i + 1 < argc)
+		{
+			float camera[9];
+			if (!LineArguments(std::string("camera camera=") + argv[++i]).GetFloats("camera", camera, 9))
+			{
+				std::cout << "--camera takes px,py,pz,tx,ty,tz,ux,uy,uz" << std::endl;
+				return false;
+			}
+
+			memcpy(cameraPos, &camera[0], sizeof(cameraPos));
+			memcpy(cameraTarget, &camera[3], sizeof(cameraTarget));
+			memcpy(cameraUp, &camera[6], sizeof(cameraUp));
+		}
+		else if (arg == "--no-hot-reload")
+		{
+			options.hotReload = false;
+		}
+		else if (arg == "--texture-cache" && i + 1 < argc)
+		{
+			options.textureCache = argv[++i];
+		}
+		else if (arg == "--no-texture-cache")
+		{
+			options.textureCache.clear();
+		}
+		else if (arg == "--hdr-format" && i + 1 < argc)
+		{
+			std::string format = argv[++i];
+			if (format == "auto")
+				options.hdrFormat = HDRImageBuilder::HDR_AUTO;
+			else if (format == "rgb9e5")
+				options.hdrFormat = HDRImageBuilder::HDR_RGB9E5;
+			else if (format == "r11g11b10f")
+				options.hdrFormat = HDRImageBuilder::HDR_R11G11B10F;
+			else if (format == "rgb16f")
+				options.hdrFormat = HDRImageBuilder::HDR_RGB16F;
+			else
+			{
+				std::cout << "--hdr-format takes auto, rgb9e5, r11g11b10f or rgb16f" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--virtual-texture" && i + 1 < argc)
+		{
+			options.virtualTexture = std::max(2, atoi(argv[++i]));
+		}
+		else if (arg == "--preview-lighting")
+		{
+			options.previewLighting = true;
+		}
+		else if (arg == "--self-test")
+		{
+			options.selfTest = true;
+		}
+		else if (arg == "--sampler" && i + 1 < argc)
+		{
+			std::string sampler = argv[++i];
+			if (sampler == "random")
+				options.sampler = SamplerTables::RANDOM;
+			else if (sampler == "sobol")
+				options.sampler = SamplerTables::SOBOL;
+			else if (sampler == "bluenoise")
+				options.sampler = SamplerTables::BLUE_NOISE;
+			else
+			{
+				std::cout << "--sampler takes random, sobol or bluenoise" << std::endl;
+				return false;
+			}
+		}
+		else
+		{
+			std::cout << "usage: " << argv[0] << "\n"
+				"  [--cpu] [--threads N] [--spp N] [--no-pin] [--numa-replicate] [--arena-kb N]\n"
+				"  [--gpu-spp N] [--depth N] [--sampler random|sobol|bluenoise] [--camera px,py,pz,tx,ty,tz,ux,uy,uz] [--temporal [--temporal-history N]]\n"
+				"  [--denoise [--denoise-iterations N]] [--exposure E]\n"
+				"  [--texture-cache DIR | --no-texture-cache] [--hdr-format auto|rgb9e5|r11g11b10f|rgb16f] [--virtual-texture N] [--preview-lighting] [--no-hot-reload]\n"
+				"  [--server SOCKET] [--coordinator PORT | --worker HOST:PORT]\n"
+				"  [--output PATH] [--size W H] [--tile N] [--sample-split N] [--worker-timeout S]\n"
+				"  [--render [--first N] [--checkpoint PATH [--checkpoint-interval S] [--resume]]]\n"
+				"  [--animate PATH [--frames N]] [--merge OUT IN...] [--self-test]" << std::endl;
+			return false;
+		}
+	}
+
+	if (options.useCPU && !options.serverSocket.empty())
+	{
+		std::cout << "--server renders on the GPU, it cannot be combined with --cpu" << std::endl;
+		return false;
+	}
+
+	if (!options.checkpointPath.empty() && (!options.render || options.useCPU))
+	{
+		std::cout << "--checkpoint saves the accumulation buffer of a GPU --render" << std::endl;
+		return false;
+	}
+
+	if ((options.temporal || (options.denoise && !isHeadless())) && options.useCPU)
+	{
+		std::cout << "--temporal and the interactive --denoise filter GPU frames, they cannot be combined with --cpu" << std::endl;
+		return false;
+	}
+
+	if (options.virtualTexture && (options.useCPU || options.textureCache.empty()))
+	{
+		std::cout << "--virtual-texture streams into GPU textures and keeps its tiles in the texture cache, it needs a --texture-cache and no --cpu" << std::endl;
+		return false;
+	}
+
+	if (options.previewLighting && options.useCPU)
+	{
+		std::cout << "--preview-lighting previews on the GPU, it cannot be combined with --cpu" << std::endl;
+		return false;
+	}
+
+	if (options.resume && options.checkpointPath.empty())
+	{
+		std::cout << "--resume needs --checkpoint PATH" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+ShaderCompileQueue shaderCompileQueue;
+ShaderProgramCache shaderPrograms;
+ShaderProgram* pathTraceProgram = nullptr;
+// the interactive frame goes through these when --temporal or --denoise is on
+FrameBufferObject previewTarget;
+unsigned int previewFrameIndex = 0;
+ShaderProgram* previewDisplayProgram = nullptr;
+ShaderProgram* temporalProgram = nullptr;
+TemporalAccumulator temporal;
+ShaderProgram* denoiseVarianceProgram = nullptr;
+ShaderProgram* denoiseATrousProgram = nullptr;
+ShaderProgram* tonemapProgram = nullptr;
+Denoiser denoiser;
+ShaderReloader shaderReloader;
+TextureArray materialTextures;
+TextureLayers materialLayers;
+Texture2D envMap;
+TextureBuffer materialTable;
+// the streamed environment map and its feedback pass, with --virtual-texture
+VirtualTexture virtualEnvMap;
+ShaderProgram* vtFeedbackProgram = nullptr;
+FrameBufferObject vtFeedbackTarget;
+PixelReadback vtFeedbackReadback;
+unsigned int vtFeedbackFrameIndex = 0;
+// the early ending preview program and its lighting, with --preview-lighting
+LightingCache lightingCache;
+ShaderProgram* lightingPreviewProgram = nullptr;
+ShaderProgram* lastInteractiveProgram = nullptr;
+VertexArrayObject vertexArrayObject;
+
+ThreadPool threadPool;
+ImageDenoiser imageDenoiser;
+TextureCache textureCache;
+TextureLoader textureLoader;
+
+ShaderProgram displayProgram;
+Texture2D cpuFrameTexture;
+EnvironmentMap cpuEnvMap;
+Scene cpuScene;
+TileScheduler tileScheduler;
+TiledFrameBuffer cpuFrameBuffers[TileScheduler::MAX_FRAMES_IN_FLIGHT];
+int cpuFrameIndices[TileScheduler::MAX_FRAMES_IN_FLIGHT];
+std::vector<float> cpuResolveBuffer;
+int cpuFrameCount = 0;
+
+// the display transform of the programs that draw to the window, see Tonemap.glsl
+ShaderDefines getDisplayDefines()
+{
+	ShaderDefines defines;
+	if (options.tonemap)
+		defines.Set("TONEMAP");
+
+	return defines;
+}
+
+bool createCPUScene()
+{
+	if (!shaderCompileQueue.Submit(&displayProgram, "PathTraceVS.glsl", "DisplayPS.glsl", getDisplayDefines()))
+	{
+		return false;
+	}
+
+	if (!cpuEnvMap.Create("../assets/envmap6.jpg"))
+	{
+		return false;
+	}
+
+	// the tiles read the material layers without locks, so they must be final
+	while (textureLoader.GetPendingCount() > 0)
+	{
+		textureLoader.Update(~size_t(0));
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	InitScene(cpuScene, &cpuEnvMap, &materialLayers);
+
+	cpuResolveBuffer.resize(SCR_WIDTH * SCR_HEIGHT * 3);
+	if (!cpuFrameTexture.Create(SCR_WIDTH, SCR_HEIGHT, 3, true, cpuResolveBuffer.data()))
+	{
+		return false;
+	}
+
+	if (!tileScheduler.Create(&cpuScene, SCR_WIDTH, SCR_HEIGHT, options.cpuThreads, options.pinThreads, options.replicateScene, options.arenaSize))
+	{
+		return false;
+	}
+
+	for (int i = 0; i < TileScheduler::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		if (!tileScheduler.CreateFrameBuffer(cpuFrameBuffers[i]))
+		{
+			return false;
+		}
+	}
+
+	if (!shaderCompileQueue.Wait(&displayProgram))
+	{
+		return false;
+	}
+
+	shaderReloader.Add(&displayProgram);
+
+	return true;
+}
+
+// specializes the path tracer for the material types the scene uses
+void getPathTraceDefines(ShaderDefines& defines)
+{
+	World world = WorldConstructor();
+	std::vector<PackedMaterial> materials = MaterialsConstructor();
+	for (int i = 0; i < world.objectCount; i++)
+	{
+		int type = MaterialUnpack(materials[world.objects[i].material]).type;
+		if (type == MAT_LAMBERTIAN)
+			defines.Set("HAS_MAT_LAMBERTIAN");
+		else if (type == MAT_METALLIC)
+			defines.Set("HAS_MAT_METALLIC");
+		else if (type == MAT_DIELECTRIC)
+			defines.Set("HAS_MAT_DIELECTRIC");
+	}
+
+	defines.Set("NUM_SAMPLES", options.gpuSamples);
+	defines.Set("MAX_DEPTH", options.maxDepth);
+
+	if (options.virtualTexture)
+		defines.Set("VIRTUAL_ENVMAP");
+
+	if (options.sampler == SamplerTables::SOBOL)
+		defines.Set("SAMPLER_SOBOL");
+	else if (options.sampler == SamplerTables::BLUE_NOISE)
+		defines.Set("SAMPLER_BLUE_NOISE");
+}
+
+bool createScene()
+{
+	float vertices[] = {
+		 1.0f,  1.0f, 0.0f,  // top right
+		 1.0f, -1.0f, 0.0f,  // bottom right
+		-1.0f, -1.0f, 0.0f,  // bottom left
+		-1.0f,  1.0f, 0.0f   // top left 
+	};
+	unsigned int indices[] = {  // note that we start from 0!
+		0, 1, 3,   // first triangle
+		1, 2, 3    // second triangle
+	};
+
+	if (!vertexArrayObject.Create(vertices, sizeof(vertices) / sizeof(vertices[0]), indices, sizeof(indices) / sizeof(indices[0])))
+	{
+		return false;
+	}
+
+	shaderCompileQueue.Create();
+
+	// submitted first so the driver compiles while the textures decode
+	ShaderDefines defines;
+	getPathTraceDefines(defines);
+	if (options.denoise)
+		defines.Set("OUTPUT_GBUFFER");
+	if (options.temporal)
+		defines.Set("OUTPUT_FIRST_HIT");
+	if (options.tonemap && !options.temporal && !options.denoise)
+		defines.Set("TONEMAP");
+
+	pathTraceProgram = shaderPrograms.Get("PathTraceVS.glsl", "PathTracePS.glsl", defines, &shaderCompileQueue);
+	if (!pathTraceProgram)
+	{
+		return false;
+	}
+
+	// a few samples of short paths, the rest of the light comes from the cache
+	if (options.previewLighting)
+	{
+		ShaderDefines previewDefines = defines;
+		previewDefines.Set("PREVIEW_LIGHTING");
+		previewDefines.Set("NUM_SAMPLES", std::min(options.gpuSamples, 4));
+		previewDefines.Set("MAX_DEPTH", std::min(options.maxDepth, 8));
+		lightingPreviewProgram = shaderPrograms.Get("PathTraceVS.glsl", "PathTracePS.glsl", previewDefines, &shaderCompileQueue);
+		if (!lightingPreviewProgram)
+		{
+			return false;
+		}
+	}
+
+	if (options.virtualTexture)
+	{
+		ShaderDefines feedbackDefines;
+		getPathTraceDefines(feedbackDefines);
+		feedbackDefines.Set("NUM_SAMPLES", 1);
+		feedbackDefines.Set("OUTPUT_VT_FEEDBACK");
+		vtFeedbackProgram = shaderPrograms.Get("PathTraceVS.glsl", "PathTracePS.glsl", feedbackDefines, &shaderCompileQueue);
+		if (!vtFeedbackProgram)
+		{
+			return false;
+		}
+	}
+
+	// while the path tracer compiles
+	samplerTables.Create(options.sampler);
+	if (!samplerTables.CreateTextures())
+	{
+		return false;
+	}
+
+	std::vector<PackedMaterial> materials = MaterialsConstructor();
+	if (!materialTable.Create(GL_RGBA32UI, materials.data(), (unsigned int)(materials.size() * sizeof(PackedMaterial))))
+	{
+		return false;
+	}
+
+	// radiance, first hits, then the denoiser's albedo and normal/depth guides
+	if (options.temporal || (options.denoise && !isHeadless()))
+	{
+		const unsigned int formats[] = { GL_RGBA32F, GL_RGBA32F, GL_RGBA16F, GL_RGBA32F };
+		previewDisplayProgram = shaderPrograms.Get("PathTraceVS.glsl", "DisplayPS.glsl", getDisplayDefines(), &shaderCompileQueue);
+		if (!previewDisplayProgram || !previewTarget.Create(SCR_WIDTH, SCR_HEIGHT, formats, options.denoise ? 4 : 2))
+		{
+			return false;
+		}
+	}
+
+	if (options.temporal)
+	{
+		temporalProgram = shaderPrograms.Get("PathTraceVS.glsl", "TemporalPS.glsl", ShaderDefines(), &shaderCompileQueue);
+		if (!temporalProgram || !temporal.Create(SCR_WIDTH, SCR_HEIGHT))
+		{
+			return false;
+		}
+	}
+
+	if (options.denoise && !isHeadless())
+	{
+		denoiseVarianceProgram = shaderPrograms.Get("PathTraceVS.glsl", "DenoiseVariancePS.glsl", ShaderDefines(), &shaderCompileQueue);
+		denoiseATrousProgram = shaderPrograms.Get("PathTraceVS.glsl", "DenoiseATrousPS.glsl", ShaderDefines(), &shaderCompileQueue);
+		tonemapProgram = shaderPrograms.Get("PathTraceVS.glsl", "TonemapPS.glsl", getDisplayDefines(), &shaderCompileQueue);
+		if (!denoiseVarianceProgram || !denoiseATrousProgram || !tonemapProgram || !denoiser.Create(SCR_WIDTH, SCR_HEIGHT))
+		{
+			return false;
+		}
+	}
+
+	if (!threadPool.Create(0))
+	{
+		return false;
+	}
+	imageDenoiser.Create(threadPool);
+
+	TextureCache* cache = nullptr;
+	if (!options.textureCache.empty() && textureCache.Create(options.textureCache.c_str(), options.hdrFormat))
+	{
+		cache = &textureCache;
+	}
+
+	if (!textureLoader.Create(&threadPool, 64 * 1024 * 1024, cache, options.hdrFormat))
+	{
+		return false;
+	}
+
+	// placeholders until the decodes finish, a missing file keeps its placeholder
+	std::vector<std::string> texturePaths = MaterialTexturesConstructor();
+	materialTextures.Create(512, (unsigned int)texturePaths.size());
+	materialLayers.Create(512, (int)texturePaths.size());
+	for (size_t i = 0; i < texturePaths.size(); i++)
+		textureLoader.Load(materialTextures, materialLayers, int(i), texturePaths[i].c_str());
+
+	// a streamed environment map keeps its tile file with the texture cache
+	if (options.virtualTexture)
+	{
+		if (!virtualEnvMap.Create(&threadPool, options.textureCache.c_str(), "../assets/envmap6.jpg", options.virtualTexture))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		textureLoader.Load(envMap, "../assets/envmap6.jpg", 0.5f, 0.7f, 1.0f);
+	}
+
+	// the window shows the full path tracer until the cache is uploaded
+	if (options.previewLighting)
+	{
+		lightingCache.Create(&threadPool, "../assets/envmap6.jpg");
+	}
+
+	if (options.useCPU)
+	{
+		return createCPUScene();
+	}
+
+	// the first frame only needs the path tracer, the rest finish in the background
+	if (!shaderCompileQueue.Wait(pathTraceProgram))
+	{
+		return false;
+	}
+
+	pathTraceProgram->Bind();
+
+	shaderReloader.Add(pathTraceProgram);
+
+	ShaderProgram* otherPrograms[] = { previewDisplayProgram, temporalProgram, denoiseVarianceProgram, denoiseATrousProgram, tonemapProgram, vtFeedbackProgram, lightingPreviewProgram };
+	for (ShaderProgram* program : otherPrograms)
+	{
+		if (!program)
+			continue;
+
+		if (!shaderCompileQueue.Wait(program))
+		{
+			return false;
+		}
+
+		shaderReloader.Add(program);
+	}
+
+	return true;
+}
+
+void renderSceneCPU()
+{
+	// submit this frame, then show the previous one while the workers render it
+	CPUFrame frame;
+	frame.camera = CameraSet(Vector3(cameraPos[0], cameraPos[1], cameraPos[2]),
+		Vector3(cameraTarget[0], cameraTarget[1], cameraTarget[2]),
+		Vector3(cameraUp[0], cameraUp[1], cameraUp[2]),
+		90.0f, float(SCR_WIDTH) / float(SCR_HEIGHT));
+	frame.samplesPerPixel = options.cpuSamples;
+	frame.maxDepth = options.maxDepth;
+	frame.frameBuffer = &cpuFrameBuffers[cpuFrameCount % TileScheduler::MAX_FRAMES_IN_FLIGHT];
+	frame.firstTouch = false;
+
+	cpuFrameIndices[cpuFrameCount % TileScheduler::MAX_FRAMES_IN_FLIGHT] = tileScheduler.SubmitFrame(frame);
+	if (cpuFrameCount > 0)
+	{
+		int previous = (cpuFrameCount - 1) % TileScheduler::MAX_FRAMES_IN_FLIGHT;
+		tileScheduler.WaitFrame(cpuFrameIndices[previous]);
+		cpuFrameBuffers[previous].Resolve(cpuResolveBuffer.data());
+		cpuFrameTexture.Update(SCR_WIDTH, SCR_HEIGHT, cpuResolveBuffer.data());
+	}
+	cpuFrameCount++;
+
+	displayProgram.Bind();
+	displayProgram.SetUniform1i("colorMap", 0);
+	displayProgram.SetUniform1f("exposure", options.exposure);
+
+	vertexArrayObject.Bind();
+
+	cpuFrameTexture.Bind(0);
+
+	vertexArrayObject.Draw(GL_TRIANGLES, 6);
+}
+
+void destroyCPUScene()
+{
+	TileScheduler::Stats stats = tileScheduler.GetStats();
+	std::cout << "CPU: " << tileScheduler.GetWorkerCount() << " workers, " << stats.tilesRendered << " tiles, "
+		<< stats.tilesStolen << " stolen, " << stats.sharesClaimed << " shares, "
+		<< stats.idleMicroseconds / 1000 << " ms idle" << std::endl;
+	std::cout << "NUMA: " << stats.nodeCount << " nodes, " << stats.sceneReplicas << " scene replicas, remote access ratio "
+		<< (stats.tilesRendered ? double(stats.remoteTiles) / double(stats.tilesRendered) : 0.0) << std::endl;
+	std::cout << "Arena: peak " << stats.arenaPeakBytes / 1024 << " KB per worker, " << stats.arenaCapacityBytes / 1024
+		<< " KB reserved, " << stats.arenaOverflows << " overflows" << std::endl;
+
+	tileScheduler.Destroy();
+
+	for (int i = 0; i < TileScheduler::MAX_FRAMES_IN_FLIGHT; i++)
+		cpuFrameBuffers[i].Destroy();
+
+	cpuFrameTexture.Destroy();
+
+	cpuEnvMap.Destroy();
+
+	displayProgram.Destroy();
+}
+
+// one full screen pass into whatever framebuffer and viewport are bound
+void drawPathTrace(ShaderProgram* program, int width, int height, const float* position, const float* target, const float* up, unsigned int frameIndex)
+{
+	program->Bind();
+	program->SetUniform1i("materialTextures", 0);
+	program->SetUniform1i("envMap", 2);
+	program->SetUniform1i("sobolMatrices", 3);
+	program->SetUniform1i("blueNoise", 4);
+	program->SetUniform1i("materials", 5);
+	program->SetUniform2f("screenSize", width, height);
+	program->SetUniform1ui("frameIndex", frameIndex);
+	program->SetUniform1f("exposure", options.exposure);
+
+	program->SetUniform3f("cameraPos", position[0], position[1], position[2]);
+	program->SetUniform3f("cameraTarget", target[0], target[1], target[2]);
+	program->SetUniform3f("cameraUp", up[0], up[1], up[2]);
+	program->SetUniform4fv("sphereTransforms", Animation::MAX_SPHERES, &sphereTransforms[0][0]);
+
+	vertexArrayObject.Bind();
+
+	materialTextures.Bind(0);
+	envMap.Bind(2);
+	if (samplerTables.GetType() != SamplerTables::RANDOM)
+		samplerTables.GetSobolTexture().Bind(3);
+	if (samplerTables.GetType() == SamplerTables::BLUE_NOISE)
+		samplerTables.GetBlueNoiseTexture().Bind(4);
+	materialTable.Bind(5);
+	if (virtualEnvMap.IsCreated())
+		virtualEnvMap.Bind(*program, 6, 7, width);
+	if (lightingCache.IsReady())
+		lightingCache.Bind(*program, 8);
+
+	vertexArrayObject.Draw(GL_TRIANGLES, 6);
+}
+
+// The feedback pass is the path tracer at an eighth of the resolution writing,
+// instead of color, which environment tile each pixel's path looked up last.
+void drawVirtualTextureFeedback(int width, int height, const float* position, const float* target, const float* up, unsigned int frameIndex)
+{
+	unsigned int feedbackWidth = std::max(1, width / 8);
+	unsigned int feedbackHeight = std::max(1, height / 8);
+	if (vtFeedbackTarget.GetWidth() != feedbackWidth || vtFeedbackTarget.GetHeight() != feedbackHeight)
+	{
+		vtFeedbackTarget.Destroy();
+		vtFeedbackReadback.Destroy();
+		if (!vtFeedbackTarget.Create(feedbackWidth, feedbackHeight, GL_R32UI) || !vtFeedbackReadback.Create(size_t(feedbackWidth) * feedbackHeight * sizeof(unsigned int)))
+			return;
+	}
+
+	int viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	vtFeedbackTarget.Bind();
+	drawPathTrace(vtFeedbackProgram, feedbackWidth, feedbackHeight, position, target, up, frameIndex);
+	vtFeedbackTarget.Unbind();
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	vtFeedbackReadback.Begin(vtFeedbackTarget, 0, 0, 0, feedbackWidth, feedbackHeight, GL_RED_INTEGER, GL_UNSIGNED_INT);
+}
+
+void readVirtualTextureFeedback(std::vector<unsigned int>& ids)
+{
+	size_t offset = ids.size();
+	ids.resize(offset + size_t(vtFeedbackTarget.GetWidth()) * vtFeedbackTarget.GetHeight());
+	if (!vtFeedbackReadback.Read(&ids[offset], (ids.size() - offset) * sizeof(unsigned int)))
+		ids.resize(offset);
+}
+
+// interactive frames read the feedback a frame late and let tiles stream in
+void updateVirtualTexture(int width, int height, const float* position, const float* target, const float* up)
+{
+	if (!virtualEnvMap.IsCreated())
+		return;
+
+	if (vtFeedbackReadback.IsReady())
+	{
+		std::vector<unsigned int> ids;
+		readVirtualTextureFeedback(ids);
+		virtualEnvMap.Request(ids.data(), ids.size());
+	}
+
+	if (!vtFeedbackReadback.IsPending())
+		drawVirtualTextureFeedback(width, height, position, target, up, vtFeedbackFrameIndex++);
+
+	virtualEnvMap.Update(16);
+}
+
+// headless jobs wait for the tiles of a few fixed feedback passes before the
+// first sample, so what they trace never depends on upload timing
+void primeVirtualTexture(int width, int height, const float* position, const float* target, const float* up)
+{
+	if (!virtualEnvMap.IsCreated())
+		return;
+
+	std::vector<unsigned int> ids;
+	for (unsigned int i = 0; i < 4; i++)
+	{
+		drawVirtualTextureFeedback(width, height, position, target, up, i);
+		readVirtualTextureFeedback(ids);
+	}
+
+	virtualEnvMap.Request(ids.data(), ids.size());
+	virtualEnvMap.Wait();
+}
+
+// the lighting preview once its cache is up and P has not switched it off
+ShaderProgram* getInteractiveProgram()
+{
+	if (lightingPreviewProgram && lightingPreview && lightingCache.IsReady())
+		return lightingPreviewProgram;
+
+	return pathTraceProgram;
+}
+
+// traces a frame offscreen, blends it into the reprojected history and/or
+// denoises it, then shows the result
+void renderScenePreview()
+{
+	int viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	ShaderProgram* program = getInteractiveProgram();
+	previewTarget.Bind();
+	drawPathTrace(program, SCR_WIDTH, SCR_HEIGHT, cameraPos, cameraTarget, cameraUp, previewFrameIndex++);
+	previewTarget.Unbind();
+
+	Texture2D* color = &previewTarget.GetColorMap(0);
+	if (options.temporal)
+	{
+		// history traced with placeholder textures, or by the other program, would linger
+		if (textureLoader.GetPendingCount() > 0 || virtualEnvMap.GetPendingCount() > 0 || program != lastInteractiveProgram)
+			temporal.Reset();
+
+		Camera camera = CameraSet(Vector3(cameraPos[0], cameraPos[1], cameraPos[2]),
+			Vector3(cameraTarget[0], cameraTarget[1], cameraTarget[2]),
+			Vector3(cameraUp[0], cameraUp[1], cameraUp[2]),
+			90.0f, float(SCR_WIDTH) / float(SCR_HEIGHT));
+		temporal.Resolve(*temporalProgram, vertexArrayObject, *color, previewTarget.GetColorMap(1), camera, options.temporalHistory, 0.02f);
+		color = &temporal.GetOutput();
+	}
+	lastInteractiveProgram = program;
+
+	if (options.denoise)
+	{
+		denoiser.Apply(*denoiseVarianceProgram, *denoiseATrousProgram, vertexArrayObject, *color, previewTarget.GetColorMap(2), previewTarget.GetColorMap(3), options.denoiseIterations);
+	}
+
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	vertexArrayObject.Bind();
+
+	if (options.denoise)
+	{
+		tonemapProgram->Bind();
+		tonemapProgram->SetUniform1i("illuminationMap", 0);
+		tonemapProgram->SetUniform1i("albedoMap", 1);
+		tonemapProgram->SetUniform1f("exposure", options.exposure);
+		denoiser.GetOutput().Bind(0);
+		previewTarget.GetColorMap(2).Bind(1);
+	}
+	else
+	{
+		previewDisplayProgram->Bind();
+		previewDisplayProgram->SetUniform1i("colorMap", 0);
+		previewDisplayProgram->SetUniform1f("exposure", options.exposure);
+		color->Bind(0);
+	}
+
+	vertexArrayObject.Draw(GL_TRIANGLES, 6);
+}
+
+void renderScene()
+{
+	glClearColor(0.0f, 0.5f, 1.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	textureLoader.Update(32 * 1024 * 1024);
+
+	shaderCompileQueue.Update();
+
+	shaderReloader.Update();
+
+	if (options.useCPU)
+	{
+		renderSceneCPU();
+		return;
+	}
+
+	updateVirtualTexture(SCR_WIDTH, SCR_HEIGHT, cameraPos, cameraTarget, cameraUp);
+
+	lightingCache.Update();
+
+	if (options.temporal || options.denoise)
+	{
+		renderScenePreview();
+		return;
+	}
+
+	drawPathTrace(getInteractiveProgram(), SCR_WIDTH, SCR_HEIGHT, cameraPos, cameraTarget, cameraUp, 0);
+}
+
+void destroyScene()
+{
+	if (options.useCPU)
+	{
+		destroyCPUScene();
+	}
+
+	denoiser.Destroy();
+
+	temporal.Destroy();
+
+	previewTarget.Destroy();
+
+	textureLoader.Destroy();
+
+	samplerTables.Destroy();
+
+	materialTable.Destroy();
+
+	virtualEnvMap.Destroy();
+
+	vtFeedbackTarget.Destroy();
+
+	vtFeedbackReadback.Destroy();
+
+	lightingCache.Destroy();
+
+	imageDenoiser.Destroy();
+
+	threadPool.Destroy();
+
+	if (!options.textureCache.empty())
+	{
+		std::cout << "TextureCache: " << textureCache.GetHits() << " hits, " << textureCache.GetMisses() << " misses" << std::endl;
+	}
+
+	materialTextures.Destroy();
+
+	materialLayers.Destroy();
+
+	envMap.Destroy();
+
+	vertexArrayObject.Destroy();
+
+	shaderReloader.Destroy();
+
+	shaderCompileQueue.Destroy();
+
+	shaderPrograms.Destroy();
+	pathTraceProgram = nullptr;
+	lightingPreviewProgram = nullptr;
+	lastInteractiveProgram = nullptr;
+}
+
+// the path tracer taking one sample per pass, for accumulating renders, with
+// squared radiance in a second output and, when denoising, the albedo and
+// normal guides in the third and fourth. Variants stay cached, so only a new
+// depth compiles.
+ShaderProgram* getProgressiveProgram(int depth)
+{
+	ShaderDefines defines;
+	getPathTraceDefines(defines);
+	defines.Set("NUM_SAMPLES", 1);
+	defines.Set("MAX_DEPTH", depth);
+	defines.Set("OUTPUT_MOMENTS");
+	if (options.denoise)
+		defines.Set("OUTPUT_GBUFFER");
+
+	return shaderPrograms.Get("PathTraceVS.glsl", "PathTracePS.glsl", defines);
+}
+
+// hashes what a GPU render depends on besides the view: the program's
+// sources, includes and defines, which hold the scene
+uint64_t getSceneKey(const ShaderProgram& program)
+{
+	std::string defines = program.GetDefines().GetKey();
+	uint64_t hash = HashFNV1a((const unsigned char*)defines.data(), defines.size());
+	for (auto& path : program.GetSourceFiles())
+	{
+		std::ifstream file(path.c_str(), std::ios::binary);
+		std::stringstream source;
+		source << file.rdbuf();
+		std::string text = source.str();
+		hash = HashFNV1a((const unsigned char*)text.data(), text.size(), hash);
+	}
+
+	return hash;
+}
+
+// blocks until every queued texture is decoded and uploaded
+void waitForTextures()
+{
+	while (textureLoader.GetPendingCount() > 0)
+	{
+		textureLoader.Update(~size_t(0));
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+// Keeps the context, compiled programs and textures of this process warm and
+// renders jobs sent over a Unix domain socket, one pass per Update() so the
+// socket stays responsive. Protocol, one line per message:
+//   render width=W height=H spp=N [depth=D] [seed=S] camera=px,py,pz,tx,ty,tz,ux,uy,uz output=PATH|-
+//     -> accepted ID, progress ID DONE SPP ..., then done ID PATH MS, for output=-
+//        preceded by image ID W H BYTES and the float RGB data, top row first
+//   cancel id=ID -> cancelled ID
+//   ping -> pong
+//   quit -> bye, the server exits
+// Failures answer error ID MESSAGE. A job renders pass i with frame index
+// seed + i, so the same job always gives the same image. An output ending in
+// .partial is written as a PartialImage for --merge.
+class RenderServer
+{
+public:
+	RenderServer()
+		: running(false)
+		, nextJobId(1)
+	{
+	}
+
+	~RenderServer()
+	{
+	}
+
+	bool Create(const char* path_)
+	{
+		if (!Socket::Startup() || !listener.Listen(path_))
+		{
+			std::cout << "RenderServer: failed to listen on " << path_ << std::endl;
+			return false;
+		}
+
+		std::cout << "RenderServer: listening on " << path_ << std::endl;
+		running = true;
+		imageOutput.Create(3, options.denoise ? &imageDenoiser : nullptr);
+
+		return true;
+	}
+
+	void Destroy()
+	{
+		for (auto& client : clients)
+			client->socket.Close();
+		clients.clear();
+		jobs.clear();
+
+		listener.Close();
+		imageOutput.Destroy();
+		progressive.Destroy();
+	}
+
+	// false once a client asked the server to quit
+	bool Update()
+	{
+		Poll(!jobs.empty() ? 0 : imageOutput.GetPendingCount() ? 1 : 50);
+
+		if (!jobs.empty())
+			RenderPass(jobs.front());
+
+		imageOutput.Update();
+
+		return running;
+	}
+private:
+	struct Client
+	{
+		Socket socket;
+	};
+
+	struct Job
+	{
+		int id = 0;
+		std::shared_ptr<Client> client;
+		int width = 0;
+		int height = 0;
+		int samplesPerPixel = 0;
+		unsigned int seed = 0;
+		int depth = 0;
+		float camera[9] = {};
+		std::string output;
+		ShaderProgram* program = nullptr;
+
+		int passesDone = 0;
+		std::chrono::steady_clock::time_point startTime;
+		std::chrono::steady_clock::time_point progressTime;
+	};
+
+	void Poll(int timeoutMs_)
+	{
+		std::vector<Socket*> sockets;
+		sockets.push_back(&listener);
+		for (auto& client : clients)
+			sockets.push_back(&client->socket);
+
+		std::vector<bool> readable;
+		if (Socket::Select(sockets, timeoutMs_, readable) <= 0)
+			return;
+
+		if (readable[0])
+		{
+			std::shared_ptr<Client> client(new Client);
+			if (listener.Accept(client->socket))
+				clients.push_back(client);
+		}
+
+		for (size_t i = 1; i < readable.size(); i++)
+		{
+			if (!readable[i])
+				continue;
+
+			std::shared_ptr<Client> client = clients[i - 1];
+			if (!client->socket.ReceiveAvailable())
+			{
+				Disconnect(client);
+				continue;
+			}
+
+			std::string line;
+			while (client->socket.PopLine(line))
+				HandleLine(client, line);
+		}
+
+		clients.erase(std::remove_if(clients.begin(), clients.end(), [](const std::shared_ptr<Client>& client) { return !client->socket.IsOpen(); }), clients.end());
+	}
+
+	void Disconnect(const std::shared_ptr<Client>& client_)
+	{
+		client_->socket.Close();
+
+		// nobody is left to receive them
+		jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&client_](const Job& job) { return job.client == client_; }), jobs.end());
+	}
+
+	void HandleLine(const std::shared_ptr<Client>& client_, const std::string& line_)
+	{
+		LineArguments args(line_);
+		if (args.GetCommand() == "ping")
+		{
+			client_->socket.SendLine("pong");
+		}
+		else if (args.GetCommand() == "quit")
+		{
+			client_->socket.SendLine("bye");
+			running = false;
+		}
+		else if (args.GetCommand() == "cancel")
+		{
+			int id = args.GetInt("id", 0);
+			size_t count = jobs.size();
+			jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [id, &client_](const Job& job) { return job.id == id && job.client == client_; }), jobs.end());
+			client_->socket.SendLine(count != jobs.size() ? "cancelled " + std::to_string(id) : "error " + std::to_string(id) + " no such job");
+		}
+		else if (args.GetCommand() == "render")
+		{
+			Job job;
+			job.id = nextJobId++;
+			job.client = client_;
+
+			std::string error;
+			if (!ParseJob(args, job, error))
+			{
+				client_->socket.SendLine("error " + std::to_string(job.id) + " " + error);
+				return;
+			}
+
+			jobs.push_back(job);
+			client_->socket.SendLine("accepted " + std::to_string(job.id));
+		}
+		else if (!args.GetCommand().empty())
+		{
+			client_->socket.SendLine("error 0 unknown command " + args.GetCommand());
+		}
+	}
+
+	bool ParseJob(const LineArguments& args_, Job& job_, std::string& error_)
+	{
+		job_.width = args_.GetInt("width", options.renderWidth);
+		job_.height = args_.GetInt("height", options.renderHeight);
+		job_.samplesPerPixel = args_.GetInt("spp", options.gpuSamples);
+		job_.seed = (unsigned int)args_.GetInt("seed", 0);
+		job_.output = args_.GetString("output");
+		int depth = args_.GetInt("depth", options.maxDepth);
+
+		if (job_.width < 1 || job_.height < 1 || job_.width > 16384 || job_.height > 16384)
+		{
+			error_ = "bad resolution";
+			return false;
+		}
+		if (job_.samplesPerPixel < 1 || depth < 1)
+		{
+			error_ = "bad spp or depth";
+			return false;
+		}
+		if (job_.output.empty())
+		{
+			error_ = "missing output";
+			return false;
+		}
+
+		const float defaultCamera[9] = { cameraPos[0], cameraPos[1], cameraPos[2], cameraTarget[0], cameraTarget[1], cameraTarget[2], cameraUp[0], cameraUp[1], cameraUp[2] };
+		memcpy(job_.camera, defaultCamera, sizeof(defaultCamera));
+		if (args_.Has("camera") && !args_.GetFloats("camera", job_.camera, 9))
+		{
+			error_ = "camera needs 9 values";
+			return false;
+		}
+
+		job_.depth = depth;
+		job_.program = getProgressiveProgram(depth);
+		if (!job_.program)
+		{
+			error_ = "shader build failed";
+			return false;
+		}
+
+		return true;
+	}
+
+	void RenderPass(Job& job_)
+	{
+		if (job_.passesDone == 0)
+		{
+			// a job must never see a placeholder texture
+			waitForTextures();
+			primeVirtualTexture(job_.width, job_.height, &job_.camera[0], &job_.camera[3], &job_.camera[6]);
+
+			if (progressive.GetWidth() != (unsigned int)job_.width || progressive.GetHeight() != (unsigned int)job_.height)
+			{
+				progressive.Destroy();
+				if (!progressive.Create(job_.width, job_.height, options.denoise))
+				{
+					job_.client->socket.SendLine("error " + std::to_string(job_.id) + " target allocation failed");
+					jobs.pop_front();
+					return;
+				}
+			}
+			progressive.Reset();
+
+			job_.startTime = std::chrono::steady_clock::now();
+			job_.progressTime = job_.startTime;
+		}
+
+		progressive.BeginPass();
+		drawPathTrace(job_.program, job_.width, job_.height, &job_.camera[0], &job_.camera[3], &job_.camera[6], job_.seed + job_.passesDone);
+		progressive.EndPass();
+		job_.passesDone++;
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		bool finished = job_.passesDone == job_.samplesPerPixel;
+		if (finished || now - job_.progressTime > std::chrono::milliseconds(250))
+		{
+			job_.client->socket.SendLine("progress " + std::to_string(job_.id) + " " + std::to_string(job_.passesDone) + " " + std::to_string(job_.samplesPerPixel));
+			job_.progressTime = now;
+		}
+
+		if (!finished)
+			return;
+
+		long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - job_.startTime).count();
+		std::string id = std::to_string(job_.id);
+
+		// image files are read back and encoded while the next job renders
+		if (job_.output != "-" && !HasExtension(job_.output, ".partial"))
+		{
+			std::shared_ptr<Client> client = job_.client;
+			std::string output = job_.output;
+			imageOutput.Submit(progressive.GetTarget(), output, [client, id, output, ms](bool written)
+			{
+				if (written)
+					client->socket.SendLine("done " + id + " " + output + " " + std::to_string(ms));
+				else
+					client->socket.SendLine("error " + id + " failed to write " + output);
+			});
+
+			jobs.pop_front();
+			return;
+		}
+
+		std::vector<float> rgb;
+		std::vector<float> squares;
+		progressive.Read(rgb, 0, 0, job_.width, job_.height, &squares);
+
+		if (HasExtension(job_.output, ".partial"))
+		{
+			PartialImage partial;
+			partial.Create(job_.width, job_.height, true, MakeRenderKey(job_.width, job_.height, job_.camera, "depth=" + std::to_string(job_.depth)));
+			partial.AddRegion(0, 0, job_.width, job_.height, rgb.data(), squares.data(), job_.samplesPerPixel);
+			partial.AddRange(job_.seed, job_.samplesPerPixel);
+
+			if (partial.Write(job_.output.c_str()))
+				job_.client->socket.SendLine("done " + id + " " + job_.output + " " + std::to_string(ms));
+			else
+				job_.client->socket.SendLine("error " + id + " failed to write " + job_.output);
+		}
+		else
+		{
+			size_t bytes = rgb.size() * sizeof(float);
+			job_.client->socket.SendLine("image " + id + " " + std::to_string(job_.width) + " " + std::to_string(job_.height) + " " + std::to_string(bytes));
+			job_.client->socket.Send(rgb.data(), bytes);
+			job_.client->socket.SendLine("done " + id + " - " + std::to_string(ms));
+		}
+
+		jobs.pop_front();
+	}
+private:
+	bool running;
+	int nextJobId;
+	Socket listener;
+	std::vector<std::shared_ptr<Client>> clients;
+	std::deque<Job> jobs;
+	ProgressiveRenderer progressive;
+	ImageOutputQueue imageOutput;
+};
+
+RenderServer renderServer;
+
+// renders a region of a width x height frame on the CPU backend, y counted from
+// the top. Sample i is seeded with frame index first + i like a GPU pass.
+// squares receives the mean squared radiance, albedo and normal the averaged
+// first hit guides of the denoiser.
+void renderRegionCPU(const RenderTileRequest& request, std::vector<float>& rgb, std::vector<float>* squares = nullptr,
+	std::vector<float>* albedo = nullptr, std::vector<float>* normal = nullptr)
+{
+	Camera camera = CameraSet(Vector3(request.camera[0], request.camera[1], request.camera[2]),
+		Vector3(request.camera[3], request.camera[4], request.camera[5]),
+		Vector3(request.camera[6], request.camera[7], request.camera[8]), 90.0f, float(request.width) / float(request.height));
+
+	rgb.assign(size_t(request.w) * request.h * 3, 0.0f);
+	if (squares)
+		squares->assign(rgb.size(), 0.0f);
+	if (albedo)
+		albedo->assign(rgb.size(), 0.0f);
+	if (normal)
+		normal->assign(rgb.size(), 0.0f);
+	bool guides = albedo || normal;
+
+	std::atomic<int> nextRow(0);
+	int remaining = (int)threadPool.GetThreadCount();
+	std::mutex mutex;
+	std::condition_variable done;
+	for (unsigned int t = 0; t < threadPool.GetThreadCount(); t++)
+	{
+		threadPool.Enqueue([&]()
+		{
+			for (int row = nextRow++; row < request.h; row = nextRow++)
+			{
+				int y = request.height - 1 - (request.y + row); // rows count up from the bottom, like gl_FragCoord
+				for (int column = 0; column < request.w; column++)
+				{
+					int x = request.x + column;
+					Vector3 col(0.0f, 0.0f, 0.0f);
+					Vector3 colSquared(0.0f, 0.0f, 0.0f);
+					Vector3 albedoSum(0.0f, 0.0f, 0.0f);
+					Vector3 normalSum(0.0f, 0.0f, 0.0f);
+					for (int i = 0; i < request.samples; i++)
+					{
+						SamplerBegin(x, y, request.width, request.first + i);
+						float u = (x + GetUniform()) / request.width;
+						float v = (y + GetUniform()) / request.height;
+						PrimaryHit primary;
+						Vector3 sample = WorldTrace(cpuScene, CameraGetRay(camera, u, v), request.depth, guides ? &primary : nullptr);
+						col += sample;
+						colSquared += sample * sample;
+						if (guides)
+						{
+							albedoSum += primary.albedo;
+							normalSum += primary.normal;
+						}
+					}
+					col = col / float(request.samples);
+					colSquared = colSquared / float(request.samples);
+
+					size_t dst = (size_t(row) * request.w + column) * 3;
+					rgb[dst + 0] = col.x;
+					rgb[dst + 1] = col.y;
+					rgb[dst + 2] = col.z;
+					if (squares)
+					{
+						(*squares)[dst + 0] = colSquared.x;
+						(*squares)[dst + 1] = colSquared.y;
+						(*squares)[dst + 2] = colSquared.z;
+					}
+					if (albedo)
+					{
+						albedoSum = albedoSum / float(request.samples);
+						(*albedo)[dst + 0] = albedoSum.x;
+						(*albedo)[dst + 1] = albedoSum.y;
+						(*albedo)[dst + 2] = albedoSum.z;
+					}
+					if (normal)
+					{
+						float length = sqrtf(dot(normalSum, normalSum));
+						if (length > 0.0f)
+							normalSum = normalSum / length;
+						(*normal)[dst + 0] = normalSum.x;
+						(*normal)[dst + 1] = normalSum.y;
+						(*normal)[dst + 2] = normalSum.z;
+					}
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--remaining == 0)
+				done.notify_one();
+		});
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&remaining]() { return remaining == 0; });
+}
+
+// worker side of RenderCoordinator, renders tiles until the coordinator is done
+bool runRenderWorker(const char* address)
+{
+	std::string host = address;
+	size_t colon = host.rfind(':');
+	if (colon == std::string::npos)
+	{
+		std::cout << "--worker takes HOST:PORT" << std::endl;
+		return false;
+	}
+	int port = atoi(host.c_str() + colon + 1);
+	host.resize(colon);
+
+	Socket coordinator;
+	if (!Socket::Startup() || !coordinator.ConnectTCP(host.c_str(), port))
+	{
+		std::cout << "RenderWorker: failed to connect to " << address << std::endl;
+		return false;
+	}
+
+	coordinator.SendLine(options.useCPU ? "hello backend=cpu" : "hello backend=gpu");
+	waitForTextures();
+
+	ProgressiveRenderer progressive;
+	std::string line;
+	bool success = true;
+	while (coordinator.ReceiveLine(line))
+	{
+		LineArguments args(line);
+		if (args.GetCommand() == "bye")
+			break;
+
+		RenderTileRequest request;
+		if (args.GetCommand() != "tile" || !request.Parse(args))
+		{
+			std::cout << "RenderWorker: bad request " << line << std::endl;
+			success = false;
+			break;
+		}
+
+		std::vector<float> rgb;
+		if (options.useCPU)
+		{
+			renderRegionCPU(request, rgb);
+		}
+		else
+		{
+			ShaderProgram* program = getProgressiveProgram(request.depth);
+			if (!program)
+			{
+				success = false;
+				break;
+			}
+
+			if (progressive.GetWidth() != (unsigned int)request.width || progressive.GetHeight() != (unsigned int)request.height)
+			{
+				progressive.Destroy();
+				if (!progressive.Create(request.width, request.height))
+				{
+					success = false;
+					break;
+				}
+			}
+			progressive.Reset();
+
+			primeVirtualTexture(request.width, request.height, &request.camera[0], &request.camera[3], &request.camera[6]);
+			for (int i = 0; i < request.samples; i++)
+			{
+				progressive.BeginPass(request.x, request.y, request.w, request.h);
+				drawPathTrace(program, request.width, request.height, &request.camera[0], &request.camera[3], &request.camera[6], request.first + i);
+				progressive.EndPass();
+			}
+			progressive.Read(rgb, request.x, request.y, request.w, request.h);
+		}
+
+		size_t bytes = rgb.size() * sizeof(float);
+		if (!coordinator.SendLine("result id=" + std::to_string(request.id) + " samples=" + std::to_string(request.samples) + " bytes=" + std::to_string(bytes)) ||
+			!coordinator.Send(rgb.data(), bytes))
+		{
+			break;
+		}
+	}
+
+	progressive.Destroy();
+	coordinator.Close();
+
+	return success;
+}
+
+// the coordinator needs no GL context, it only merges what workers send
+bool runRenderCoordinator()
+{
+	const float camera[9] = { cameraPos[0], cameraPos[1], cameraPos[2], cameraTarget[0], cameraTarget[1], cameraTarget[2], cameraUp[0], cameraUp[1], cameraUp[2] };
+
+	RenderCoordinator coordinator;
+	if (!coordinator.Create(options.coordinatorPort, options.renderWidth, options.renderHeight, options.tileSize, options.gpuSamples, options.sampleSplit, options.maxDepth, camera, options.workerTimeout))
 	{
 		return false;
 	}
 
-	if (!envMap.Create("../assets/envmap6.jpg"))
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	coordinator.Run();
+	long long seconds = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count();
+
+	bool written;
+	if (HasExtension(options.output, ".partial"))
+	{
+		written = coordinator.GetPartialImage().Write(options.output.c_str());
+	}
+	else
+	{
+		std::vector<float> rgb;
+		coordinator.GetPartialImage().Resolve(rgb);
+		written = WriteImage(options.output.c_str(), options.renderWidth, options.renderHeight, rgb.data());
+	}
+	coordinator.Destroy();
+
+	if (!written)
 	{
+		std::cout << "RenderCoordinator: failed to write " << options.output << std::endl;
 		return false;
 	}
 
+	std::cout << "RenderCoordinator: wrote " << options.output << " in " << seconds << "s" << std::endl;
+
 	return true;
 }
 
-void renderScene()
+// the --denoise stage of offline renders, replaces rgb by its denoised version
+void denoiseOutput(int width, int height, std::vector<float>& rgb, const std::vector<float>& squares, int samples,
+	const std::vector<float>& albedo, const std::vector<float>& normal)
 {
-	glClearColor(0.0f, 0.5f, 1.0f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
+	std::vector<float> variance(rgb.size());
+	for (size_t i = 0; i < rgb.size(); i++)
+		variance[i] = ImageDenoiser::GetMeanVariance(rgb[i], squares[i], (float)samples);
+
+	std::vector<float> denoised(rgb.size());
+	imageDenoiser.Apply(width, height, rgb.data(), variance.data(), albedo.data(), normal.data(), denoised.data());
+	rgb.swap(denoised);
+}
+
+// renders samples [first, first + gpuSamples) of the whole frame in this process
+// on the GPU or the CPU backend. A .partial output keeps sums and moments for
+// --merge, anything else is written as an image, denoised with --denoise.
+bool runRender()
+{
+	RenderTileRequest request;
+	request.x = 0;
+	request.y = 0;
+	request.w = request.width = options.renderWidth;
+	request.h = request.height = options.renderHeight;
+	request.first = options.firstSample;
+	request.samples = options.gpuSamples;
+	request.depth = options.maxDepth;
+	const float camera[9] = { cameraPos[0], cameraPos[1], cameraPos[2], cameraTarget[0], cameraTarget[1], cameraTarget[2], cameraUp[0], cameraUp[1], cameraUp[2] };
+	memcpy(request.camera, camera, sizeof(request.camera));
+
+	waitForTextures();
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<float> rgb;
+	std::vector<float> squares;
+	std::vector<float> albedo;
+	std::vector<float> normal;
+	bool denoise = options.denoise && !HasExtension(options.output, ".partial");
+	if (options.useCPU)
+	{
+		renderRegionCPU(request, rgb, &squares, denoise ? &albedo : nullptr, denoise ? &normal : nullptr);
+	}
+	else
+	{
+		ShaderProgram* program = getProgressiveProgram(request.depth);
+		ProgressiveRenderer progressive;
+		if (!program || !progressive.Create(request.width, request.height, denoise))
+		{
+			return false;
+		}
 
-	shaderProgram.Bind();
-	shaderProgram.SetUniform1i("diffuseMap", 0);
-	shaderProgram.SetUniform1i("specularMap", 1);
-	shaderProgram.SetUniform1i("envMap", 2);
-	shaderProgram.SetUniform2f("screenSize", SCR_WIDTH, SCR_HEIGHT);
+		char scene[32];
+		snprintf(scene, sizeof(scene), " scene=%016llx", (unsigned long long)getSceneKey(*program));
+		uint64_t renderKey = MakeRenderKey(request.width, request.height, request.camera, "depth=" + std::to_string(request.depth) + scene);
 
-	shaderProgram.SetUniform3f("cameraPos", cameraPos[0], cameraPos[1], cameraPos[2]);
-	shaderProgram.SetUniform3f("cameraTarget", cameraTarget[0], cameraTarget[1], cameraTarget[2]);
-	shaderProgram.SetUniform3f("cameraUp", cameraUp[0], cameraUp[1], cameraUp[2]);
+		// a render preempted before its first checkpoint simply starts over
+		RenderCheckpoint checkpoint;
+		if (options.resume && !std::ifstream(options.checkpointPath.c_str()))
+		{
+			std::cout << "Render: no checkpoint at " << options.checkpointPath << ", starting from the first sample" << std::endl;
+		}
+		else if (options.resume)
+		{
+			if (!checkpoint.Read(options.checkpointPath.c_str()))
+			{
+				std::cout << "Render: failed to read checkpoint " << options.checkpointPath << std::endl;
+				progressive.Destroy();
+				return false;
+			}
+			if (checkpoint.renderKey != renderKey || checkpoint.width != request.width || checkpoint.height != request.height || checkpoint.firstSample != request.first)
+			{
+				std::cout << "Render: " << options.checkpointPath << " is a checkpoint of another scene, view, size, depth or first sample" << std::endl;
+				progressive.Destroy();
+				return false;
+			}
 
-	vertexArrayObject.Bind();
+			progressive.Restore(checkpoint.sums, checkpoint.moments, checkpoint.passCount);
+			std::cout << "Render: resuming after " << checkpoint.passCount << " samples" << std::endl;
+		}
 
-	diffuseMap.Bind(0);
-	specularMap.Bind(1);
-	envMap.Bind(2);
+		CheckpointWriter writer;
+		if (!options.checkpointPath.empty())
+			writer.Create(options.checkpointPath);
 
-	vertexArrayObject.Draw(GL_TRIANGLES, 6);
+		primeVirtualTexture(request.width, request.height, &request.camera[0], &request.camera[3], &request.camera[6]);
+
+		std::chrono::steady_clock::time_point checkpointTime = std::chrono::steady_clock::now();
+		for (int i = progressive.GetPassCount(); i < request.samples; i++)
+		{
+			progressive.BeginPass();
+			drawPathTrace(program, request.width, request.height, &request.camera[0], &request.camera[3], &request.camera[6], request.first + i);
+			progressive.EndPass();
+
+			if (options.checkpointPath.empty())
+				continue;
+
+			// the readback overlaps the passes that follow it
+			if (progressive.IsSnapshotPending())
+			{
+				if (progressive.IsSnapshotReady())
+				{
+					checkpoint.width = request.width;
+					checkpoint.height = request.height;
+					checkpoint.firstSample = request.first;
+					checkpoint.renderKey = renderKey;
+					checkpoint.passCount = progressive.ReadSnapshot(checkpoint.sums, checkpoint.moments);
+					writer.Submit(checkpoint);
+				}
+			}
+			else if (std::chrono::steady_clock::now() - checkpointTime > std::chrono::seconds(options.checkpointInterval))
+			{
+				progressive.BeginSnapshot();
+				checkpointTime = std::chrono::steady_clock::now();
+			}
+		}
+		progressive.Read(rgb, 0, 0, request.width, request.height, &squares);
+		if (denoise)
+			progressive.ReadGuides(albedo, normal);
+		progressive.Destroy();
+		writer.Destroy();
+	}
+	long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+	if (denoise)
+	{
+		start = std::chrono::steady_clock::now();
+		denoiseOutput(request.width, request.height, rgb, squares, request.samples, albedo, normal);
+		long long denoiseMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Render: denoised in " << denoiseMs << "ms" << std::endl;
+	}
+
+	bool written;
+	if (HasExtension(options.output, ".partial"))
+	{
+		PartialImage partial;
+		partial.Create(request.width, request.height, true, MakeRenderKey(request.width, request.height, request.camera, "depth=" + std::to_string(request.depth)));
+		partial.AddRegion(0, 0, request.width, request.height, rgb.data(), squares.data(), request.samples);
+		partial.AddRange(request.first, request.samples);
+		written = partial.Write(options.output.c_str());
+	}
+	else
+	{
+		written = WriteImage(options.output.c_str(), request.width, request.height, rgb.data());
+	}
+
+	if (!written)
+	{
+		std::cout << "Render: failed to write " << options.output << std::endl;
+		return false;
+	}
+
+	// the output holds everything the checkpoint did
+	if (!options.checkpointPath.empty())
+		std::remove(options.checkpointPath.c_str());
+
+	std::cout << "Render: samples " << request.first << "-" << request.first + request.samples - 1 << " written to " << options.output << " in " << ms << "ms" << std::endl;
+
+	return true;
 }
 
-void destroyScene()
+// true for an output path with one integer conversion for the frame number, like frame_%04d.png
+bool isFramePattern(const std::string& pattern)
 {
-	diffuseMap.Destroy();
+	size_t percent = pattern.find('%');
+	if (percent == std::string::npos || pattern.find('%', percent + 1) != std::string::npos)
+		return false;
 
-	specularMap.Destroy();
+	size_t conversion = pattern.find_first_not_of("0123456789", percent + 1);
+	return conversion != std::string::npos && pattern[conversion] == 'd';
+}
 
-	vertexArrayObject.Destroy();
+// Renders every frame of --animate with gpu-spp samples each, frame f taking
+// frame indices first + f * spp onwards. On the GPU the readback and encoding
+// of a frame overlap the passes of the next, so the GPU never waits for them.
+bool runAnimation()
+{
+	Animation animation;
+	if (!animation.Load(options.animationPath.c_str()))
+	{
+		return false;
+	}
+
+	if (!isFramePattern(options.output))
+	{
+		std::cout << "Animation: --output needs a frame number pattern like frame_%04d.png" << std::endl;
+		return false;
+	}
+
+	int frameCount = options.frameCount ? options.frameCount : animation.GetFrameCount();
+	int width = options.renderWidth;
+	int height = options.renderHeight;
+
+	waitForTextures();
+
+	ShaderProgram* program = nullptr;
+	ProgressiveRenderer progressive;
+	ImageOutputQueue imageOutput;
+	if (!options.useCPU)
+	{
+		program = getProgressiveProgram(options.maxDepth);
+		if (!program || !progressive.Create(width, height, options.denoise))
+		{
+			return false;
+		}
+		imageOutput.Create(3, options.denoise ? &imageDenoiser : nullptr);
+	}
+
+	int failures = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frameCount; frame++)
+	{
+		float camera[9];
+		animation.Evaluate((float)frame, camera, sphereTransforms);
+		unsigned int first = options.firstSample + (unsigned int)frame * options.gpuSamples;
+
+		char path[1024];
+		snprintf(path, sizeof(path), options.output.c_str(), frame);
+
+		if (options.useCPU)
+		{
+			cpuScene.world = WorldConstructor();
+			WorldTransform(cpuScene.world, sphereTransforms);
+
+			RenderTileRequest request;
+			request.w = request.width = width;
+			request.h = request.height = height;
+			request.first = first;
+			request.samples = options.gpuSamples;
+			request.depth = options.maxDepth;
+			memcpy(request.camera, camera, sizeof(request.camera));
+
+			std::vector<float> rgb;
+			std::vector<float> squares;
+			std::vector<float> albedo;
+			std::vector<float> normal;
+			if (options.denoise)
+			{
+				renderRegionCPU(request, rgb, &squares, &albedo, &normal);
+				denoiseOutput(width, height, rgb, squares, request.samples, albedo, normal);
+			}
+			else
+			{
+				renderRegionCPU(request, rgb);
+			}
+			if (!WriteImage(path, width, height, rgb.data()))
+			{
+				std::cout << "Animation: failed to write " << path << std::endl;
+				failures++;
+			}
+		}
+		else
+		{
+			progressive.Reset();
+			primeVirtualTexture(width, height, &camera[0], &camera[3], &camera[6]);
+			for (int i = 0; i < options.gpuSamples; i++)
+			{
+				progressive.BeginPass();
+				drawPathTrace(program, width, height, &camera[0], &camera[3], &camera[6], first + i);
+				progressive.EndPass();
+
+				imageOutput.Update();
+			}
+
+			// the next frame's passes queue up behind this copy, not behind its encoding
+			std::string output = path;
+			imageOutput.Submit(progressive.GetTarget(), output, [output, &failures](bool written)
+			{
+				if (!written)
+				{
+					std::cout << "Animation: failed to write " << output << std::endl;
+					failures++;
+				}
+			});
+		}
+
+		std::cout << "Animation: frame " << frame + 1 << "/" << frameCount << " " << path << std::endl;
+	}
+
+	imageOutput.Destroy();
+	progressive.Destroy();
+
+	long long seconds = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Animation: " << frameCount << " frames in " << seconds << "s" << std::endl;
+
+	return failures == 0;
+}
+
+// merges partial images in any order, needs no GL context
+bool runMerge()
+{
+	PartialImage merged;
+	for (size_t i = 0; i < options.mergeInputs.size(); i++)
+	{
+		const char* path = options.mergeInputs[i].c_str();
+
+		PartialImage partial;
+		if (!partial.Read(path))
+		{
+			std::cout << "Merge: failed to read " << path << std::endl;
+			return false;
+		}
+
+		if (i == 0)
+		{
+			merged = std::move(partial);
+			continue;
+		}
+
+		bool overlapping;
+		if (!merged.Merge(partial, overlapping))
+		{
+			std::cout << "Merge: " << path << " is a render of another size, view or depth" << std::endl;
+			return false;
+		}
+		if (overlapping)
+		{
+			std::cout << "Merge: " << path << " reuses sample indices, its samples are correlated with earlier inputs" << std::endl;
+		}
+	}
+
+	unsigned int minSamples, maxSamples;
+	merged.GetSampleCountRange(minSamples, maxSamples);
+	std::cout << "Merge: " << options.mergeInputs.size() << " partials, " << minSamples << "-" << maxSamples << " samples per pixel" << std::endl;
+
+	if (HasExtension(options.mergeOutput, ".partial"))
+	{
+		if (!merged.Write(options.mergeOutput.c_str()))
+		{
+			std::cout << "Merge: failed to write " << options.mergeOutput << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	std::vector<float> rgb;
+	merged.Resolve(rgb);
+	if (!WriteImage(options.mergeOutput.c_str(), merged.GetWidth(), merged.GetHeight(), rgb.data()))
+	{
+		std::cout << "Merge: failed to write " << options.mergeOutput << std::endl;
+		return false;
+	}
+
+	std::vector<float> variance;
+	if (merged.ResolveVariance(variance))
+	{
+		double error = 0.0;
+		for (float v : variance)
+			error += sqrt(v);
+		std::cout << "Merge: mean standard error " << error / variance.size() << std::endl;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// --self-test: numeric checks of the CPU sampling code, which the GLSL mirrors
+// line by line. Each check prints its figures and whether it passed.
+
+// checks that a pdf over the sphere integrates to 1, and that the directions
+// sampled from it land in coarse cos theta x phi bins as often as the pdf says
+bool checkSampling(const char* name_, const std::function<Vector3(float, float)>& sample_, const std::function<float(const Vector3&)>& pdf_)
+{
+	const int binsTheta = 16;
+	const int binsPhi = 32;
+	const int cells = 64;			// midpoint rule cells per bin side
+	const int sampleCount = 4000000;
+
+	// cells of equal solid angle, d(omega) = d(cos theta) d(phi)
+	std::vector<double> expected(binsTheta * binsPhi, 0.0);
+	double cellArea = (2.0 / (binsTheta * cells)) * (2.0 * PI / (binsPhi * cells));
+	double integral = 0.0;
+	for (int i = 0; i < binsTheta * cells; i++)
+	{
+		float z = 1.0f - 2.0f * (i + 0.5f) / (binsTheta * cells);
+		float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+		for (int j = 0; j < binsPhi * cells; j++)
+		{
+			float phi = 2.0f * PI * (j + 0.5f) / (binsPhi * cells);
+			double p = pdf_(Vector3(r * cosf(phi), r * sinf(phi), z)) * cellArea;
+			expected[(i / cells) * binsPhi + j / cells] += p;
+			integral += p;
+		}
+	}
+
+	// independent of the sampler under test
+	std::mt19937 generator(1);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	std::vector<double> observed(expected.size(), 0.0);
+	for (int k = 0; k < sampleCount; k++)
+	{
+		float u1 = uniform(generator);
+		float u2 = uniform(generator);
+		Vector3 d = sample_(u1, u2);
+		float phi = atan2f(d.y, d.x);
+		if (phi < 0.0f)
+			phi += 2.0f * PI;
+		int i = std::min(std::max(int((1.0f - d.z) * 0.5f * binsTheta), 0), binsTheta - 1);
+		int j = std::min(int(phi / (2.0f * PI) * binsPhi), binsPhi - 1);
+		observed[i * binsPhi + j] += 1.0 / sampleCount;
+	}
+
+	// total variation distance, about 0.005 from the sample count alone at this bin count
+	double distance = 0.0;
+	for (size_t i = 0; i < expected.size(); i++)
+		distance += 0.5 * fabs(observed[i] - expected[i]);
+
+	bool passed = fabs(integral - 1.0) < 0.005 && distance < 0.01;
+	std::cout << "Self test: " << name_ << ": pdf integral " << integral << ", histogram distance " << distance << (passed ? "" : ", FAILED") << std::endl;
+	return passed;
+}
+
+// white furnace of the GGX conductor: with F0 = 1 the mean weight of
+// MetallicScatter is its single scattering albedo, which is also the
+// integral of D G2 / (4 cos theta_o) over the upper hemisphere
+bool checkFurnace(float roughness_, float cosine_)
+{
+	const int cells = 2048;			// midpoint rule cells per side
+	const int sampleCount = 1000000;
+
+	float alpha = roughness_ * roughness_;
+	Vector3 wo(sqrtf(1.0f - cosine_ * cosine_), 0.0f, cosine_);
+	double cellArea = (1.0 / cells) * (2.0 * PI / cells);
+	double integrated = 0.0;
+	for (int i = 0; i < cells; i++)
+	{
+		float z = (i + 0.5f) / cells;
+		float r = sqrtf(1.0f - z * z);
+		for (int j = 0; j < cells; j++)
+		{
+			float phi = 2.0f * PI * (j + 0.5f) / cells;
+			Vector3 wi(r * cosf(phi), r * sinf(phi), z);
+			Vector3 h = normalize(wo + wi);
+			integrated += GGXD(h, alpha) * GGXG2(wo, wi, alpha) / (4.0f * wo.z) * cellArea;
+		}
+	}
+
+	Metallic metallic = MetallicConstructor(Vector3(1.0f, 1.0f, 1.0f), roughness_);
+	HitRecord hitRecord;
+	hitRecord.position = Vector3(0.0f, 0.0f, 0.0f);
+	hitRecord.normal = Vector3(0.0f, 0.0f, 1.0f);
+	Ray incident = RayConstructor(Vector3(0.0f, 0.0f, 0.0f), -wo);
+	double sampled = 0.0;
+	for (int k = 0; k < sampleCount; k++)
+	{
+		SamplerBegin(k, 0, sampleCount, 0);
+		Ray scattered;
+		Vector3 attenuation;
+		if (MetallicScatter(metallic, incident, hitRecord, scattered, attenuation))
+			sampled += attenuation.x / sampleCount;
+	}
+
+	// the weights lie in [0, 1], so the standard error is below 0.0005
+	bool passed = fabs(sampled - integrated) < 0.003;
+	std::cout << "Self test: GGX furnace roughness " << roughness_ << " cos " << cosine_ << ": sampled " << sampled << ", integrated " << integrated << (passed ? "" : ", FAILED") << std::endl;
+	return passed;
+}
+
+// the mean squared error of a samples_ spp CPU render with the given sampler
+// against reference_, which is rendered from other sample indices
+double measureSamplerError(SamplerTables::Type type_, const RenderTileRequest& request_, int samples_, const std::vector<float>& reference_)
+{
+	samplerTables.Create(type_);
+
+	RenderTileRequest request = request_;
+	request.first = 0;
+	request.samples = samples_;
+	std::vector<float> rgb;
+	renderRegionCPU(request, rgb);
+
+	double error = 0.0;
+	for (size_t i = 0; i < rgb.size(); i++)
+		error += double(rgb[i] - reference_[i]) * (rgb[i] - reference_[i]);
+
+	return error / rgb.size();
+}
+
+// Sobol against random on a 120x60 CPU render of the untextured scene from the
+// current camera, at 64 spp against a 2048 spp reference
+bool checkSamplerConvergence()
+{
+	if (!cpuEnvMap.Create("../assets/envmap6.jpg"))
+	{
+		std::cout << "Self test: failed to load the environment map" << std::endl;
+		return false;
+	}
+	if (!threadPool.Create(0))
+	{
+		return false;
+	}
+	InitScene(cpuScene, &cpuEnvMap);
+
+	RenderTileRequest request;
+	request.w = request.width = 120;
+	request.h = request.height = 60;
+	request.depth = 10;
+	const float camera[9] = { cameraPos[0], cameraPos[1], cameraPos[2], cameraTarget[0], cameraTarget[1], cameraTarget[2], cameraUp[0], cameraUp[1], cameraUp[2] };
+	memcpy(request.camera, camera, sizeof(request.camera));
+
+	samplerTables.Create(SamplerTables::RANDOM);
+	RenderTileRequest referenceRequest = request;
+	referenceRequest.first = 100000;
+	referenceRequest.samples = 2048;
+	std::vector<float> reference;
+	renderRegionCPU(referenceRequest, reference);
+
+	double randomError = measureSamplerError(SamplerTables::RANDOM, request, 64, reference);
+	double sobolError = measureSamplerError(SamplerTables::SOBOL, request, 64, reference);
+	threadPool.Destroy();
+
+	bool passed = sobolError < randomError;
+	std::cout << "Self test: 64 spp MSE against 2048 spp: random " << randomError << ", sobol " << sobolError << (passed ? "" : ", FAILED") << std::endl;
+	return passed;
+}
+
+bool runSelfTest()
+{
+	bool passed = true;
+
+	passed &= checkSampling("uniform sphere", SampleUniformSphere, [](const Vector3&) { return UniformSpherePdf(); });
+	passed &= checkSampling("cosine hemisphere", SampleCosineHemisphere, [](const Vector3& l) { return CosineHemispherePdf(l.z); });
+
+	// VNDF reflections, the pdf of a reflected direction through its half vector
+	const float alphas[] = { 0.1f, 0.4f, 1.0f };
+	const float cosines[] = { 0.9f, 0.3f };
+	for (float alpha : alphas)
+	{
+		for (float cosine : cosines)
+		{
+			Vector3 wo(sqrtf(1.0f - cosine * cosine), 0.0f, cosine);
+			std::string name = "GGX reflection alpha " + std::to_string(alpha).substr(0, 3) + " cos " + std::to_string(cosine).substr(0, 3);
+			passed &= checkSampling(name.c_str(),
+				[&](float u1, float u2) { return reflect(-wo, SampleGGXVNDF(wo, alpha, u1, u2)); },
+				[&](const Vector3& l) { return GGXReflectionPdf(wo, l, alpha); });
+		}
+	}
+
+	// energy lost to multiple scattering is not compensated, so rough surfaces stay below 1
+	const float roughnesses[] = { 0.3f, 0.6f, 1.0f };
+	samplerTables.Create(SamplerTables::RANDOM);
+	for (float roughness : roughnesses)
+	{
+		for (float cosine : cosines)
+			passed &= checkFurnace(roughness, cosine);
+	}
+
+	passed &= checkSamplerConvergence();
+
+	std::cout << (passed ? "Self test: passed" : "Self test: FAILED") << std::endl;
+	return passed;
+}
+
+// server mode main loop body, false once a client sent quit
+bool serveScene()
+{
+	textureLoader.Update(32 * 1024 * 1024);
+
+	shaderCompileQueue.Update();
 
-	shaderProgram.Destroy();
+	shaderReloader.Update();
+
+	return renderServer.Update();
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+	if (!parseOptions(argc, argv))
+	{
+		return -1;
+	}
+
+	if (options.selfTest)
+	{
+		return runSelfTest() ? 0 : -1;
+	}
+
+	if (!options.mergeOutput.empty())
+	{
+		return runMerge() ? 0 : -1;
+	}
+
+	if (options.coordinatorPort)
+	{
+		return runRenderCoordinator() ? 0 : -1;
+	}
+
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -655,6 +11223,10 @@ int main()
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
 
+	// servers, workers and batch renders draw offscreen only
+	if (isHeadless())
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
 	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
 	if (window == NULL)
 	{
@@ -680,6 +11252,57 @@ int main()
 		return -1;
 	}
 
+	if (options.hotReload && !shaderReloader.Create(window))
+	{
+		std::cout << "Failed to watch shader files, hot reload disabled" << std::endl;
+	}
+
+	if (!options.animationPath.empty())
+	{
+		bool success = runAnimation();
+
+		destroyScene();
+		glfwTerminate();
+
+		return success ? 0 : -1;
+	}
+
+	if (options.render)
+	{
+		bool success = runRender();
+
+		destroyScene();
+		glfwTerminate();
+
+		return success ? 0 : -1;
+	}
+
+	if (!options.workerAddress.empty())
+	{
+		bool success = runRenderWorker(options.workerAddress.c_str());
+
+		destroyScene();
+		glfwTerminate();
+
+		return success ? 0 : -1;
+	}
+
+	if (!options.serverSocket.empty())
+	{
+		bool listening = renderServer.Create(options.serverSocket.c_str());
+		if (listening)
+		{
+			while (serveScene())
+				glfwPollEvents();
+		}
+
+		renderServer.Destroy();
+		destroyScene();
+		glfwTerminate();
+
+		return listening ? 0 : -1;
+	}
+
 	while (!glfwWindowShouldClose(window))
 	{
 		processInput(window);